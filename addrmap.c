@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include "addrmap.h"
+/* See addrmap.h for usage information */
+
+#define ADDRMAP_MIN_CAP 64
+
+/* ip and port packed into one word. bit 48 is always set so a real
+* address never collides with the empty marker. */
+static uint64_t addr_key(const struct sockaddr_in *addr) {
+    return (1ULL << 48) | ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+static uint32_t key_slot(uint64_t key, uint32_t cap) {
+    // fibonacci hashing, the top bits are the well mixed ones
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+void addrmap_init(struct addrmap *m) {
+    m->slots = NULL;
+    m->cap = 0;
+    m->count = 0;
+}
+
+void addrmap_free(struct addrmap *m) {
+    free(m->slots);
+    addrmap_init(m);
+}
+
+static void insert_slot(struct addrmap_slot *slots, uint32_t cap, uint64_t key, void *value) {
+    uint32_t i = key_slot(key, cap);
+    while (slots[i].key != 0 && slots[i].key != key) {
+        i = (i + 1) & (cap - 1);
+    }
+    slots[i].key = key;
+    slots[i].value = value;
+}
+
+static int grow(struct addrmap *m) {
+    uint32_t new_cap = m->cap ? m->cap * 2 : ADDRMAP_MIN_CAP;
+    struct addrmap_slot *slots = calloc(new_cap, sizeof(struct addrmap_slot));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < m->cap; i++) {
+        if (m->slots[i].key != 0) {
+            insert_slot(slots, new_cap, m->slots[i].key, m->slots[i].value);
+        }
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->cap = new_cap;
+    return 0;
+}
+
+void *addrmap_get(const struct addrmap *m, const struct sockaddr_in *addr) {
+    if (m->count == 0) {
+        return NULL;
+    }
+    uint64_t key = addr_key(addr);
+    uint32_t i = key_slot(key, m->cap);
+    while (m->slots[i].key != 0) {
+        if (m->slots[i].key == key) {
+            return m->slots[i].value;
+        }
+        i = (i + 1) & (m->cap - 1);
+    }
+    return NULL;
+}
+
+int addrmap_put(struct addrmap *m, const struct sockaddr_in *addr, void *value) {
+    if ((m->count + 1) * 2 > m->cap && grow(m) < 0) {
+        return -1;
+    }
+    uint64_t key = addr_key(addr);
+    uint32_t i = key_slot(key, m->cap);
+    while (m->slots[i].key != 0) {
+        if (m->slots[i].key == key) {
+            m->slots[i].value = value;
+            return 0;
+        }
+        i = (i + 1) & (m->cap - 1);
+    }
+    m->slots[i].key = key;
+    m->slots[i].value = value;
+    m->count++;
+    return 0;
+}
+
+void addrmap_del(struct addrmap *m, const struct sockaddr_in *addr) {
+    if (m->count == 0) {
+        return;
+    }
+    uint64_t key = addr_key(addr);
+    uint32_t mask = m->cap - 1;
+    uint32_t i = key_slot(key, m->cap);
+    while (m->slots[i].key != key) {
+        if (m->slots[i].key == 0) {
+            return; // not present
+        }
+        i = (i + 1) & mask;
+    }
+
+    // backward shift: pull later entries of the run into the hole if
+    // their home slot is at or before it
+    uint32_t hole = i;
+    uint32_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (m->slots[j].key == 0) {
+            break;
+        }
+        uint32_t home = key_slot(m->slots[j].key, m->cap);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            m->slots[hole] = m->slots[j];
+            hole = j;
+        }
+    }
+    m->slots[hole].key = 0;
+    m->slots[hole].value = NULL;
+    m->count--;
+}
@@ -0,0 +1,31 @@
+#ifndef ADDRMAP_H
+#define ADDRMAP_H
+#include <stdint.h>
+#include <netinet/in.h>
+/* Hash index keyed on an IPv4 address and port. The server keeps one of
+* these for logged in users and one for neighboring servers so the per
+* packet lookups don't have to scan the tables. The index only stores
+* pointers; the caller owns whatever the values point to.
+*
+* Open addressing with linear probing. Deletes shift the following run
+* back instead of leaving tombstones, so lookups never get slower with
+* churn. The table doubles whenever it gets half full. */
+struct addrmap_slot {
+    uint64_t key; /* 0 = empty */
+    void *value;
+};
+
+struct addrmap {
+    struct addrmap_slot *slots;
+    uint32_t cap; /* always a power of 2 */
+    uint32_t count;
+};
+
+void addrmap_init(struct addrmap *m);
+void addrmap_free(struct addrmap *m);
+/* Returns the value stored for addr, or NULL if there is none */
+void *addrmap_get(const struct addrmap *m, const struct sockaddr_in *addr);
+/* Inserts or replaces. Returns -1 if the table could not grow, 0 on success */
+int addrmap_put(struct addrmap *m, const struct sockaddr_in *addr, void *value);
+void addrmap_del(struct addrmap *m, const struct sockaddr_in *addr);
+#endif
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include "arena.h"
+/* See arena.h for usage information */
+
+/* every chunk starts with this header */
+struct chunk_hdr {
+    struct chunk_hdr *next;
+    size_t size;
+};
+
+static int size_class(size_t size) {
+    int shift = ARENA_MIN_SHIFT;
+    while (((size_t)1 << shift) < size) {
+        shift++;
+    }
+    return shift - ARENA_MIN_SHIFT;
+}
+
+size_t arena_block_size(size_t size) {
+    if (size > ((size_t)1 << ARENA_MAX_SHIFT)) {
+        return size;
+    }
+    return (size_t)1 << (size_class(size) + ARENA_MIN_SHIFT);
+}
+
+void arena_init(struct arena *a) {
+    for (int i = 0; i < ARENA_CLASSES; i++) {
+        a->free_lists[i] = NULL;
+    }
+    a->chunks = NULL;
+    a->chunk_next = NULL;
+    a->chunk_left = 0;
+    a->in_use = 0;
+    a->reserved = 0;
+}
+
+void arena_free(struct arena *a) {
+    struct chunk_hdr *c = a->chunks;
+    while (c != NULL) {
+        struct chunk_hdr *next = c->next;
+        free(c);
+        c = next;
+    }
+    arena_init(a);
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    if (size > ((size_t)1 << ARENA_MAX_SHIFT)) {
+        // too big to pool, but still accounted for
+        void *p = malloc(size);
+        if (p != NULL) {
+            a->in_use += size;
+            a->reserved += size;
+        }
+        return p;
+    }
+
+    int cls = size_class(size);
+    size_t block = (size_t)1 << (cls + ARENA_MIN_SHIFT);
+
+    void *p = a->free_lists[cls];
+    if (p != NULL) {
+        a->free_lists[cls] = *(void **)p;
+        a->in_use += block;
+        return p;
+    }
+
+    if (a->chunk_left < block) {
+        // whatever is left of the old chunk is too small for this class,
+        // file it under the smaller classes so it doesn't go to waste
+        while (a->chunk_left >= ((size_t)1 << ARENA_MIN_SHIFT)) {
+            int c = size_class(a->chunk_left);
+            if (((size_t)1 << (c + ARENA_MIN_SHIFT)) > a->chunk_left) {
+                c--;
+            }
+            size_t piece = (size_t)1 << (c + ARENA_MIN_SHIFT);
+            *(void **)a->chunk_next = a->free_lists[c];
+            a->free_lists[c] = a->chunk_next;
+            a->chunk_next += piece;
+            a->chunk_left -= piece;
+        }
+
+        struct chunk_hdr *c = malloc(ARENA_CHUNK_SIZE);
+        if (c == NULL) {
+            return NULL;
+        }
+        c->next = a->chunks;
+        c->size = ARENA_CHUNK_SIZE;
+        a->chunks = c;
+        a->reserved += ARENA_CHUNK_SIZE;
+        // keep blocks 16 byte aligned
+        a->chunk_next = (char *)c + 16;
+        a->chunk_left = ARENA_CHUNK_SIZE - 16;
+    }
+
+    p = a->chunk_next;
+    a->chunk_next += block;
+    a->chunk_left -= block;
+    a->in_use += block;
+    return p;
+}
+
+void arena_release(struct arena *a, void *p, size_t size) {
+    if (p == NULL) {
+        return;
+    }
+    if (size > ((size_t)1 << ARENA_MAX_SHIFT)) {
+        free(p);
+        a->in_use -= size;
+        a->reserved -= size;
+        return;
+    }
+    int cls = size_class(size);
+    *(void **)p = a->free_lists[cls];
+    a->free_lists[cls] = p;
+    a->in_use -= (size_t)1 << (cls + ARENA_MIN_SHIFT);
+}
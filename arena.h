@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <stddef.h>
+/* A size-class arena for the server's many small, resizable lists.
+*
+* Requests are rounded up to a power of two and carved out of large
+* chunks. Released blocks go on a free list for their class and are
+* handed out again before any new chunk space is used, so a list that
+* grows and shrinks keeps reusing the same memory. Anything bigger than
+* the largest class goes straight to malloc().
+*
+* Blocks must be released with the same size they were allocated with. */
+#define ARENA_MIN_SHIFT 4   /* smallest block is 16 bytes */
+#define ARENA_MAX_SHIFT 16  /* largest pooled block is 64KB */
+#define ARENA_CLASSES (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+struct arena {
+    void *free_lists[ARENA_CLASSES];
+    void *chunks;        /* every chunk, linked for arena_free() */
+    char *chunk_next;    /* unused space in the current chunk */
+    size_t chunk_left;
+    size_t in_use;       /* bytes handed out and not released */
+    size_t reserved;     /* bytes obtained from malloc() */
+};
+
+void arena_init(struct arena *a);
+/* Returns everything to the system. Outstanding blocks become invalid. */
+void arena_free(struct arena *a);
+/* Returns NULL if memory is exhausted */
+void *arena_alloc(struct arena *a, size_t size);
+void arena_release(struct arena *a, void *p, size_t size);
+/* The number of bytes a request of this size really occupies */
+size_t arena_block_size(size_t size);
+#endif
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "capture.h"
+/* See capture.h for usage information */
+
+int capture_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct capture_header h;
+    h.magic = CAPTURE_MAGIC;
+    h.version = CAPTURE_VERSION;
+    h.started = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (write(fd, &h, sizeof(h)) != sizeof(h)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int capture_writer_init(struct capture_writer *w, int fd) {
+    w->fd = fd;
+    w->used = 0;
+    w->records = 0;
+    w->errors = 0;
+    w->buf = malloc(CAPTURE_BUFFER);
+    return w->buf == NULL ? -1 : 0;
+}
+
+uint64_t capture_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void capture_add(struct capture_writer *w, uint64_t time, const struct sockaddr_in *from,
+                 const void *payload, size_t len) {
+    size_t need = sizeof(struct capture_record) + len;
+    if (w->used + need > CAPTURE_BUFFER) {
+        capture_flush(w);
+    }
+    struct capture_record r;
+    r.time = time;
+    r.addr = from->sin_addr.s_addr;
+    r.port = from->sin_port;
+    r.len = (uint16_t)len;
+    memcpy(w->buf + w->used, &r, sizeof(r));
+    memcpy(w->buf + w->used + sizeof(r), payload, len);
+    w->used += need;
+    w->records++;
+}
+
+void capture_flush(struct capture_writer *w) {
+    if (w->used == 0) {
+        return;
+    }
+    // one write per buffer keeps it whole between the other workers' appends
+    if (write(w->fd, w->buf, w->used) != (ssize_t)w->used) {
+        w->errors++;
+    }
+    w->used = 0;
+}
+
+int capture_map(struct capture_reader *r, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    r->size = st.st_size;
+    r->pos = sizeof(struct capture_header);
+    r->map = NULL;
+    if (r->size >= sizeof(struct capture_header)) {
+        r->map = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (r->map == NULL || r->map == MAP_FAILED) {
+        r->map = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    const struct capture_header *h = (const struct capture_header *)r->map;
+    if (h->magic != CAPTURE_MAGIC || h->version != CAPTURE_VERSION) {
+        capture_unmap(r);
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void capture_unmap(struct capture_reader *r) {
+    if (r->map != NULL) {
+        munmap((void *)r->map, r->size);
+        r->map = NULL;
+    }
+}
+
+const struct capture_record *capture_next(struct capture_reader *r) {
+    if (r->pos + sizeof(struct capture_record) > r->size) {
+        return NULL;
+    }
+    const struct capture_record *rec = (const struct capture_record *)(r->map + r->pos);
+    if (r->pos + sizeof(*rec) + rec->len > r->size) {
+        return NULL;
+    }
+    r->pos += sizeof(*rec) + rec->len;
+    return rec;
+}
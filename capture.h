@@ -0,0 +1,68 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+/* Binary capture of the datagrams a server receives, for duckreplay.
+*
+* The file is a header followed by records, each a fixed header and then
+* the datagram exactly as it arrived. Every worker collects records in
+* its own buffer and appends the whole buffer with one write() to the
+* shared file, opened O_APPEND, so records never tear but blocks from
+* different workers interleave: records are in time order per worker,
+* not across the file. Readers that care (duckreplay does) sort them.
+*
+* Buffers are written out when full and on every timer tick, so a server
+* that is killed loses at most the last tick's worth. */
+#define CAPTURE_MAGIC 0x50434344u /* "DCCP" */
+#define CAPTURE_VERSION 1
+#define CAPTURE_BUFFER (64 * 1024)
+
+struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t started;   /* wall clock at creation, ns since the epoch */
+} __attribute__((__packed__));
+
+struct capture_record {
+    uint64_t time;      /* CLOCK_MONOTONIC ns when the batch was received */
+    uint32_t addr;      /* source address and port, network byte order */
+    uint16_t port;
+    uint16_t len;       /* payload bytes that follow */
+} __attribute__((__packed__));
+
+struct capture_writer {
+    int fd;
+    char *buf;          /* CAPTURE_BUFFER bytes */
+    size_t used;
+
+    /* counters for reporting */
+    uint64_t records;
+    uint64_t errors;    /* records lost to failed writes */
+};
+
+struct capture_reader {
+    const char *map;
+    size_t size;
+    size_t pos;
+};
+
+/* Creates (or truncates) a capture file and writes its header. Returns
+* the descriptor, or -1 with errno set. */
+int capture_open(const char *path);
+/* Returns -1 if the buffer could not be allocated, 0 on success */
+int capture_writer_init(struct capture_writer *w, int fd);
+/* The timestamp capture_add() expects */
+uint64_t capture_clock();
+void capture_add(struct capture_writer *w, uint64_t time, const struct sockaddr_in *from,
+                 const void *payload, size_t len);
+void capture_flush(struct capture_writer *w);
+
+/* Maps a capture file for reading. Returns -1 with errno set if it can't
+* be opened or isn't a capture. */
+int capture_map(struct capture_reader *r, const char *path);
+void capture_unmap(struct capture_reader *r);
+/* The next record, its payload right after it, or NULL at the end (or
+* at a record cut short by a crash) */
+const struct capture_record *capture_next(struct capture_reader *r);
+#endif
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "dclog.h"
+/* See dclog.h for usage information */
+
+#define DCLOG_IDLE_NS 5000000 /* formatter's nap when every ring is empty */
+
+struct dclog_ring {
+    _Alignas(64) uint32_t head;  /* next record to format, written by the formatter */
+    _Alignas(64) uint32_t tail;  /* next record to fill, written by the owner */
+    uint64_t dropped;            /* written by the owner */
+    _Alignas(64) uint64_t reported; /* drops already reported, formatter only */
+};
+
+static struct dclog_ring *rings;
+static struct dclog_record *records; /* nthreads * ring_size */
+static int ring_count;
+static uint32_t ring_size;
+static FILE *log_out;
+static int log_level = DCLOG_DEBUG;
+static unsigned log_categories = DCLOG_ALL;
+static pthread_t formatter;
+static __thread int log_tid = -1;
+
+int dclog_init(int nthreads, uint32_t size, FILE *out) {
+    uint32_t cap = 1;
+    while (cap < size) {
+        cap <<= 1;
+    }
+    rings = calloc(nthreads, sizeof(struct dclog_ring));
+    records = malloc((size_t)nthreads * cap * sizeof(struct dclog_record));
+    if (rings == NULL || records == NULL) {
+        free(rings);
+        free(records);
+        return -1;
+    }
+    ring_count = nthreads;
+    ring_size = cap;
+    log_out = out;
+    return 0;
+}
+
+void dclog_thread(int tid) {
+    log_tid = tid;
+}
+
+void dclog_set_level(int level) {
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int dclog_get_level() {
+    return __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+void dclog_set_categories(unsigned mask) {
+    __atomic_store_n(&log_categories, mask, __ATOMIC_RELAXED);
+}
+
+int dclog_parse_categories(const char *list, unsigned *mask) {
+    static const struct {
+        const char *name;
+        unsigned bit;
+    } names[] = {
+        { "server", DCLOG_SERVER },
+        { "s2s", DCLOG_S2S },
+        { "stats", DCLOG_STATS },
+        { "all", DCLOG_ALL },
+    };
+    *mask = 0;
+    while (*list != '\0') {
+        size_t len = strcspn(list, ",");
+        size_t i;
+        for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            if (strlen(names[i].name) == len && strncmp(names[i].name, list, len) == 0) {
+                *mask |= names[i].bit;
+                break;
+            }
+        }
+        if (i == sizeof(names) / sizeof(names[0])) {
+            return -1;
+        }
+        list += len;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return 0;
+}
+
+struct dclog_record *dclog_begin(int level, int category) {
+    if (level > __atomic_load_n(&log_level, __ATOMIC_RELAXED) ||
+        !(category & __atomic_load_n(&log_categories, __ATOMIC_RELAXED)) ||
+        log_tid < 0) {
+        return NULL;
+    }
+    struct dclog_ring *r = &rings[log_tid];
+    uint32_t tail = r->tail; // only we write it
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == ring_size) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct dclog_record *rec = &records[(size_t)log_tid * ring_size + (tail & (ring_size - 1))];
+    rec->level = level;
+    rec->category = category;
+    return rec;
+}
+
+void dclog_commit(struct dclog_record *rec) {
+    (void)rec; // it is always the slot at our tail
+    struct dclog_ring *r = &rings[log_tid];
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t dclog_dropped() {
+    uint64_t n = 0;
+    for (int i = 0; i < ring_count; i++) {
+        n += __atomic_load_n(&rings[i].dropped, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+void dclog_flush() {
+    for (int i = 0; i < ring_count; i++) {
+        struct dclog_ring *r = &rings[i];
+        uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        while ((int32_t)(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail) < 0) {
+            struct timespec nap = { 0, DCLOG_IDLE_NS };
+            nanosleep(&nap, NULL);
+        }
+    }
+}
+
+/* the formatting the server used to do inline */
+static void format_record(const struct dclog_record *rec) {
+    char local_ip[INET_ADDRSTRLEN];
+    char remote_ip[INET_ADDRSTRLEN];
+
+    if (rec->kind == DCLOG_TEXT) {
+        inet_ntop(AF_INET, &rec->u.text.addr.sin_addr, local_ip, INET_ADDRSTRLEN);
+        fprintf(log_out, "%s:%d %s", local_ip, ntohs(rec->u.text.addr.sin_port), rec->u.text.text);
+        return;
+    }
+
+    const struct dclog_packet *p = &rec->u.packet;
+    inet_ntop(AF_INET, &p->local.sin_addr, local_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &p->remote.sin_addr, remote_ip, INET_ADDRSTRLEN);
+    fprintf(log_out, "%s:%d %s:%d %s %s %.*s",
+        local_ip, ntohs(p->local.sin_port),
+        remote_ip, ntohs(p->remote.sin_port),
+        p->direction, p->message_type,
+        CHANNEL_MAX, p->has_channel ? p->channel : "(null)");
+    if (p->has_username) {
+        fprintf(log_out, " %.*s", USERNAME_MAX, p->username);
+    }
+    if (p->has_text) {
+        fprintf(log_out, " \"%.*s\"", SAY_MAX, p->text);
+    }
+    fprintf(log_out, "\n");
+}
+
+static void *formatter_main(void *arg) {
+    (void)arg;
+    while (1) {
+        int busy = 0;
+        for (int i = 0; i < ring_count; i++) {
+            struct dclog_ring *r = &rings[i];
+            uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+            while (r->head != tail) {
+                format_record(&records[(size_t)i * ring_size + (r->head & (ring_size - 1))]);
+                __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+                busy = 1;
+            }
+            uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+            if (dropped != r->reported) {
+                fprintf(log_out, "log: %llu records dropped by thread %d, log ring full\n",
+                    (unsigned long long)(dropped - r->reported), i);
+                r->reported = dropped;
+                busy = 1;
+            }
+        }
+        if (busy) {
+            fflush(log_out);
+        } else {
+            struct timespec nap = { 0, DCLOG_IDLE_NS };
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+int dclog_start() {
+    if (pthread_create(&formatter, NULL, formatter_main, NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef DCLOG_H
+#define DCLOG_H
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+/* Asynchronous logging. A thread that logs fills a fixed-size binary
+* record in its own single producer, single consumer ring, and a
+* background thread formats the records and writes them out. Nothing on
+* the logging side formats addresses, touches stdio or waits: if a ring is
+* full the record is dropped and counted, so a slow stdout never holds up
+* packet handling.
+*
+* Every record has a level and a category. Records above the current level
+* or outside the enabled categories are discarded before anything is
+* copied. Both can be changed at runtime from any thread, including a
+* signal handler.
+*
+* Each logging thread must call dclog_thread() with its own index first;
+* records from any other thread are dropped. */
+#define DCLOG_ERROR 0
+#define DCLOG_INFO 1
+#define DCLOG_DEBUG 2
+
+#define DCLOG_SERVER 0x1  /* server events: logins, joins, channel changes */
+#define DCLOG_S2S 0x2     /* one line per S2S message sent or received */
+#define DCLOG_STATS 0x4   /* the periodic stats report */
+#define DCLOG_ALL 0x7
+
+#define DCLOG_TEXT_MAX 176
+
+/* an S2S message sent or received, see log_message() in server.c */
+struct dclog_packet {
+    struct sockaddr_in local;
+    struct sockaddr_in remote;
+    const char *direction;    /* string literals, never copied */
+    const char *message_type;
+    uint8_t has_channel;
+    uint8_t has_username;
+    uint8_t has_text;
+    char channel[CHANNEL_MAX];
+    char username[USERNAME_MAX];
+    char text[SAY_MAX];
+};
+
+#define DCLOG_PACKET 0
+#define DCLOG_TEXT 1
+
+struct dclog_record {
+    uint8_t kind;             /* DCLOG_PACKET or DCLOG_TEXT */
+    uint8_t level;
+    uint8_t category;
+    union {
+        struct dclog_packet packet;
+        struct {
+            struct sockaddr_in addr;       /* printed ahead of the text */
+            char text[DCLOG_TEXT_MAX];     /* already formatted */
+        } text;
+    } u;
+};
+
+/* Sets up nthreads rings of ring_size records each, writing to out.
+* Returns -1 if the memory could not be allocated, 0 on success. */
+int dclog_init(int nthreads, uint32_t ring_size, FILE *out);
+/* Starts the formatter thread. Returns -1 if it could not be started. */
+int dclog_start();
+/* Binds the calling thread to ring tid */
+void dclog_thread(int tid);
+
+void dclog_set_level(int level);
+int dclog_get_level();
+void dclog_set_categories(unsigned mask);
+/* Parses a comma separated list of category names ("server,s2s,stats" or
+* "all"). Returns -1 on an unknown name. */
+int dclog_parse_categories(const char *list, unsigned *mask);
+
+/* Returns a record to fill in, or NULL if it would be filtered out or the
+* ring is full. A record that is returned must be handed to dclog_commit(). */
+struct dclog_record *dclog_begin(int level, int category);
+void dclog_commit(struct dclog_record *r);
+
+/* records dropped on a full ring, over all threads */
+uint64_t dclog_dropped();
+/* Waits for the formatter to write out everything committed so far, for
+* programs that log and then exit */
+void dclog_flush();
+#endif
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+/* See dedup.h for usage information */
+
+#define DEDUP_MIN_CAP 16
+
+static uint32_t origin_slot(uint32_t origin, uint32_t cap) {
+    return (uint32_t)(((uint64_t)origin * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+int dedup_init(struct dedup *d, uint32_t window, time_t expiry) {
+    // a power of 2 (at least one word) so seq % window survives wraparound
+    d->window = 64;
+    while (d->window < window) {
+        d->window *= 2;
+    }
+    d->expiry = expiry;
+    d->cap = DEDUP_MIN_CAP;
+    d->count = 0;
+    d->last_sweep = 0;
+    d->lookups = 0;
+    d->hits = 0;
+    d->stale = 0;
+    d->expired = 0;
+    d->origins = calloc(d->cap, sizeof(struct dedup_origin));
+    return d->origins == NULL ? -1 : 0;
+}
+
+void dedup_free(struct dedup *d) {
+    for (uint32_t i = 0; i < d->cap; i++) {
+        free(d->origins[i].bits);
+    }
+    free(d->origins);
+    d->origins = NULL;
+}
+
+static struct dedup_origin *find_slot(struct dedup_origin *origins, uint32_t cap, uint32_t origin) {
+    uint32_t i = origin_slot(origin, cap);
+    while (origins[i].origin != 0 && origins[i].origin != origin) {
+        i = (i + 1) & (cap - 1);
+    }
+    return &origins[i];
+}
+
+static int grow(struct dedup *d) {
+    uint32_t new_cap = d->cap * 2;
+    struct dedup_origin *origins = calloc(new_cap, sizeof(struct dedup_origin));
+    if (origins == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < d->cap; i++) {
+        if (d->origins[i].origin != 0) {
+            *find_slot(origins, new_cap, d->origins[i].origin) = d->origins[i];
+        }
+    }
+    free(d->origins);
+    d->origins = origins;
+    d->cap = new_cap;
+    return 0;
+}
+
+/* forget origins that have been quiet for longer than the expiry.
+* rebuilding is simpler than deleting in place and this runs rarely. */
+static void sweep(struct dedup *d, time_t now) {
+    struct dedup_origin *origins = calloc(d->cap, sizeof(struct dedup_origin));
+    if (origins == NULL) {
+        return; // try again next time
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < d->cap; i++) {
+        struct dedup_origin *o = &d->origins[i];
+        if (o->origin == 0) {
+            continue;
+        }
+        if (now - o->last_seen > d->expiry) {
+            free(o->bits);
+            d->expired++;
+            continue;
+        }
+        *find_slot(origins, d->cap, o->origin) = *o;
+        count++;
+    }
+    free(d->origins);
+    d->origins = origins;
+    d->count = count;
+}
+
+static void set_bit(uint64_t *bits, uint32_t i) {
+    bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static int test_bit(const uint64_t *bits, uint32_t i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+int dedup_check(struct dedup *d, uint64_t id, time_t now) {
+    uint32_t origin = (uint32_t)(id >> 32);
+    uint32_t seq = (uint32_t)id;
+    d->lookups++;
+
+    if (now - d->last_sweep > d->expiry) {
+        sweep(d, now);
+        d->last_sweep = now;
+    }
+
+    struct dedup_origin *o = find_slot(d->origins, d->cap, origin);
+    if (o->origin == 0) {
+        if ((d->count + 1) * 2 > d->cap) {
+            if (grow(d) < 0) {
+                return 0; // can't track it, let it through
+            }
+            o = find_slot(d->origins, d->cap, origin);
+        }
+        o->bits = calloc(d->window / 64, sizeof(uint64_t));
+        if (o->bits == NULL) {
+            return 0;
+        }
+        o->origin = origin;
+        o->top = seq;
+        o->last_seen = now;
+        set_bit(o->bits, seq % d->window);
+        d->count++;
+        return 0;
+    }
+    o->last_seen = now;
+
+    // serial number arithmetic, so the sequence may wrap
+    int32_t ahead = (int32_t)(seq - o->top);
+    if (ahead > 0) {
+        // slide the window up, clearing the numbers it skips over
+        if ((uint32_t)ahead >= d->window) {
+            memset(o->bits, 0, d->window / 8);
+        } else {
+            for (uint32_t s = o->top + 1; s != seq; s++) {
+                o->bits[(s % d->window) / 64] &= ~(1ULL << (s % 64));
+            }
+        }
+        o->top = seq;
+        set_bit(o->bits, seq % d->window);
+        return 0;
+    }
+    if ((uint32_t)-ahead >= d->window) {
+        d->hits++;
+        d->stale++;
+        return 1;
+    }
+    if (test_bit(o->bits, seq % d->window)) {
+        d->hits++;
+        return 1;
+    }
+    set_bit(o->bits, seq % d->window);
+    return 0;
+}
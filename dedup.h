@@ -0,0 +1,49 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+#include <stdint.h>
+#include <time.h>
+/* Duplicate suppression for S2S say message ids.
+*
+* An id is the originating server's id in the upper 32 bits and that
+* server's sequence number in the lower 32 (see dedup_make_id()). For each
+* origin we keep the highest sequence number seen plus a bitmap of which
+* of the window sequence numbers below it have arrived. Checking an id is
+* a hash lookup on the origin and a couple of bit operations, and memory
+* grows with the number of servers rather than with message rate.
+*
+* Anything that falls behind the window is treated as a duplicate. Origins
+* that go quiet for expiry seconds (a restarted server comes back with a
+* new id) are forgotten. */
+struct dedup_origin {
+    uint32_t origin;     /* 0 = empty slot */
+    uint32_t top;        /* highest sequence number seen */
+    time_t last_seen;
+    uint64_t *bits;      /* window bits, indexed by seq % window */
+};
+
+struct dedup {
+    struct dedup_origin *origins;
+    uint32_t cap;        /* always a power of 2 */
+    uint32_t count;
+    uint32_t window;     /* in sequence numbers, a power of 2 >= 64 */
+    time_t expiry;
+    time_t last_sweep;
+
+    /* counters for reporting */
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t stale;      /* hits that were behind the window */
+    uint64_t expired;    /* origins forgotten */
+};
+
+/* Returns -1 if the memory could not be allocated, 0 on success */
+int dedup_init(struct dedup *d, uint32_t window, time_t expiry);
+void dedup_free(struct dedup *d);
+/* Returns 1 if id has been seen (or is too old to tell), otherwise
+* records it and returns 0 */
+int dedup_check(struct dedup *d, uint64_t id, time_t now);
+
+static inline uint64_t dedup_make_id(uint32_t origin, uint32_t seq) {
+    return ((uint64_t)origin << 32) | seq;
+}
+#endif
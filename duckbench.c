@@ -0,0 +1,530 @@
+/*
+duckbench.c
+times the server's state primitives on their own, across population sizes
+*/
+#include "duckchat.h"
+#include "state.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define BENCH_OPS 1000000    // default operations per measurement
+#define MIN_POPULATION 10
+#define MAX_POPULATION 1000000
+#define MEMBERSHIPS 4        // channels per user where memberships matter
+#define DEDUP_WINDOW 4096
+
+struct bench_result {
+    double ns;     // per operation
+    double misses; // cache misses per operation, < 0 if not available
+};
+
+struct bench {
+    const char *name;
+    void (*fn)(long n, long ops, struct bench_result *r);
+    long max_population;
+};
+
+// globals
+int perf_fd = -1;      // hardware cache miss counter, -1 if we can't have one
+uint64_t rng = 0x9E3779B97F4A7C15ULL;
+struct timespec bench_began;
+volatile uintptr_t sink; // keeps lookups from being optimized away
+long ops = BENCH_OPS;
+int json = 0;
+
+// functions
+void open_counter();
+void bench_start();
+void bench_stop(long n, struct bench_result *r);
+void *bench_alloc(long n, size_t size);
+uint64_t next_random();
+void user_addr(long i, struct sockaddr_in *addr);
+void channel_key(long i, char *name);
+void fill_users(struct server_state *st, long n);
+void fill_channels(struct server_state *st, long n, int local);
+void fill_memberships(struct server_state *st, long n);
+void bench_find_user(long n, long ops, struct bench_result *r);
+void bench_find_channel(long n, long ops, struct bench_result *r);
+void bench_find_rt_entry(long n, long ops, struct bench_result *r);
+void bench_user_present(long n, long ops, struct bench_result *r);
+void bench_isdup(long n, long ops, struct bench_result *r);
+void bench_remove_user(long n, long ops, struct bench_result *r);
+void bench_add_user(long n, long ops, struct bench_result *r);
+void bench_delete_channel(long n, long ops, struct bench_result *r);
+void bench_drop_user(long n, long ops, struct bench_result *r);
+
+struct bench benches[] = {
+    { "find_user", bench_find_user, MAX_POPULATION },
+    { "find_channel", bench_find_channel, MAX_POPULATION },
+    { "find_rt_entry", bench_find_rt_entry, MAX_POPULATION },
+    { "user_present", bench_user_present, MAX_POPULATION },
+    // origins are servers, and each keeps a DEDUP_WINDOW bit window
+    { "isdup", bench_isdup, 100000 },
+    { "remove_user", bench_remove_user, MAX_POPULATION },
+    { "add_user", bench_add_user, MAX_POPULATION },
+    { "delete_channel", bench_delete_channel, MAX_POPULATION },
+    { "drop_user", bench_drop_user, MAX_POPULATION },
+};
+#define NBENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+/*
+    a user space cache miss counter for this thread. perf events are often
+    unavailable (containers, paranoid kernels); the times are still good
+*/
+void open_counter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void bench_start() {
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &bench_began);
+}
+
+void bench_stop(long n, struct bench_result *r) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t misses = 0;
+    r->misses = -1;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &misses, sizeof(misses)) == sizeof(misses)) {
+            r->misses = (double)misses / n;
+        }
+    }
+    r->ns = ((end.tv_sec - bench_began.tv_sec) * 1e9 + (end.tv_nsec - bench_began.tv_nsec)) / n;
+}
+
+/* zeroed setup arrays; a bench that can't have one can't run */
+void *bench_alloc(long n, size_t size) {
+    void *p = calloc(n, size);
+    if (p == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    return p;
+}
+
+/* xorshift64* */
+uint64_t next_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* a distinct client address for every user index */
+void user_addr(long i, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(0x0a000000u | (uint32_t)(i / 50000));
+    addr->sin_port = htons(10000 + i % 50000);
+}
+
+void channel_key(long i, char *name) {
+    memset(name, 0, CHANNEL_MAX);
+    snprintf(name, CHANNEL_MAX, "channel%ld", i);
+}
+
+void fill_users(struct server_state *st, long n) {
+    for (long i = 0; i < n; i++) {
+        struct sockaddr_in addr;
+        char name[USERNAME_MAX];
+        user_addr(i, &addr);
+        snprintf(name, sizeof(name), "user%ld", i);
+        if (state_new_user(st, name, &addr) == NULL) {
+            exit(1);
+        }
+    }
+}
+
+void fill_channels(struct server_state *st, long n, int local) {
+    for (long i = 0; i < n; i++) {
+        char name[CHANNEL_MAX];
+        channel_key(i, name);
+        struct channel *ch = state_get_channel(st, name);
+        if (ch == NULL) {
+            exit(1);
+        }
+        ch->local = local;
+        ch->routed = !local;
+    }
+}
+
+/*
+    n users, each in MEMBERSHIPS random channels out of n / MEMBERSHIPS
+*/
+void fill_memberships(struct server_state *st, long n) {
+    long nchannels = n / MEMBERSHIPS > MEMBERSHIPS ? n / MEMBERSHIPS : MEMBERSHIPS;
+    fill_users(st, n);
+    fill_channels(st, nchannels, 1);
+    for (long i = 0; i < n; i++) {
+        struct user *u = pvec_at(&st->users, i);
+        while (u->channels.count < MEMBERSHIPS) {
+            char name[CHANNEL_MAX];
+            channel_key(next_random() % nchannels, name);
+            struct channel *ch = state_find_channel(st, name);
+            if (!state_user_present(st, u, ch) && state_add_user(st, u, ch) < 0) {
+                exit(1);
+            }
+        }
+    }
+}
+
+void bench_find_user(long n, long ops, struct bench_result *r) {
+    struct server_state st;
+    state_init(&st, DEDUP_WINDOW, 0);
+    fill_users(&st, n);
+    struct sockaddr_in *keys = bench_alloc(ops, sizeof(*keys));
+    for (long i = 0; i < ops; i++) {
+        user_addr(next_random() % n, &keys[i]);
+    }
+
+    bench_start();
+    for (long i = 0; i < ops; i++) {
+        sink += (uintptr_t)state_find_user(&st, &keys[i]);
+    }
+    bench_stop(ops, r);
+    free(keys);
+    state_free(&st);
+}
+
+/* shared by find_channel and find_rt_entry, which differ in one flag */
+static void bench_channel_lookup(long n, long ops, struct bench_result *r, int local) {
+    struct server_state st;
+    state_init(&st, DEDUP_WINDOW, 0);
+    fill_channels(&st, n, local);
+    char (*keys)[CHANNEL_MAX] = bench_alloc(ops, CHANNEL_MAX);
+    for (long i = 0; i < ops; i++) {
+        channel_key(next_random() % n, keys[i]);
+    }
+
+    bench_start();
+    if (local) {
+        for (long i = 0; i < ops; i++) {
+            sink += (uintptr_t)state_find_channel(&st, keys[i]);
+        }
+    } else {
+        for (long i = 0; i < ops; i++) {
+            sink += (uintptr_t)state_find_rt_entry(&st, keys[i]);
+        }
+    }
+    bench_stop(ops, r);
+    free(keys);
+    state_free(&st);
+}
+
+void bench_find_channel(long n, long ops, struct bench_result *r) {
+    bench_channel_lookup(n, ops, r, 1);
+}
+
+void bench_find_rt_entry(long n, long ops, struct bench_result *r) {
+    bench_channel_lookup(n, ops, r, 0);
+}
+
+/*
+    random user against a random channel, mostly misses like a say from a
+    user who isn't in the channel would be, with one hit in MEMBERSHIPS + 1
+*/
+void bench_user_present(long n, long ops, struct bench_result *r) {
+    struct server_state st;
+    state_init(&st, DEDUP_WINDOW, 0);
+    fill_memberships(&st, n);
+    struct user **us = bench_alloc(ops, sizeof(*us));
+    struct channel **chs = bench_alloc(ops, sizeof(*chs));
+    for (long i = 0; i < ops; i++) {
+        us[i] = pvec_at(&st.users, next_random() % n);
+        if (next_random() % (MEMBERSHIPS + 1) == 0) {
+            struct membership *m = pvec_at(&us[i]->channels, next_random() % MEMBERSHIPS);
+            chs[i] = slotmap_get(&st.channels, m->channel);
+        } else {
+            chs[i] = slotmap_at(&st.channels, next_random() % st.channels.used);
+        }
+    }
+
+    bench_start();
+    for (long i = 0; i < ops; i++) {
+        sink += state_user_present(&st, us[i], chs[i]);
+    }
+    bench_stop(ops, r);
+    free(us);
+    free(chs);
+    state_free(&st);
+}
+
+/*
+    fresh ids from n origins, the common case on the S2S say path
+*/
+void bench_isdup(long n, long ops, struct bench_result *r) {
+    struct server_state st;
+    state_init(&st, DEDUP_WINDOW, 0);
+    uint32_t *seqs = bench_alloc(n, sizeof(*seqs));
+    for (long i = 0; i < n; i++) {
+        dedup_check(&st.recent_ids, dedup_make_id(i + 1, ++seqs[i]), 0);
+    }
+    uint64_t *ids = bench_alloc(ops, sizeof(*ids));
+    for (long i = 0; i < ops; i++) {
+        long o = next_random() % n;
+        ids[i] = dedup_make_id(o + 1, ++seqs[o]);
+    }
+
+    bench_start();
+    for (long i = 0; i < ops; i++) {
+        sink += dedup_check(&st.recent_ids, ids[i], 0);
+    }
+    bench_stop(ops, r);
+    free(ids);
+    free(seqs);
+    state_free(&st);
+}
+
+/*
+    remove_user and add_user run together: memberships removed in random
+    order, then put back, in rounds until there have been enough of each.
+    each half is timed for its own primitive
+*/
+static void bench_membership(long n, long ops, struct bench_result *removed, struct bench_result *added) {
+    struct server_state st;
+    state_init(&st, DEDUP_WINDOW, 0);
+    fill_memberships(&st, n);
+    long count = n * MEMBERSHIPS < ops ? n * MEMBERSHIPS : ops;
+    struct user **us = bench_alloc(count, sizeof(*us));
+    struct channel **chs = bench_alloc(count, sizeof(*chs));
+    long done = 0;
+    double remove_ns = 0, remove_misses = 0, add_ns = 0, add_misses = 0;
+    while (done < ops) {
+        // every user turns up at most MEMBERSHIPS times, so it always has one to drop
+        for (long i = 0; i < count; i++) {
+            us[i] = pvec_at(&st.users, i % n);
+        }
+        for (long i = count - 1; i > 0; i--) {
+            long j = next_random() % (i + 1);
+            struct user *t = us[i];
+            us[i] = us[j];
+            us[j] = t;
+        }
+
+        struct bench_result round;
+        bench_start();
+        for (long i = 0; i < count; i++) {
+            struct membership *m = pvec_at(&us[i]->channels, 0);
+            chs[i] = slotmap_get(&st.channels, m->channel);
+            state_remove_user(&st, m, chs[i]);
+        }
+        bench_stop(count, &round);
+        remove_ns += round.ns * count;
+        remove_misses += round.misses * count;
+
+        bench_start();
+        for (long i = count - 1; i >= 0; i--) {
+            state_add_user(&st, us[i], chs[i]);
+        }
+        bench_stop(count, &round);
+        add_ns += round.ns * count;
+        add_misses += round.misses * count;
+        done += count;
+    }
+    removed->ns = remove_ns / done;
+    removed->misses = perf_fd >= 0 ? remove_misses / done : -1;
+    added->ns = add_ns / done;
+    added->misses = perf_fd >= 0 ? add_misses / done : -1;
+    free(us);
+    free(chs);
+    state_free(&st);
+}
+
+void bench_remove_user(long n, long ops, struct bench_result *r) {
+    struct bench_result added;
+    bench_membership(n, ops, r, &added);
+}
+
+void bench_add_user(long n, long ops, struct bench_result *r) {
+    struct bench_result removed;
+    bench_membership(n, ops, &removed, r);
+}
+
+/*
+    empty local channels deleted in random order, in rounds until there
+    have been enough deletes to time
+*/
+void bench_delete_channel(long n, long ops, struct bench_result *r) {
+    struct server_state st;
+    state_init(&st, DEDUP_WINDOW, 0);
+    struct channel **chs = bench_alloc(n, sizeof(*chs));
+    long done = 0;
+    double ns = 0, misses = 0;
+    while (done < ops) {
+        fill_channels(&st, n, 1);
+        long count = 0;
+        for (uint32_t i = 0; i < st.channels.used; i++) {
+            struct channel *ch = slotmap_at(&st.channels, i);
+            if (ch != NULL) {
+                chs[count++] = ch;
+            }
+        }
+        for (long i = count - 1; i > 0; i--) {
+            long j = next_random() % (i + 1);
+            struct channel *t = chs[i];
+            chs[i] = chs[j];
+            chs[j] = t;
+        }
+
+        struct bench_result round;
+        bench_start();
+        for (long i = 0; i < count; i++) {
+            state_delete_channel(&st, chs[i]);
+        }
+        bench_stop(count, &round);
+        ns += round.ns * count;
+        misses += round.misses * count;
+        done += count;
+    }
+    r->ns = ns / done;
+    r->misses = perf_fd >= 0 ? misses / done : -1;
+    free(chs);
+    state_free(&st);
+}
+
+/*
+    users dropped in random order, as a logout ends, then logged in again,
+    in rounds until there have been enough drops to time
+*/
+void bench_drop_user(long n, long ops, struct bench_result *r) {
+    struct server_state st;
+    state_init(&st, DEDUP_WINDOW, 0);
+    fill_users(&st, n);
+    long count = n < ops ? n : ops;
+    long *picks = bench_alloc(n, sizeof(*picks));
+    struct user **us = bench_alloc(count, sizeof(*us));
+    long done = 0;
+    double ns = 0, misses = 0;
+    while (done < ops) {
+        for (long i = 0; i < n; i++) {
+            picks[i] = i;
+        }
+        for (long i = n - 1; i > 0; i--) {
+            long j = next_random() % (i + 1);
+            long t = picks[i];
+            picks[i] = picks[j];
+            picks[j] = t;
+        }
+        for (long i = 0; i < count; i++) {
+            struct sockaddr_in addr;
+            user_addr(picks[i], &addr);
+            us[i] = state_find_user(&st, &addr);
+        }
+
+        struct bench_result round;
+        bench_start();
+        for (long i = 0; i < count; i++) {
+            state_drop_user(&st, us[i]);
+        }
+        bench_stop(count, &round);
+        ns += round.ns * count;
+        misses += round.misses * count;
+        done += count;
+
+        for (long i = 0; i < count; i++) {
+            struct sockaddr_in addr;
+            char name[USERNAME_MAX];
+            user_addr(picks[i], &addr);
+            snprintf(name, sizeof(name), "user%ld", picks[i]);
+            if (state_new_user(&st, name, &addr) == NULL) {
+                exit(1);
+            }
+        }
+    }
+    r->ns = ns / done;
+    r->misses = perf_fd >= 0 ? misses / done : -1;
+    free(picks);
+    free(us);
+    state_free(&st);
+}
+
+int main(int argc, char *argv[]) {
+    long max_population = MAX_POPULATION;
+    int opt;
+    while ((opt = getopt(argc, argv, "jn:o:")) != -1) {
+        switch (opt) {
+            case 'j':
+                json = 1;
+                break;
+            case 'n':
+                max_population = atol(optarg);
+                break;
+            case 'o':
+                ops = atol(optarg);
+                break;
+            default:
+                argc = 0; // print usage
+                break;
+        }
+    }
+    if (argc == 0 || max_population < MIN_POPULATION || ops <= 0) {
+        fprintf(stderr, "Usage: %s [-j] [-n <largest population>] [-o <operations per measurement>] [<primitive>]...\n", argv[0]);
+        fprintf(stderr, "  primitives:");
+        for (int b = 0; b < NBENCHES; b++) {
+            fprintf(stderr, " %s", benches[b].name);
+        }
+        fprintf(stderr, "\n  populations go up by 10x from %d\n", MIN_POPULATION);
+        exit(1);
+    }
+    open_counter();
+
+    if (json) {
+        printf("[");
+    } else {
+        printf("%-16s %10s %10s %14s\n", "primitive", "population", "ns/op", "misses/op");
+    }
+    int first = 1;
+    for (int b = 0; b < NBENCHES; b++) {
+        // with names on the command line, only those
+        int wanted = optind == argc;
+        for (int i = optind; i < argc; i++) {
+            wanted |= strcmp(argv[i], benches[b].name) == 0;
+        }
+        if (!wanted) {
+            continue;
+        }
+        for (long n = MIN_POPULATION; n <= max_population && n <= benches[b].max_population; n *= 10) {
+            struct bench_result r;
+            benches[b].fn(n, ops, &r);
+            if (json) {
+                printf("%s\n {\"primitive\": \"%s\", \"population\": %ld, \"ns_per_op\": %.2f, \"misses_per_op\": ",
+                    first ? "" : ",", benches[b].name, n, r.ns);
+                if (r.misses >= 0) {
+                    printf("%.3f}", r.misses);
+                } else {
+                    printf("null}");
+                }
+            } else if (r.misses >= 0) {
+                printf("%-16s %10ld %10.2f %14.3f\n", benches[b].name, n, r.ns, r.misses);
+            } else {
+                printf("%-16s %10ld %10.2f %14s\n", benches[b].name, n, r.ns, "n/a");
+            }
+            fflush(stdout);
+            first = 0;
+        }
+    }
+    if (json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
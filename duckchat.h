@@ -32,6 +32,10 @@ typedef int text_t;
 #define TXT_LIST 1
 #define TXT_WHO 2
 #define TXT_ERROR 3
+/* A longer LIST or WHO reply comes in several datagrams of up to this many
+* names, which keeps each one under 1024 bytes */
+#define TXT_LIST_MAX 31
+#define TXT_WHO_MAX 30
 /* This structure is used for a generic request type, to the server. */
 struct request {
 request_t req_type;
@@ -110,6 +114,13 @@ char txt_error[SAY_MAX]; // Error message
 #define S2S_JOIN 8
 #define S2S_LEAVE 9
 #define S2S_SAY 10
+#define S2S_HELLO 11
+#define S2S_JOIN_BULK 12
+#define S2S_DIGEST 13
+#define S2S_SUBSCRIBED 14
+#define S2S_BULK_MAX 31 /* channels in one S2S_JOIN_BULK or S2S_SUBSCRIBED, which keeps it under 1024 bytes */
+#define S2S_SHARDS_MAX 64 /* engines one server's channels may be split between */
+#define S2S_DIGEST_BUCKETS 64 /* sums in an S2S_DIGEST, a channel's is its hash >> 26 */
 
 struct s2s_join {
     request_t req_type;   /* = S2S_JOIN */
@@ -123,10 +134,62 @@ struct s2s_leave {
 
 struct s2s_say {
     request_t req_type;   /* = S2S_SAY */
-    uint64_t unique_id;   /* unique identifier (loop prevention) */
+    uint64_t unique_id;   /* origin server id << 32 | origin's sequence number (loop prevention) */
     char req_username[USERNAME_MAX];
     char req_channel[CHANNEL_MAX];
     char req_text[SAY_MAX];
 } packed;
 
+/* About every second, and whenever the sender's place in the spanning tree
+* changes. Server ids are the address as ip << 16 | port. Each hello also
+* echoes the recipient's last one, which gives both ends the round trip. */
+struct s2s_hello {
+    request_t req_type;   /* = S2S_HELLO */
+    uint64_t root;        /* lowest server id the sender knows of */
+    uint32_t cost;        /* the sender's one way latency to it in us */
+    uint64_t parent;      /* the sender's next hop towards it, 0 at the root */
+    uint32_t stamp;       /* the sender's clock in us, never 0 */
+    uint32_t echo;        /* the last stamp the sender got from the recipient, 0 if none */
+    uint32_t held;        /* us between the sender getting that stamp and sending this */
+    uint32_t shards;      /* engines the sender's channels are split between, by hash */
+} packed;
+
+/* Several S2S_JOINs to one neighbor in one datagram. Only sent to
+* neighbors that send S2S_HELLO. */
+struct s2s_join_bulk {
+    request_t req_type;   /* = S2S_JOIN_BULK */
+    uint32_t nchannels;   /* 1 to S2S_BULK_MAX */
+    struct channel_info channels[0];
+} packed;
+
+/* Every 2 to 60 seconds, in place of renewing each join: the channels the
+* sender joined through the recipient, as the XOR of their hashes in
+* S2S_DIGEST_BUCKETS buckets. A server split into shards sends one digest
+* from each of its shards to each of the recipient's, the ones its hellos
+* count, covering the channels both of them hold. */
+struct s2s_digest {
+    request_t req_type;   /* = S2S_DIGEST */
+    uint16_t shard;       /* the sender's shard, of nshards */
+    uint16_t nshards;
+    uint16_t slot;        /* the recipient's shard, of nslots */
+    uint16_t nslots;
+    uint32_t nsums;       /* = S2S_DIGEST_BUCKETS */
+    uint32_t sums[0];
+} packed;
+
+/* The answer to digest sums that didn't match: every channel the digest's
+* sender is subscribed to in those buckets. The sender joins again the ones
+* it wants and leaves the others. Sent in parts of up to S2S_BULK_MAX. */
+struct s2s_subscribed {
+    request_t req_type;   /* = S2S_SUBSCRIBED */
+    uint16_t shard;       /* the digest's sender, of nshards */
+    uint16_t nshards;
+    uint16_t slot;        /* and its recipient, of nslots */
+    uint16_t nslots;
+    uint64_t buckets;     /* the sums that didn't match, bit n for bucket n */
+    uint32_t part;        /* 0 for the first */
+    uint32_t nchannels;   /* 0 to S2S_BULK_MAX */
+    struct channel_info channels[0];
+} packed;
+
 #endif
\ No newline at end of file
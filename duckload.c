@@ -0,0 +1,503 @@
+/*
+duckload.c
+simulates thousands of users over loopback and measures how long a say
+takes to reach everyone on the channel
+*/
+#include "duckchat.h"
+#include "lathist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define MAX_THREADS 64
+#define MAX_SERVERS 64
+#define MAX_MEMBERSHIPS 16
+#define SETUP_BURST 128 // requests sent before pausing during login/join
+#define SEND_BURST 256  // most says one wakeup may send to catch up
+#define LINGER_MS 1000  // time left for deliveries after the last say
+#define EPOLL_EVENTS 64
+
+struct sim_user {
+    int fd;
+    int nchannels;
+    int channels[MAX_MEMBERSHIPS];
+};
+
+struct load_thread {
+    pthread_t thread;
+    int index;
+    int first, count; // the users this thread sends for and receives on
+    int epoll_fd;
+    uint64_t rng;
+    // counted only for says sent inside the measurement window
+    uint64_t sent, expected;
+    uint64_t outside;    // deliveries of says sent during warmup or linger
+    uint64_t send_errors;
+    struct lathist latency; // every delivery
+    struct lathist remote;  // the ones that came in through another server
+};
+
+// globals
+struct sockaddr_in servers[MAX_SERVERS];
+int nservers = 0;
+struct sim_user *users;
+int nusers = 1000;
+int nchannels = 10;
+int memberships = 1;
+double zipf = 0;      // channel popularity exponent, 0 = uniform
+double say_rate = 1000; // says per second over all threads
+int nthreads = 4;
+int duration = 10;
+int warmup = 1;
+int json = 0;
+double *channel_cdf;  // cumulative popularity, for picking channels to join
+int *channel_members;
+// phase boundaries on the monotonic clock, set before the threads start
+uint64_t send_start, measure_start, measure_end, stop_at;
+
+// functions
+uint64_t now_ns();
+uint64_t next_random(uint64_t *state);
+int pick_channel(uint64_t *state);
+void channel_name(int c, char *name);
+int open_user(struct sim_user *u, int index);
+void setup_users();
+void teardown_users();
+void send_say(struct load_thread *t, uint64_t now);
+void drain_user(struct load_thread *t, struct sim_user *u);
+void *load_main(void *arg);
+void print_latency(const char *title, const struct lathist *h);
+void print_report(struct load_thread *total);
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one state per thread */
+uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+    a channel index drawn from the popularity distribution
+*/
+int pick_channel(uint64_t *state) {
+    double r = (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = nchannels - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (channel_cdf[mid] < r) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void channel_name(int c, char *name) {
+    memset(name, 0, CHANNEL_MAX);
+    snprintf(name, CHANNEL_MAX, "load%d", c);
+}
+
+/*
+    one socket per simulated user, connected so the server sees a distinct
+    address for each and only its replies come back
+*/
+int open_user(struct sim_user *u, int index) {
+    u->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (u->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_in *server = &servers[index % nservers];
+    if (connect(u->fd, (struct sockaddr *)server, sizeof(*server)) < 0) {
+        perror("connect");
+        return -1;
+    }
+    int flags = fcntl(u->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(u->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    log every user in and join its channels, pacing the requests so the
+    server's receive buffer doesn't overflow before the run even starts
+*/
+void setup_users() {
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    int pending = 0;
+    for (int i = 0; i < nusers; i++) {
+        struct sim_user *u = &users[i];
+        if (open_user(u, i) < 0) {
+            exit(1);
+        }
+
+        struct request_login login;
+        memset(&login, 0, sizeof(login));
+        login.req_type = REQ_LOGIN;
+        snprintf(login.req_username, USERNAME_MAX, "load%d", i);
+        if (send(u->fd, &login, sizeof(login), 0) < 0) {
+            perror("send login");
+            exit(1);
+        }
+
+        // distinct channels, drawn by popularity
+        u->nchannels = 0;
+        while (u->nchannels < memberships) {
+            int c = pick_channel(&rng);
+            int dup = 0;
+            for (int j = 0; j < u->nchannels; j++) {
+                dup |= u->channels[j] == c;
+            }
+            if (dup) {
+                continue;
+            }
+            u->channels[u->nchannels++] = c;
+            channel_members[c]++;
+
+            struct request_join join;
+            join.req_type = REQ_JOIN;
+            channel_name(c, join.req_channel);
+            if (send(u->fd, &join, sizeof(join), 0) < 0) {
+                perror("send join");
+                exit(1);
+            }
+        }
+
+        pending += 1 + u->nchannels;
+        if (pending >= SETUP_BURST) {
+            usleep(1000);
+            pending = 0;
+        }
+    }
+    // let the joins settle (and cross any server links) before saying anything
+    usleep(500000);
+}
+
+void teardown_users() {
+    struct request_logout logout;
+    logout.req_type = REQ_LOGOUT;
+    for (int i = 0; i < nusers; i++) {
+        if (send(users[i].fd, &logout, sizeof(logout), 0) < 0 && errno != EAGAIN) {
+            perror("send logout");
+        }
+        close(users[i].fd);
+        if (i % SETUP_BURST == SETUP_BURST - 1) {
+            usleep(1000);
+        }
+    }
+}
+
+/*
+    a say from a random user of this thread on one of its channels; the
+    text carries the send time so receivers can work out the latency, and
+    the sender's server so they can tell which deliveries crossed a link
+*/
+void send_say(struct load_thread *t, uint64_t now) {
+    int sender = t->first + next_random(&t->rng) % t->count;
+    struct sim_user *u = &users[sender];
+    int c = u->channels[next_random(&t->rng) % u->nchannels];
+
+    struct request_say say;
+    memset(&say, 0, sizeof(say));
+    say.req_type = REQ_SAY;
+    channel_name(c, say.req_channel);
+    snprintf(say.req_text, SAY_MAX, "%016llx %d", (unsigned long long)now, sender % nservers);
+
+    if (send(u->fd, &say, sizeof(say), 0) < 0) {
+        t->send_errors++;
+        return;
+    }
+    if (now >= measure_start && now < measure_end) {
+        t->sent++;
+        t->expected += channel_members[c]; // the sender gets its own say back
+    }
+}
+
+void drain_user(struct load_thread *t, struct sim_user *u) {
+    char buf[1024];
+    while (1) {
+        ssize_t len = recv(u->fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                perror("recv");
+            }
+            return;
+        }
+        struct text_say *txt = (struct text_say *)buf;
+        if ((size_t)len < sizeof(*txt) || txt->txt_type != TXT_SAY) {
+            continue; // errors and anything else the server volunteers
+        }
+        uint64_t now = now_ns();
+        char stamp[SAY_MAX];
+        memcpy(stamp, txt->txt_text, SAY_MAX);
+        stamp[SAY_MAX - 1] = '\0';
+        char *end;
+        uint64_t sent_at = strtoull(stamp, &end, 16);
+        int origin = (int)strtol(end, NULL, 10);
+        if (sent_at < measure_start || sent_at >= measure_end || sent_at > now) {
+            t->outside++;
+            continue;
+        }
+        lathist_record(&t->latency, now - sent_at);
+        if (origin != (int)(u - users) % nservers) {
+            lathist_record(&t->remote, now - sent_at);
+        }
+    }
+}
+
+/*
+    open loop: says go out on schedule whether or not earlier ones have
+    been delivered, so a slow server shows up as latency instead of a
+    lower send rate
+*/
+void *load_main(void *arg) {
+    struct load_thread *t = arg;
+    uint64_t interval = (uint64_t)(1e9 * nthreads / say_rate);
+    uint64_t next_send = send_start + interval * t->index / nthreads; // stagger the threads
+    struct epoll_event events[EPOLL_EVENTS];
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= stop_at) {
+            break;
+        }
+        while (next_send <= now && next_send < measure_end) {
+            send_say(t, now);
+            next_send += interval;
+            if (next_send < now && now - next_send > interval * SEND_BURST) {
+                next_send = now; // too far behind, give up on the backlog
+            }
+        }
+
+        uint64_t wake = next_send < measure_end ? next_send : stop_at;
+        int timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        int n = epoll_wait(t->epoll_fd, events, EPOLL_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            drain_user(t, &users[events[i].data.u32]);
+        }
+    }
+    return NULL;
+}
+
+void print_latency(const char *title, const struct lathist *h) {
+    if (json) {
+        printf("\"%s\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}", title,
+            lathist_percentile(h, 0.50) / 1e3, lathist_percentile(h, 0.99) / 1e3,
+            lathist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+        return;
+    }
+    printf("%-12s p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n", title,
+        lathist_percentile(h, 0.50) / 1e3, lathist_percentile(h, 0.99) / 1e3,
+        lathist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+}
+
+/*
+    human readable, or one JSON object with -j
+*/
+void print_report(struct load_thread *total) {
+    double seconds = duration;
+    double loss = total->expected ? 1.0 - (double)total->latency.count / total->expected : 0;
+
+    if (json) {
+        printf("{\"servers\": %d, \"users\": %d, \"channels\": %d, \"memberships\": %d, "
+            "\"zipf\": %g, \"threads\": %d, \"duration\": %d, \"target_rate\": %g, "
+            "\"says\": %llu, \"says_per_sec\": %.1f, "
+            "\"deliveries\": %llu, \"deliveries_per_sec\": %.1f, "
+            "\"expected_deliveries\": %llu, \"loss\": %.6f, \"send_errors\": %llu, "
+            "\"remote_deliveries\": %llu, ",
+            nservers, nusers, nchannels, memberships, zipf, nthreads, duration, say_rate,
+            (unsigned long long)total->sent, total->sent / seconds,
+            (unsigned long long)total->latency.count, total->latency.count / seconds,
+            (unsigned long long)total->expected, loss, (unsigned long long)total->send_errors,
+            (unsigned long long)total->remote.count);
+        print_latency("latency_us", &total->latency);
+        printf(", ");
+        print_latency("remote_latency_us", &total->remote);
+        printf("}\n");
+        return;
+    }
+
+    printf("%d users on %d server(s), %d channels, %d per user, zipf %g, %d threads, %ds\n",
+        nusers, nservers, nchannels, memberships, zipf, nthreads, duration);
+    printf("says:        %12llu  %10.1f/s (target %g/s)\n",
+        (unsigned long long)total->sent, total->sent / seconds, say_rate);
+    printf("deliveries:  %12llu  %10.1f/s\n",
+        (unsigned long long)total->latency.count, total->latency.count / seconds);
+    printf("expected:    %12llu  loss %.3f%%\n", (unsigned long long)total->expected, loss * 100);
+    if (total->send_errors) {
+        printf("send errors: %12llu\n", (unsigned long long)total->send_errors);
+    }
+    print_latency("latency:", &total->latency);
+    if (nservers > 1) {
+        printf("cross-server:%12llu\n", (unsigned long long)total->remote.count);
+        print_latency("latency:", &total->remote);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "+c:d:jm:r:t:u:w:z:")) != -1) {
+        switch (opt) {
+            case 'c':
+                nchannels = atoi(optarg);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'm':
+                memberships = atoi(optarg);
+                break;
+            case 'r':
+                say_rate = atof(optarg);
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'u':
+                nusers = atoi(optarg);
+                break;
+            case 'w':
+                warmup = atoi(optarg);
+                break;
+            case 'z':
+                zipf = atof(optarg);
+                break;
+            default:
+                argc = 0; // print usage
+                break;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 3 || argc % 2 == 0 || (argc - 1) / 2 > MAX_SERVERS || nchannels <= 0 ||
+        memberships <= 0 || memberships > MAX_MEMBERSHIPS || memberships > nchannels ||
+        say_rate <= 0 || nthreads <= 0 || nthreads > MAX_THREADS || nusers < nthreads ||
+        duration <= 0 || warmup < 0 || zipf < 0) {
+        fprintf(stderr, "Usage: %s [-u <users>] [-c <channels>] [-m <channels per user>] [-z <zipf exponent>] [-r <says per second>] [-t <threads>] [-d <seconds>] [-w <warmup seconds>] [-j] <server IP> <port> [<server IP> <port>]...\n", prog);
+        fprintf(stderr, "  users are spread round robin over the servers; -z 0 (default) joins channels uniformly\n");
+        exit(1);
+    }
+    for (int i = 1; i < argc; i += 2) {
+        struct sockaddr_in *s = &servers[nservers++];
+        memset(s, 0, sizeof(*s));
+        s->sin_family = AF_INET;
+        s->sin_port = htons(atoi(argv[i + 1]));
+        if (inet_pton(AF_INET, argv[i], &s->sin_addr) != 1) {
+            fprintf(stderr, "bad server address %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    // a socket per user, so make room for them
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < (rlim_t)nusers + 64) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+        if (lim.rlim_cur < (rlim_t)nusers + 64) {
+            fprintf(stderr, "warning: only %llu file descriptors for %d users\n",
+                (unsigned long long)lim.rlim_cur, nusers);
+        }
+    }
+
+    users = calloc(nusers, sizeof(*users));
+    channel_cdf = calloc(nchannels, sizeof(*channel_cdf));
+    channel_members = calloc(nchannels, sizeof(*channel_members));
+    if (users == NULL || channel_cdf == NULL || channel_members == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    double sum = 0;
+    for (int c = 0; c < nchannels; c++) {
+        sum += 1.0 / pow(c + 1, zipf);
+        channel_cdf[c] = sum;
+    }
+    for (int c = 0; c < nchannels; c++) {
+        channel_cdf[c] /= sum;
+    }
+
+    setup_users();
+
+    struct load_thread *threads = calloc(nthreads, sizeof(*threads));
+    if (threads == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        struct load_thread *t = &threads[i];
+        t->index = i;
+        t->first = (int)((long)nusers * i / nthreads);
+        t->count = (int)((long)nusers * (i + 1) / nthreads) - t->first;
+        t->rng = 0x853C49E6748FEA9BULL * (i + 1);
+        t->epoll_fd = epoll_create1(0);
+        if (t->epoll_fd < 0) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        for (int u = t->first; u < t->first + t->count; u++) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u32 = u;
+            if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, users[u].fd, &ev) < 0) {
+                perror("epoll_ctl");
+                exit(1);
+            }
+        }
+    }
+
+    send_start = now_ns() + 10000000ULL; // give every thread a chance to start
+    measure_start = send_start + warmup * 1000000000ULL;
+    measure_end = measure_start + duration * 1000000000ULL;
+    stop_at = measure_end + LINGER_MS * 1000000ULL;
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, load_main, &threads[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    struct load_thread total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < nthreads; i++) {
+        struct load_thread *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        close(t->epoll_fd);
+        total.sent += t->sent;
+        total.expected += t->expected;
+        lathist_merge(&total.latency, &t->latency);
+        lathist_merge(&total.remote, &t->remote);
+    }
+
+    teardown_users();
+    print_report(&total);
+    return 0;
+}
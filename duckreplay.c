@@ -0,0 +1,409 @@
+/*
+duckreplay.c
+plays a server's capture file back into a server, at the recorded pace,
+faster, or as fast as it will go
+*/
+#include "duckchat.h"
+#include "capture.h"
+#include "lathist.h"
+#include "addrmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define PENDING_MAX 64   // requests per source waiting for their answer
+#define LINGER_MS 1000   // time left for answers after the last datagram
+#define EPOLL_EVENTS 64
+#define MAX_BURST 64     // datagrams sent between checks for answers at full speed
+#define REPLAY_TYPES 16  // REQ_* and S2S_* by value, the last one counts anything else
+
+/* a request we expect an answer to, and when it went out */
+struct pending {
+    int type;            // TXT_* of the answer
+    uint32_t key;        // channel (and text, for a say) it has to match
+    uint64_t sent;
+};
+
+/*
+    one socket per address in the capture, so every client and neighbor
+    the server saw is a distinct sender again, on a local port
+*/
+struct replay_source {
+    int fd;
+    struct sockaddr_in orig;
+    char username[USERNAME_MAX]; // from its last LOGIN, say echoes carry it
+    struct pending pending[PENDING_MAX];
+    int npending;
+};
+
+// globals
+struct sockaddr_in server_addr;
+struct addrmap sources;          // address in the capture -> struct replay_source *
+struct replay_source **source_list;
+int nsources = 0, source_cap = 0;
+int epoll_fd;
+double speed = 1.0;              // 0 = as fast as possible
+int json = 0;
+uint64_t sent = 0, send_errors = 0, answers = 0, matched = 0, unanswered = 0;
+uint64_t sent_types[REPLAY_TYPES];
+struct lathist latency;
+
+// functions
+uint64_t now_ns();
+uint32_t key_hash(const char *a, size_t alen, const char *b, size_t blen);
+int by_time(const void *a, const void *b);
+struct replay_source *source_for(const struct capture_record *rec);
+void expect(struct replay_source *src, int type, uint32_t key, uint64_t now);
+void answer(struct replay_source *src, int type, uint32_t key, uint64_t now);
+void replay_one(const struct capture_record *rec, uint64_t now);
+void drain_source(struct replay_source *src);
+void poll_answers(int timeout);
+void print_report(size_t nrecords, double capture_seconds, double seconds);
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* FNV-1a over two fixed-width fields, stopping at their terminators */
+uint32_t key_hash(const char *a, size_t alen, const char *b, size_t blen) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < alen && a[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)a[i]) * 16777619u;
+    }
+    h = (h ^ 0xff) * 16777619u;
+    for (size_t i = 0; b != NULL && i < blen && b[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)b[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* record order within a worker is kept for equal times */
+int by_time(const void *a, const void *b) {
+    const struct capture_record *x = *(const struct capture_record **)a;
+    const struct capture_record *y = *(const struct capture_record **)b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+struct replay_source *source_for(const struct capture_record *rec) {
+    struct sockaddr_in orig;
+    memset(&orig, 0, sizeof(orig));
+    orig.sin_family = AF_INET;
+    orig.sin_addr.s_addr = rec->addr;
+    orig.sin_port = rec->port;
+    struct replay_source *src = addrmap_get(&sources, &orig);
+    if (src != NULL) {
+        return src;
+    }
+
+    src = calloc(1, sizeof(*src));
+    if (src == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    src->orig = orig;
+    src->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (src->fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(src->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int flags = fcntl(src->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(src->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    if (addrmap_put(&sources, &orig, src) < 0) {
+        perror("addrmap_put");
+        exit(1);
+    }
+    if (nsources == source_cap) {
+        source_cap = source_cap ? source_cap * 2 : 64;
+        source_list = realloc(source_list, source_cap * sizeof(*source_list));
+        if (source_list == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    source_list[nsources++] = src;
+    return src;
+}
+
+void expect(struct replay_source *src, int type, uint32_t key, uint64_t now) {
+    if (src->npending == PENDING_MAX) {
+        // the oldest one isn't coming
+        memmove(&src->pending[0], &src->pending[1], (PENDING_MAX - 1) * sizeof(struct pending));
+        src->npending--;
+        unanswered++;
+    }
+    struct pending *p = &src->pending[src->npending++];
+    p->type = type;
+    p->key = key;
+    p->sent = now;
+}
+
+/*
+    match an answer to the oldest request it could be for. requests the
+    server drops (a say to a channel the user isn't in, say) never match
+    and are counted at the end
+*/
+void answer(struct replay_source *src, int type, uint32_t key, uint64_t now) {
+    answers++;
+    for (int i = 0; i < src->npending; i++) {
+        struct pending *p = &src->pending[i];
+        if (p->type == type && p->key == key) {
+            lathist_record(&latency, now - p->sent);
+            matched++;
+            memmove(p, p + 1, (src->npending - i - 1) * sizeof(struct pending));
+            src->npending--;
+            return;
+        }
+    }
+}
+
+void replay_one(const struct capture_record *rec, uint64_t now) {
+    struct replay_source *src = source_for(rec);
+    const char *payload = (const char *)(rec + 1);
+
+    if (send(src->fd, payload, rec->len, 0) < 0) {
+        send_errors++;
+        return;
+    }
+    sent++;
+    if (rec->len < sizeof(struct request)) {
+        return;
+    }
+    int type = ((const struct request *)payload)->req_type;
+    sent_types[type >= 0 && type < REPLAY_TYPES - 1 ? type : REPLAY_TYPES - 1]++;
+
+    // remember what should come back, to time it
+    if (type == REQ_LOGIN && rec->len >= sizeof(struct request_login)) {
+        const struct request_login *r = (const struct request_login *)payload;
+        strncpy(src->username, r->req_username, USERNAME_MAX - 1);
+    } else if (type == REQ_SAY && rec->len >= sizeof(struct request_say)) {
+        const struct request_say *r = (const struct request_say *)payload;
+        expect(src, TXT_SAY, key_hash(r->req_channel, CHANNEL_MAX, r->req_text, SAY_MAX), now);
+    } else if (type == REQ_LIST) {
+        expect(src, TXT_LIST, 0, now);
+    } else if (type == REQ_WHO && rec->len >= sizeof(struct request_who)) {
+        const struct request_who *r = (const struct request_who *)payload;
+        expect(src, TXT_WHO, key_hash(r->req_channel, CHANNEL_MAX, NULL, 0), now);
+    }
+}
+
+void drain_source(struct replay_source *src) {
+    char buf[65536];
+    while (1) {
+        ssize_t len = recv(src->fd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                perror("recv");
+            }
+            return;
+        }
+        uint64_t now = now_ns();
+        struct text *txt = (struct text *)buf;
+        if ((size_t)len < sizeof(*txt)) {
+            continue;
+        }
+        if (txt->txt_type == TXT_SAY && (size_t)len >= sizeof(struct text_say)) {
+            struct text_say *t = (struct text_say *)buf;
+            // only our own say coming back answers one of ours
+            if (strncmp(t->txt_username, src->username, USERNAME_MAX) == 0) {
+                answer(src, TXT_SAY, key_hash(t->txt_channel, CHANNEL_MAX, t->txt_text, SAY_MAX), now);
+            }
+        } else if (txt->txt_type == TXT_LIST) {
+            answer(src, TXT_LIST, 0, now);
+        } else if (txt->txt_type == TXT_WHO && (size_t)len >= sizeof(struct text_who)) {
+            struct text_who *t = (struct text_who *)buf;
+            answer(src, TXT_WHO, key_hash(t->txt_channel, CHANNEL_MAX, NULL, 0), now);
+        }
+    }
+}
+
+void poll_answers(int timeout) {
+    struct epoll_event events[EPOLL_EVENTS];
+    int n = epoll_wait(epoll_fd, events, EPOLL_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        drain_source(events[i].data.ptr);
+    }
+}
+
+/*
+    human readable, or one JSON object with -j
+*/
+void print_report(size_t nrecords, double capture_seconds, double seconds) {
+    static const char *type_names[REPLAY_TYPES] = {
+        "LOGIN", "LOGOUT", "JOIN", "LEAVE", "SAY", "LIST", "WHO", "KEEP_ALIVE",
+        "S2S_JOIN", "S2S_LEAVE", "S2S_SAY", "S2S_HELLO", "S2S_JOIN_BULK", "S2S_DIGEST",
+        "S2S_SUBSCRIBED", "other"
+    };
+    double rate = seconds > 0 ? sent / seconds : 0;
+    if (json) {
+        printf("{\"records\": %zu, \"sources\": %d, \"speed\": %g, \"capture_seconds\": %.3f, "
+            "\"seconds\": %.3f, \"sent\": %llu, \"sent_per_sec\": %.1f, \"send_errors\": %llu, "
+            "\"answers\": %llu, \"matched\": %llu, \"unanswered\": %llu, \"sent_by_type\": {",
+            nrecords, nsources, speed, capture_seconds, seconds, (unsigned long long)sent, rate,
+            (unsigned long long)send_errors, (unsigned long long)answers,
+            (unsigned long long)matched, (unsigned long long)unanswered);
+        for (int i = 0; i < REPLAY_TYPES; i++) {
+            printf("%s\"%s\": %llu", i ? ", " : "", type_names[i], (unsigned long long)sent_types[i]);
+        }
+        printf("}, \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+            lathist_percentile(&latency, 0.50) / 1e3, lathist_percentile(&latency, 0.99) / 1e3,
+            lathist_percentile(&latency, 0.999) / 1e3, latency.max / 1e3);
+        return;
+    }
+
+    printf("%zu records from %d sources, %.3fs captured, replayed in %.3fs", nrecords, nsources,
+        capture_seconds, seconds);
+    if (speed > 0) {
+        printf(" at %gx\n", speed);
+    } else {
+        printf(" at full speed\n");
+    }
+    printf("sent:        %12llu  %10.1f/s", (unsigned long long)sent, rate);
+    if (send_errors) {
+        printf(", %llu failed", (unsigned long long)send_errors);
+    }
+    printf("\n");
+    for (int i = 0; i < REPLAY_TYPES; i++) {
+        if (sent_types[i]) {
+            printf("  %-10s %12llu\n", type_names[i], (unsigned long long)sent_types[i]);
+        }
+    }
+    printf("answered:    %12llu of %llu awaited, %llu datagrams back\n", (unsigned long long)matched,
+        (unsigned long long)(matched + unanswered), (unsigned long long)answers);
+    printf("latency:     p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+        lathist_percentile(&latency, 0.50) / 1e3, lathist_percentile(&latency, 0.99) / 1e3,
+        lathist_percentile(&latency, 0.999) / 1e3, latency.max / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "js:")) != -1) {
+        switch (opt) {
+            case 'j':
+                json = 1;
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            default:
+                argc = 0; // print usage
+                break;
+        }
+    }
+    if (argc - optind != 3 || speed < 0) {
+        fprintf(stderr, "Usage: %s [-j] [-s <speed, 0 = as fast as possible>] <capture file> <server IP> <port>\n", prog);
+        fprintf(stderr, "  every address in the capture gets its own local socket; answers to SAY, LIST and WHO are timed\n");
+        exit(1);
+    }
+    const char *path = argv[optind];
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[optind + 2]));
+    if (inet_pton(AF_INET, argv[optind + 1], &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "bad server address %s\n", argv[optind + 1]);
+        exit(1);
+    }
+
+    struct capture_reader reader;
+    if (capture_map(&reader, path) < 0) {
+        perror(path);
+        exit(1);
+    }
+    // workers append whole buffers, so put the records back in time order
+    size_t nrecords = 0, cap = 1024;
+    const struct capture_record **records = malloc(cap * sizeof(*records));
+    const struct capture_record *rec;
+    while (records != NULL && (rec = capture_next(&reader)) != NULL) {
+        if (nrecords == cap) {
+            cap *= 2;
+            records = realloc(records, cap * sizeof(*records));
+            if (records == NULL) {
+                break;
+            }
+        }
+        records[nrecords++] = rec;
+    }
+    if (records == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    if (nrecords == 0) {
+        fprintf(stderr, "%s holds no records\n", path);
+        exit(1);
+    }
+    qsort(records, nrecords, sizeof(*records), by_time);
+
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+        lim.rlim_cur = lim.rlim_max; // a socket per source
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+    addrmap_init(&sources);
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    uint64_t first = records[0]->time;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < nrecords; i++) {
+        if (speed > 0) {
+            // wait for the record's time, answering whatever comes in meanwhile
+            uint64_t due = start + (uint64_t)((records[i]->time - first) / speed);
+            uint64_t now;
+            while ((now = now_ns()) < due) {
+                poll_answers(due - now >= 2000000 ? (int)((due - now) / 1000000) - 1 : 0);
+            }
+        } else if (i % MAX_BURST == 0) {
+            poll_answers(0);
+        }
+        replay_one(records[i], now_ns());
+    }
+    uint64_t end = now_ns();
+
+    uint64_t linger_until = end + LINGER_MS * 1000000ULL;
+    uint64_t now;
+    while ((now = now_ns()) < linger_until) {
+        poll_answers((int)((linger_until - now) / 1000000) + 1);
+    }
+    for (int i = 0; i < nsources; i++) {
+        unanswered += source_list[i]->npending;
+        close(source_list[i]->fd);
+    }
+
+    print_report(nrecords, (records[nrecords - 1]->time - first) / 1e9, (end - start) / 1e9);
+    capture_unmap(&reader);
+    return 0;
+}
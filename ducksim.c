@@ -0,0 +1,705 @@
+/*
+ducksim.c
+runs a whole network of servers in one process, on a simulated network
+and a virtual clock, and reports how the server-to-server protocol behaved
+*/
+#include "duckchat.h"
+#include "engine.h"
+#include "dclog.h"
+#include "lathist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#define SERVER_NET 0x0a010000u   // server i is 10.1.0.0 + i
+#define USER_NET 0x0a800000u     // user j is 10.128.0.0 + j
+#define SERVER_PORT 4000
+#define USER_PORT 5000
+#define MAX_SIM_SERVERS 65536
+#define MAX_SIM_USERS (1 << 23)
+#define SETUP_MS 1000            // users log in and join over this long
+#define SETTLE_MS 1000           // then joins get this long to spread
+#define LINGER_MS 2000           // says still in flight after the last one get this long
+#define CONTROL_WINDOW_US 100000 // control traffic is counted in windows this long
+#define LOG_RING 65536
+#define DEDUP_EXPIRY 600         // seconds, as the server's default
+
+/* a datagram on the wire, due at its destination at a virtual time */
+struct sim_packet {
+    uint64_t due;                // virtual us
+    uint64_t seq;                // send order, so equal times always come out the same way
+    struct sockaddr_in from;
+    struct sockaddr_in to;
+    uint16_t len;
+    char buf[];
+};
+
+struct sim_server {
+    struct engine engine;
+    struct engine_transport transport;
+    int *links;                  // neighbor indexes
+    uint32_t *link_us;           // and each link's latency on top of -l
+    int nlinks, links_cap;
+};
+
+/* a scripted client. it logs in, joins its channels and says things */
+struct sim_user {
+    int server;
+    int *channels;
+};
+
+// globals
+struct sim_server *servers;
+int nservers = 100;
+struct sim_user *users;
+int nusers = 1000;
+int nchannels = 50;
+int channels_per_user = 2;
+int *channel_members;            // users in each channel, what a say should reach
+const char *topology = "mesh";
+int mesh_degree = 3;
+unsigned long long seed = 1;
+double say_rate = 1000;          // per virtual second
+double run_seconds = 10;
+double latency_ms = 5;           // one way, every hop
+double jitter_ms = 0;            // up to this much more between servers
+double spread_ms = 0;            // up to this much more on each link, fixed for the run
+double loss = 0;                 // percent of server to server datagrams lost
+long dedup_window = 256;
+int json = 0;
+uint64_t rng;
+uint64_t now_us = 0;
+
+struct sim_packet **heap;        // min-heap on (due, seq)
+size_t heap_count = 0, heap_cap = 0;
+uint64_t send_seq = 0;
+uint64_t wire_sent = 0, wire_lost = 0, wire_bytes = 0, peak_in_flight = 0;
+uint64_t control_sent = 0, control_window = 0, control_in_window = 0, peak_control = 0; // S2S but not says, once settled
+
+// what the users saw, per say
+uint64_t *say_sent;              // virtual us each say was sent at
+uint32_t *say_expected;
+uint32_t *say_delivered;
+uint64_t nsays = 0, says_cap = 0;
+uint64_t other_texts = 0;        // errors, lists and whos the users got back
+struct lathist latency;
+
+// functions
+uint64_t next_random();
+int linked(int a, int b);
+uint32_t link_extra(int a, int b);
+void add_link(int a, int b);
+int build_topology();
+int heap_before(const struct sim_packet *a, const struct sim_packet *b);
+void heap_push(struct sim_packet *p);
+struct sim_packet *heap_pop();
+void net_send(const struct sockaddr_in *from, const void *buf, size_t len, const struct sockaddr_in *to);
+void server_send(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to);
+void server_send_many(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to, uint32_t n);
+struct sockaddr_in server_addr(int i);
+struct sockaddr_in user_addr(int j);
+void deliver(struct sim_packet *p);
+void user_receive(int j, const char *buf, size_t len);
+void user_setup(int j);
+void user_say();
+void tick_servers();
+void print_report(double wall_seconds);
+
+/* xorshift64*, seeded from -s so a run can be repeated exactly */
+uint64_t next_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* checks the shorter of the two neighbor lists */
+int linked(int a, int b) {
+    struct sim_server *s = &servers[servers[a].nlinks <= servers[b].nlinks ? a : b];
+    int other = s == &servers[a] ? b : a;
+    for (int i = 0; i < s->nlinks; i++) {
+        if (s->links[i] == other) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* the extra latency of the link from a to b */
+uint32_t link_extra(int a, int b) {
+    struct sim_server *s = &servers[a];
+    for (int i = 0; i < s->nlinks; i++) {
+        if (s->links[i] == b) {
+            return s->link_us[i];
+        }
+    }
+    return 0;
+}
+
+void add_link(int a, int b) {
+    if (a == b || linked(a, b)) {
+        return;
+    }
+    uint32_t extra = spread_ms > 0 ? next_random() % ((uint64_t)(spread_ms * 1000) + 1) : 0;
+    int ends[2] = { a, b };
+    for (int i = 0; i < 2; i++) {
+        struct sim_server *s = &servers[ends[i]];
+        if (s->nlinks == s->links_cap) {
+            s->links_cap = s->links_cap ? s->links_cap * 2 : 4;
+            s->links = realloc(s->links, s->links_cap * sizeof(int));
+            s->link_us = realloc(s->link_us, s->links_cap * sizeof(uint32_t));
+            if (s->links == NULL || s->link_us == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        s->link_us[s->nlinks] = extra;
+        s->links[s->nlinks++] = ends[1 - i];
+    }
+}
+
+/*
+    links the servers up in the named topology, the same shapes ducktopo
+    builds. -1 if the name is unknown
+*/
+int build_topology() {
+    if (strcmp(topology, "line") == 0 || strcmp(topology, "ring") == 0) {
+        for (int i = 1; i < nservers; i++) {
+            add_link(i - 1, i);
+        }
+        if (topology[0] == 'r' && nservers > 2) {
+            add_link(nservers - 1, 0);
+        }
+    } else if (strcmp(topology, "star") == 0) {
+        for (int i = 1; i < nservers; i++) {
+            add_link(0, i);
+        }
+    } else if (strcmp(topology, "tree") == 0) {
+        for (int i = 1; i < nservers; i++) {
+            add_link((i - 1) / 2, i); // binary tree rooted at server 0
+        }
+    } else if (strcmp(topology, "mesh") == 0) {
+        // a random spanning tree keeps it connected, then random extra
+        // links until the average degree is reached
+        long nlinks = nservers - 1;
+        for (int i = 1; i < nservers; i++) {
+            add_link((int)(next_random() % i), i);
+        }
+        long want = (long)nservers * mesh_degree / 2;
+        if (want > (long)nservers * (nservers - 1) / 2) {
+            want = (long)nservers * (nservers - 1) / 2;
+        }
+        while (nlinks < want) {
+            int a = (int)(next_random() % nservers), b = (int)(next_random() % nservers);
+            if (a != b && !linked(a, b)) {
+                add_link(a, b);
+                nlinks++;
+            }
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int heap_before(const struct sim_packet *a, const struct sim_packet *b) {
+    return a->due != b->due ? a->due < b->due : a->seq < b->seq;
+}
+
+void heap_push(struct sim_packet *p) {
+    if (heap_count == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        heap = realloc(heap, heap_cap * sizeof(*heap));
+        if (heap == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    size_t i = heap_count++;
+    while (i > 0 && heap_before(p, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = p;
+    if (heap_count > peak_in_flight) {
+        peak_in_flight = heap_count;
+    }
+}
+
+struct sim_packet *heap_pop() {
+    struct sim_packet *top = heap[0];
+    struct sim_packet *last = heap[--heap_count];
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= heap_count) {
+            break;
+        }
+        if (child + 1 < heap_count && heap_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!heap_before(heap[child], last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (heap_count > 0) {
+        heap[i] = last;
+    }
+    return top;
+}
+
+/*
+    put a datagram on the wire. links to users are reliable and fixed; links
+    between servers add their own latency, the jitter and the loss, since
+    those are what the S2S protocol has to cope with
+*/
+void net_send(const struct sockaddr_in *from, const void *buf, size_t len, const struct sockaddr_in *to) {
+    int s2s = (ntohl(from->sin_addr.s_addr) & 0xffff0000u) == SERVER_NET &&
+              (ntohl(to->sin_addr.s_addr) & 0xffff0000u) == SERVER_NET;
+    uint64_t delay = (uint64_t)(latency_ms * 1000);
+    wire_sent++;
+    wire_bytes += len;
+    if (s2s && now_us >= (SETUP_MS + SETTLE_MS) * 1000ULL &&
+        len >= sizeof(request_t) && ((const struct request *)buf)->req_type != S2S_SAY) {
+        // the busiest window of control traffic after the joins, the bursts timers cause
+        control_sent++;
+        if (now_us / CONTROL_WINDOW_US != control_window) {
+            control_window = now_us / CONTROL_WINDOW_US;
+            control_in_window = 0;
+        }
+        if (++control_in_window > peak_control) {
+            peak_control = control_in_window;
+        }
+    }
+    if (s2s) {
+        if (loss > 0 && (next_random() % 1000000) < (uint64_t)(loss * 10000)) {
+            wire_lost++;
+            return;
+        }
+        if (jitter_ms > 0) {
+            delay += next_random() % ((uint64_t)(jitter_ms * 1000) + 1);
+        }
+        if (spread_ms > 0) {
+            delay += link_extra(ntohl(from->sin_addr.s_addr) & 0xffff, ntohl(to->sin_addr.s_addr) & 0xffff);
+        }
+    }
+    struct sim_packet *p = malloc(sizeof(struct sim_packet) + len);
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    p->due = now_us + delay;
+    p->seq = send_seq++;
+    p->from = *from;
+    p->to = *to;
+    p->len = len;
+    memcpy(p->buf, buf, len);
+    heap_push(p);
+}
+
+/* the engines' transport */
+void server_send(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to) {
+    struct sim_server *s = (struct sim_server *)ctx;
+    net_send(&s->engine.addr, buf, len, to);
+}
+
+void server_send_many(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to, uint32_t n) {
+    struct sim_server *s = (struct sim_server *)ctx;
+    for (uint32_t i = 0; i < n; i++) {
+        net_send(&s->engine.addr, buf, len, &to[i]);
+    }
+}
+
+struct sockaddr_in server_addr(int i) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(SERVER_NET + i);
+    addr.sin_port = htons(SERVER_PORT);
+    return addr;
+}
+
+struct sockaddr_in user_addr(int j) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(USER_NET + j);
+    addr.sin_port = htons(USER_PORT);
+    return addr;
+}
+
+/*
+    hand a datagram that has arrived to its server or user. anything
+    addressed elsewhere (a neighbor that was never started) is dropped
+*/
+void deliver(struct sim_packet *p) {
+    uint32_t to = ntohl(p->to.sin_addr.s_addr);
+    if ((to & 0xffff0000u) == SERVER_NET && (int)(to & 0xffff) < nservers) {
+        struct engine *e = &servers[to & 0xffff].engine;
+        engine_set_clock(e, now_us);
+        engine_handle(e, p->buf, p->len, &p->from);
+    } else if ((to & 0xff800000u) == USER_NET && (int)(to & 0x7fffff) < nusers) {
+        user_receive(to & 0x7fffff, p->buf, p->len);
+    }
+    free(p);
+}
+
+/*
+    a user's own say comes back too, it counts like any other delivery
+*/
+void user_receive(int j, const char *buf, size_t len) {
+    (void)j;
+    const struct text_say *t = (const struct text_say *)buf;
+    if (len < sizeof(struct text_say) || t->txt_type != TXT_SAY) {
+        other_texts++;
+        return;
+    }
+    uint64_t id = strtoull(t->txt_text, NULL, 10);
+    if (id >= nsays) {
+        return;
+    }
+    say_delivered[id]++;
+    lathist_record(&latency, (now_us - say_sent[id]) * 1000);
+}
+
+/*
+    log user j in to its server and join its channels, all at once
+*/
+void user_setup(int j) {
+    struct sim_user *u = &users[j];
+    struct sockaddr_in from = user_addr(j);
+    struct sockaddr_in to = server_addr(u->server);
+
+    struct request_login login;
+    memset(&login, 0, sizeof(login));
+    login.req_type = REQ_LOGIN;
+    snprintf(login.req_username, USERNAME_MAX, "u%d", j);
+    net_send(&from, &login, sizeof(login), &to);
+
+    for (int k = 0; k < channels_per_user; k++) {
+        struct request_join join;
+        memset(&join, 0, sizeof(join));
+        join.req_type = REQ_JOIN;
+        snprintf(join.req_channel, CHANNEL_MAX, "sim%d", u->channels[k]);
+        net_send(&from, &join, sizeof(join), &to);
+    }
+}
+
+/*
+    a random user says the next numbered line in one of its channels
+*/
+void user_say() {
+    int j = (int)(next_random() % nusers);
+    int c = users[j].channels[next_random() % channels_per_user];
+    if (nsays == says_cap) {
+        says_cap = says_cap ? says_cap * 2 : 4096;
+        say_sent = realloc(say_sent, says_cap * sizeof(*say_sent));
+        say_expected = realloc(say_expected, says_cap * sizeof(*say_expected));
+        say_delivered = realloc(say_delivered, says_cap * sizeof(*say_delivered));
+        if (say_sent == NULL || say_expected == NULL || say_delivered == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    say_sent[nsays] = now_us;
+    say_expected[nsays] = channel_members[c];
+    say_delivered[nsays] = 0;
+
+    struct request_say req;
+    memset(&req, 0, sizeof(req));
+    req.req_type = REQ_SAY;
+    snprintf(req.req_channel, CHANNEL_MAX, "sim%d", c);
+    snprintf(req.req_text, SAY_MAX, "%llu", (unsigned long long)nsays);
+    nsays++;
+    struct sockaddr_in from = user_addr(j);
+    struct sockaddr_in to = server_addr(users[j].server);
+    net_send(&from, &req, sizeof(req), &to);
+}
+
+/* every server's timers, once per wheel tick */
+void tick_servers() {
+    for (int i = 0; i < nservers; i++) {
+        engine_set_clock(&servers[i].engine, now_us);
+        engine_advance(&servers[i].engine);
+    }
+}
+
+/*
+    human readable, or one JSON object with -j
+*/
+void print_report(double wall_seconds) {
+    struct metrics total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < nservers; i++) {
+        struct metrics *m = &servers[i].engine.counters;
+        for (int t = 0; t < METRICS_TYPES; t++) {
+            total.received[t] += m->received[t];
+        }
+        total.dedup_hits += m->dedup_hits;
+        total.prunes += m->prunes;
+        total.renews += m->renews;
+        total.tree_changes += m->tree_changes;
+        total.bulk_joins += m->bulk_joins;
+        total.repairs += m->repairs;
+    }
+    uint64_t expected = 0, delivered = 0, missing = 0, extra = 0;
+    for (uint64_t i = 0; i < nsays; i++) {
+        expected += say_expected[i];
+        delivered += say_delivered[i];
+        if (say_delivered[i] < say_expected[i]) {
+            missing += say_expected[i] - say_delivered[i];
+        } else {
+            extra += say_delivered[i] - say_expected[i];
+        }
+    }
+    long links = 0;
+    for (int i = 0; i < nservers; i++) {
+        links += servers[i].nlinks;
+    }
+    links /= 2;
+    double virtual_seconds = now_us / 1e6;
+    double speedup = wall_seconds > 0 ? virtual_seconds / wall_seconds : 0;
+
+    if (json) {
+        printf("{\"servers\": %d, \"topology\": \"%s\", \"links\": %ld, \"users\": %d, \"channels\": %d, "
+            "\"seed\": %llu, \"link_ms\": %g, \"spread_ms\": %g, \"jitter_ms\": %g, \"loss_pct\": %g, "
+            "\"virtual_seconds\": %.3f, \"wall_seconds\": %.3f, \"speedup\": %.1f, "
+            "\"datagrams\": %llu, \"bytes\": %llu, \"lost\": %llu, \"peak_in_flight\": %llu, "
+            "\"control\": %llu, \"peak_control_per_window\": %llu, "
+            "\"s2s_join\": %llu, \"s2s_leave\": %llu, \"s2s_say\": %llu, \"dup\": %llu, \"prunes\": %llu, \"renews\": %llu, "
+            "\"s2s_hello\": %llu, \"tree_changes\": %llu, \"s2s_join_bulk\": %llu, \"bulk_joins\": %llu, "
+            "\"s2s_digest\": %llu, \"digest_mismatches\": %llu, \"s2s_subscribed\": %llu, "
+            "\"says\": %llu, \"expected\": %llu, \"delivered\": %llu, \"missing\": %llu, \"extra\": %llu, \"other_replies\": %llu, "
+            "\"latency_ms\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}}\n",
+            nservers, topology, links, nusers, nchannels, seed, latency_ms, spread_ms, jitter_ms, loss,
+            virtual_seconds, wall_seconds, speedup,
+            (unsigned long long)wire_sent, (unsigned long long)wire_bytes, (unsigned long long)wire_lost,
+            (unsigned long long)peak_in_flight, (unsigned long long)control_sent, (unsigned long long)peak_control,
+            (unsigned long long)total.received[S2S_JOIN], (unsigned long long)total.received[S2S_LEAVE],
+            (unsigned long long)total.received[S2S_SAY], (unsigned long long)total.dedup_hits,
+            (unsigned long long)total.prunes, (unsigned long long)total.renews,
+            (unsigned long long)total.received[S2S_HELLO], (unsigned long long)total.tree_changes,
+            (unsigned long long)total.received[S2S_JOIN_BULK], (unsigned long long)total.bulk_joins,
+            (unsigned long long)total.received[S2S_DIGEST], (unsigned long long)total.repairs,
+            (unsigned long long)total.received[S2S_SUBSCRIBED],
+            (unsigned long long)nsays, (unsigned long long)expected, (unsigned long long)delivered,
+            (unsigned long long)missing, (unsigned long long)extra, (unsigned long long)other_texts,
+            lathist_percentile(&latency, 0.50) / 1e6, lathist_percentile(&latency, 0.99) / 1e6,
+            latency.max / 1e6);
+        return;
+    }
+
+    printf("%d servers (%s, %ld links), %d users in %d channels, seed %llu\n",
+        nservers, topology, links, nusers, nchannels, seed);
+    printf("network:     %gms latency (up to %gms more per link), %gms jitter, %g%% loss between servers\n",
+        latency_ms, spread_ms, jitter_ms, loss);
+    printf("simulated:   %.3fs in %.3fs of wall time, %.1fx real time\n", virtual_seconds, wall_seconds, speedup);
+    printf("datagrams:   %12llu  %llu bytes, %llu lost, at most %llu in flight\n",
+        (unsigned long long)wire_sent, (unsigned long long)wire_bytes, (unsigned long long)wire_lost,
+        (unsigned long long)peak_in_flight);
+    printf("control:     %12llu  S2S datagrams other than says after setup, at most %llu in %dms\n",
+        (unsigned long long)control_sent, (unsigned long long)peak_control, CONTROL_WINDOW_US / 1000);
+    printf("S2S:         %12llu joins  %llu leaves  %llu says  %llu dup  %llu prunes  %llu renews\n",
+        (unsigned long long)total.received[S2S_JOIN], (unsigned long long)total.received[S2S_LEAVE],
+        (unsigned long long)total.received[S2S_SAY], (unsigned long long)total.dedup_hits,
+        (unsigned long long)total.prunes, (unsigned long long)total.renews);
+    printf("bulk joins:  %12llu  carrying %llu channels\n",
+        (unsigned long long)total.received[S2S_JOIN_BULK], (unsigned long long)total.bulk_joins);
+    printf("digests:     %12llu  %llu did not match, %llu lists back\n",
+        (unsigned long long)total.received[S2S_DIGEST], (unsigned long long)total.repairs,
+        (unsigned long long)total.received[S2S_SUBSCRIBED]);
+    printf("tree:        %12llu hellos  %llu parent changes, %.1f S2S says per say\n",
+        (unsigned long long)total.received[S2S_HELLO], (unsigned long long)total.tree_changes,
+        nsays ? (double)total.received[S2S_SAY] / nsays : 0.0);
+    printf("says:        %12llu  delivered %llu of %llu, %llu missing, %llu extra\n",
+        (unsigned long long)nsays, (unsigned long long)delivered, (unsigned long long)expected,
+        (unsigned long long)missing, (unsigned long long)extra);
+    if (other_texts) {
+        printf("             %12llu other replies to users (errors)\n", (unsigned long long)other_texts);
+    }
+    printf("latency:     p50 %.2fms  p99 %.2fms  max %.2fms\n",
+        lathist_percentile(&latency, 0.50) / 1e6, lathist_percentile(&latency, 0.99) / 1e6,
+        latency.max / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    int log_level = DCLOG_ERROR;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:e:jl:L:m:n:p:r:s:t:u:v:w:x:")) != -1) {
+        switch (opt) {
+            case 'c':
+                nchannels = atoi(optarg);
+                break;
+            case 'd':
+                mesh_degree = atoi(optarg);
+                break;
+            case 'e':
+                run_seconds = atof(optarg);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'l':
+                latency_ms = atof(optarg);
+                break;
+            case 'L':
+                log_level = atoi(optarg);
+                break;
+            case 'm':
+                channels_per_user = atoi(optarg);
+                break;
+            case 'n':
+                nservers = atoi(optarg);
+                break;
+            case 'p':
+                loss = atof(optarg);
+                break;
+            case 'r':
+                say_rate = atof(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                topology = optarg;
+                break;
+            case 'u':
+                nusers = atoi(optarg);
+                break;
+            case 'v':
+                spread_ms = atof(optarg);
+                break;
+            case 'w':
+                dedup_window = atol(optarg);
+                break;
+            case 'x':
+                jitter_ms = atof(optarg);
+                break;
+            default:
+                argc = 0; // print usage
+                break;
+        }
+    }
+    if (argc == 0 || optind != argc || nservers <= 0 || nservers > MAX_SIM_SERVERS ||
+        nusers <= 0 || nusers > MAX_SIM_USERS || nchannels <= 0 || channels_per_user <= 0 ||
+        channels_per_user > nchannels || say_rate <= 0 || run_seconds <= 0 || latency_ms < 0 ||
+        spread_ms < 0 || jitter_ms < 0 || loss < 0 || loss > 100 || dedup_window < 64 || dedup_window > (1L << 30) ||
+        log_level < DCLOG_ERROR || log_level > DCLOG_DEBUG) {
+        fprintf(stderr, "Usage: %s [-n <servers>] [-t line|star|tree|ring|mesh] [-d <mesh degree>] [-s <seed>] [-u <users>] [-c <channels>] [-m <channels per user>] [-r <says per second>] [-e <seconds>] [-l <latency ms>] [-v <latency spread ms>] [-x <jitter ms>] [-p <loss %%>] [-w <dedup window>] [-L <log level>] [-j]\n", prog);
+        fprintf(stderr, "  times are virtual; the same options and seed always give the same run\n");
+        exit(1);
+    }
+    rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    // the engines log like a server would, from this one thread
+    if (dclog_init(1, LOG_RING, stdout) < 0 || dclog_start() < 0) {
+        perror("dclog_init");
+        exit(1);
+    }
+    dclog_set_level(log_level);
+    dclog_thread(0);
+
+    servers = calloc(nservers, sizeof(struct sim_server));
+    users = calloc(nusers, sizeof(struct sim_user));
+    channel_members = calloc(nchannels, sizeof(int));
+    if (servers == NULL || users == NULL || channel_members == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    if (build_topology() < 0) {
+        fprintf(stderr, "unknown topology %s\n", topology);
+        exit(1);
+    }
+    for (int i = 0; i < nservers; i++) {
+        struct sim_server *s = &servers[i];
+        struct sockaddr_in addr = server_addr(i);
+        s->transport.ctx = s;
+        s->transport.send = server_send;
+        s->transport.send_many = server_send_many;
+        if (engine_init(&s->engine, &s->transport, &addr, i + 1, dedup_window, DEDUP_EXPIRY, 0) < 0) {
+            perror("engine_init");
+            exit(1);
+        }
+        for (int k = 0; k < s->nlinks; k++) {
+            struct sockaddr_in nbr = server_addr(s->links[k]);
+            if (engine_add_neighbor(&s->engine, &nbr) == NULL) {
+                exit(1);
+            }
+        }
+    }
+
+    // users spread round robin, each in distinct random channels
+    for (int j = 0; j < nusers; j++) {
+        struct sim_user *u = &users[j];
+        u->server = j % nservers;
+        u->channels = malloc(channels_per_user * sizeof(int));
+        if (u->channels == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int k = 0; k < channels_per_user; k++) {
+            int c, dup;
+            do {
+                c = (int)(next_random() % nchannels);
+                dup = 0;
+                for (int l = 0; l < k; l++) {
+                    dup |= u->channels[l] == c;
+                }
+            } while (dup);
+            u->channels[k] = c;
+            channel_members[c]++;
+        }
+    }
+
+    // one event at a time in virtual time order: a datagram arriving, a
+    // wheel tick, a user setting up, or the next say
+    uint64_t says_from = (SETUP_MS + SETTLE_MS) * 1000ULL;
+    uint64_t says_until = says_from + (uint64_t)(run_seconds * 1e6);
+    uint64_t end = says_until + LINGER_MS * 1000ULL;
+    double say_gap = 1e6 / say_rate;
+    uint64_t next_tick = ENGINE_TICK_MS * 1000ULL;
+    uint64_t say_count = 0;
+    int next_user = 0;
+
+    struct timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    while (1) {
+        uint64_t user_due = next_user < nusers ? (uint64_t)next_user * SETUP_MS * 1000 / nusers : UINT64_MAX;
+        uint64_t say_due = says_from + (uint64_t)(say_count * say_gap);
+        if (say_due >= says_until) {
+            say_due = UINT64_MAX;
+        }
+        uint64_t packet_due = heap_count > 0 ? heap[0]->due : UINT64_MAX;
+        uint64_t t = packet_due;
+        t = next_tick < t ? next_tick : t;
+        t = user_due < t ? user_due : t;
+        t = say_due < t ? say_due : t;
+        if (t >= end) {
+            break;
+        }
+        now_us = t;
+        if (packet_due == t) {
+            deliver(heap_pop());
+        } else if (next_tick == t) {
+            tick_servers();
+            next_tick += ENGINE_TICK_MS * 1000ULL;
+        } else if (user_due == t) {
+            user_setup(next_user++);
+        } else {
+            user_say();
+            say_count++;
+        }
+    }
+    now_us = end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    print_report((wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9);
+    dclog_flush();
+    return 0;
+}
@@ -0,0 +1,120 @@
+/*
+duckstat.c
+reads a running server's counters out of its shared memory page
+*/
+#include "duckchat.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+// functions
+void print_report(const struct metrics *now, const struct metrics *prev, double seconds);
+void print_hist(const char *title, const char *unit, const uint64_t *now, const uint64_t *prev);
+uint64_t hist_percentile(const uint64_t *hist, const uint64_t *prev, double p);
+
+const char *type_names[METRICS_TYPES] = {
+    "LOGIN", "LOGOUT", "JOIN", "LEAVE", "SAY", "LIST", "WHO", "KEEP_ALIVE",
+    "S2S_JOIN", "S2S_LEAVE", "S2S_SAY", "S2S_HELLO", "S2S_JOIN_BULK", "S2S_DIGEST",
+    "S2S_SUBSCRIBED", "other"
+};
+
+/*
+    upper bound of the bucket holding the p-th percentile
+*/
+uint64_t hist_percentile(const uint64_t *hist, const uint64_t *prev, double p) {
+    uint64_t count = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        count += hist[i] - prev[i];
+    }
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t want = (uint64_t)(p * count + 0.5), seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += hist[i] - prev[i];
+        if (seen >= want && seen > 0) {
+            return 2ULL << i;
+        }
+    }
+    return 2ULL << (METRICS_BUCKETS - 1);
+}
+
+void print_hist(const char *title, const char *unit, const uint64_t *now, const uint64_t *prev) {
+    printf("%s (p50 < %llu%s, p99 < %llu%s)\n", title,
+        (unsigned long long)hist_percentile(now, prev, 0.50), unit,
+        (unsigned long long)hist_percentile(now, prev, 0.99), unit);
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        uint64_t n = now[i] - prev[i];
+        if (n != 0) {
+            printf("  %10llu - %-10llu %12llu\n", (unsigned long long)(i ? 1ULL << i : 0),
+                (unsigned long long)(2ULL << i) - 1, (unsigned long long)n);
+        }
+    }
+}
+
+/*
+    print the counters, as rates when there is an earlier sample to compare to
+*/
+void print_report(const struct metrics *now, const struct metrics *prev, double seconds) {
+    const char *per = seconds > 0 ? "/s" : "";
+    double div = seconds > 0 ? seconds : 1.0;
+    int prec = seconds > 0 ? 1 : 0; // totals are whole numbers
+
+    printf("received%s:\n", per);
+    for (int i = 0; i < METRICS_TYPES; i++) {
+        printf("  %-10s %12.*f\n", type_names[i], prec, (now->received[i] - prev->received[i]) / div);
+    }
+    printf("dropped, bad length%s  %12.*f\n", per, prec, (now->bad_length - prev->bad_length) / div);
+    printf("dropped, bad string%s  %12.*f\n", per, prec, (now->bad_string - prev->bad_string) / div);
+    printf("dedup hits%s           %12.*f\n", per, prec, (now->dedup_hits - prev->dedup_hits) / div);
+    printf("neighbors pruned%s     %12.*f\n", per, prec, (now->prunes - prev->prunes) / div);
+    printf("joins repaired%s       %12.*f\n", per, prec, (now->renews - prev->renews) / div);
+    printf("tree changes%s         %12.*f\n", per, prec, (now->tree_changes - prev->tree_changes) / div);
+    printf("bulk joined channels%s %12.*f\n", per, prec, (now->bulk_joins - prev->bulk_joins) / div);
+    printf("digest mismatches%s    %12.*f\n", per, prec, (now->repairs - prev->repairs) / div);
+    printf("fan-outs%s             %12.*f\n", per, prec, (now->fanouts - prev->fanouts) / div);
+    print_hist("fan-out size", "", now->fanout_hist, prev->fanout_hist);
+    uint64_t handled = now->handled - prev->handled;
+    printf("handled%s              %12.*f, mean %.0fns\n", per, prec, handled / div,
+        handled ? (double)(now->handle_ns - prev->handle_ns) / handled : 0.0);
+    print_hist("handling time", "ns", now->handle_hist, prev->handle_hist);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <server port> [<interval seconds>]\n", argv[0]);
+        exit(1);
+    }
+    int port = atoi(argv[1]);
+    int interval = argc == 3 ? atoi(argv[2]) : 0;
+
+    struct metrics_page *page = metrics_attach(port);
+    if (page == NULL) {
+        perror("metrics_attach");
+        exit(1);
+    }
+    if (kill(page->pid, 0) < 0 && errno == ESRCH) {
+        fprintf(stderr, "warning: server pid %d is gone, these are its last counters\n", page->pid);
+    }
+
+    struct metrics prev, now;
+    memset(&prev, 0, sizeof(prev));
+    metrics_sum(page, &now);
+    printf("server on port %d, pid %d, %u workers, totals since start\n", page->port, page->pid, page->nworkers);
+    print_report(&now, &prev, 0);
+
+    // with an interval, keep printing rates over each one
+    while (interval > 0) {
+        prev = now;
+        sleep(interval);
+        metrics_sum(page, &now);
+        printf("\nlast %d seconds\n", interval);
+        print_report(&now, &prev, interval);
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ducktopo.c
+starts a network of servers on localhost, loads it with duckload and
+reports what the server-to-server traffic cost
+*/
+#include "duckchat.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#define MAX_SERVERS 64
+#define MAX_LINKS (MAX_SERVERS * (MAX_SERVERS - 1) / 2)
+#define START_TIMEOUT_MS 5000
+#define SETTLE_MS 300 // longer than a server tick, so the last counters are published
+
+struct topo_server {
+    int port;
+    pid_t pid;
+    struct metrics_page *page;
+    struct metrics before, after;
+};
+
+// globals
+struct topo_server servers[MAX_SERVERS];
+int nservers = 4;
+int links[MAX_LINKS][2];
+int nlinks = 0;
+const char *topology = "line";
+int base_port = 5700;
+int mesh_degree = 3;
+unsigned long long seed = 1;
+int workers = 1;
+int json = 0;
+char server_path[4096], load_path[4096];
+
+// functions
+uint64_t next_random(uint64_t *state);
+int linked(int a, int b);
+void add_link(int a, int b);
+int build_topology();
+void start_server(struct topo_server *s, int index);
+void wait_for_page(struct topo_server *s);
+void stop_servers();
+int run_load(char **load_args, int nload_args, char *result, size_t len);
+void print_report(const char *load_json);
+
+/* xorshift64*, seeded from -s so a mesh can be rebuilt exactly */
+uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+int linked(int a, int b) {
+    for (int i = 0; i < nlinks; i++) {
+        if ((links[i][0] == a && links[i][1] == b) || (links[i][0] == b && links[i][1] == a)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void add_link(int a, int b) {
+    if (a != b && !linked(a, b)) {
+        links[nlinks][0] = a < b ? a : b;
+        links[nlinks][1] = a < b ? b : a;
+        nlinks++;
+    }
+}
+
+/*
+    fills in links for the named topology, -1 if the name is unknown
+*/
+int build_topology() {
+    if (strcmp(topology, "line") == 0 || strcmp(topology, "ring") == 0) {
+        for (int i = 1; i < nservers; i++) {
+            add_link(i - 1, i);
+        }
+        if (topology[0] == 'r' && nservers > 2) {
+            add_link(nservers - 1, 0);
+        }
+    } else if (strcmp(topology, "star") == 0) {
+        for (int i = 1; i < nservers; i++) {
+            add_link(0, i);
+        }
+    } else if (strcmp(topology, "tree") == 0) {
+        for (int i = 1; i < nservers; i++) {
+            add_link((i - 1) / 2, i); // binary tree rooted at server 0
+        }
+    } else if (strcmp(topology, "mesh") == 0) {
+        // a random spanning tree keeps it connected, then random extra
+        // links until the average degree is reached
+        uint64_t rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+        for (int i = 1; i < nservers; i++) {
+            add_link((int)(next_random(&rng) % i), i);
+        }
+        int want = nservers * mesh_degree / 2;
+        if (want > nservers * (nservers - 1) / 2) {
+            want = nservers * (nservers - 1) / 2;
+        }
+        while (nlinks < want) {
+            add_link((int)(next_random(&rng) % nservers), (int)(next_random(&rng) % nservers));
+        }
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    fork and exec a server with its neighbors on the command line. its
+    own output is thrown away; errors still reach our stderr
+*/
+void start_server(struct topo_server *s, int index) {
+    char *argv[16 + 2 * MAX_SERVERS];
+    char ports[MAX_SERVERS][16], nworkers[16];
+    int argc = 0;
+    snprintf(nworkers, sizeof(nworkers), "%d", workers);
+    argv[argc++] = server_path;
+    argv[argc++] = "-l";
+    argv[argc++] = "0";
+    argv[argc++] = "-t";
+    argv[argc++] = nworkers;
+    argv[argc++] = "127.0.0.1";
+    snprintf(ports[index], sizeof(ports[index]), "%d", s->port);
+    argv[argc++] = ports[index];
+    for (int i = 0; i < nlinks; i++) {
+        int other = links[i][0] == index ? links[i][1] : links[i][1] == index ? links[i][0] : -1;
+        if (other < 0) {
+            continue;
+        }
+        snprintf(ports[other], sizeof(ports[other]), "%d", servers[other].port);
+        argv[argc++] = "127.0.0.1";
+        argv[argc++] = ports[other];
+    }
+    argv[argc] = NULL;
+
+    s->pid = fork();
+    if (s->pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (s->pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        execv(server_path, argv);
+        perror(server_path);
+        _exit(127);
+    }
+}
+
+/*
+    a server is up once it has published its counter page
+*/
+void wait_for_page(struct topo_server *s) {
+    for (int waited = 0; waited < START_TIMEOUT_MS; waited += 10) {
+        s->page = metrics_attach(s->port);
+        if (s->page != NULL && s->page->pid == s->pid) {
+            return;
+        }
+        // a page left behind by an earlier run, or none yet
+        s->page = NULL;
+        usleep(10000);
+    }
+    fprintf(stderr, "server on port %d did not start\n", s->port);
+    stop_servers();
+    exit(1);
+}
+
+void stop_servers() {
+    for (int i = 0; i < nservers; i++) {
+        if (servers[i].pid > 0) {
+            kill(servers[i].pid, SIGTERM);
+            waitpid(servers[i].pid, NULL, 0);
+            servers[i].pid = 0;
+            metrics_unlink(servers[i].port);
+        }
+    }
+}
+
+/*
+    run duckload against every server and keep its JSON line
+*/
+int run_load(char **load_args, int nload_args, char *result, size_t len) {
+    char *argv[8 + 64 + 2 * MAX_SERVERS];
+    char ports[MAX_SERVERS][16];
+    int argc = 0;
+    argv[argc++] = load_path;
+    argv[argc++] = "-j";
+    for (int i = 0; i < nload_args && i < 64; i++) {
+        argv[argc++] = load_args[i];
+    }
+    for (int i = 0; i < nservers; i++) {
+        snprintf(ports[i], sizeof(ports[i]), "%d", servers[i].port);
+        argv[argc++] = "127.0.0.1";
+        argv[argc++] = ports[i];
+    }
+    argv[argc] = NULL;
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(load_path, argv);
+        perror(load_path);
+        _exit(127);
+    }
+    close(fds[1]);
+    size_t used = 0;
+    ssize_t n;
+    while (used + 1 < len && (n = read(fds[0], result + used, len - used - 1)) > 0) {
+        used += n;
+    }
+    result[used] = '\0';
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || used == 0) {
+        return -1;
+    }
+    char *nl = strchr(result, '\n');
+    if (nl != NULL) {
+        *nl = '\0';
+    }
+    return 0;
+}
+
+/*
+    S2S traffic from the counter deltas. every S2S message is counted by
+    the server that received it, so summing over servers counts each
+    one once. says are data, everything else is control
+*/
+void print_report(const char *load_json) {
+    uint64_t joins = 0, bulks = 0, bulk_joins = 0, leaves = 0, hellos = 0, says = 0, dups = 0, prunes = 0;
+    uint64_t digests = 0, lists = 0, listed = 0;
+    for (int i = 0; i < nservers; i++) {
+        struct metrics *b = &servers[i].before, *a = &servers[i].after;
+        joins += a->received[S2S_JOIN] - b->received[S2S_JOIN];
+        bulks += a->received[S2S_JOIN_BULK] - b->received[S2S_JOIN_BULK];
+        bulk_joins += a->bulk_joins - b->bulk_joins;
+        digests += a->received[S2S_DIGEST] - b->received[S2S_DIGEST];
+        lists += a->received[S2S_SUBSCRIBED] - b->received[S2S_SUBSCRIBED];
+        listed += a->listed - b->listed;
+        leaves += a->received[S2S_LEAVE] - b->received[S2S_LEAVE];
+        hellos += a->received[S2S_HELLO] - b->received[S2S_HELLO];
+        says += a->received[S2S_SAY] - b->received[S2S_SAY];
+        dups += a->dedup_hits - b->dedup_hits;
+        prunes += a->prunes - b->prunes;
+    }
+    uint64_t control = joins * sizeof(struct s2s_join) + leaves * sizeof(struct s2s_leave) +
+        hellos * sizeof(struct s2s_hello) + bulks * sizeof(struct s2s_join_bulk) +
+        bulk_joins * sizeof(struct channel_info) + digests * (sizeof(struct s2s_digest) + S2S_DIGEST_BUCKETS * sizeof(uint32_t)) +
+        lists * sizeof(struct s2s_subscribed) + listed * sizeof(struct channel_info);
+    uint64_t data = says * sizeof(struct s2s_say);
+    double ratio = data ? (double)control / data : 0;
+
+    if (json) {
+        printf("{\"topology\": \"%s\", \"servers\": %d, \"seed\": %llu, \"workers\": %d, \"links\": [",
+            topology, nservers, seed, workers);
+        for (int i = 0; i < nlinks; i++) {
+            printf("%s[%d, %d]", i ? ", " : "", links[i][0], links[i][1]);
+        }
+        printf("], \"s2s_joins\": %llu, \"s2s_join_bulks\": %llu, \"bulk_joined_channels\": %llu, "
+            "\"s2s_leaves\": %llu, \"s2s_hellos\": %llu, \"s2s_digests\": %llu, \"s2s_subscribed\": %llu, "
+            "\"subscribed_channels\": %llu, \"s2s_says\": %llu, "
+            "\"duplicate_says\": %llu, \"prunes\": %llu, \"control_bytes\": %llu, "
+            "\"data_bytes\": %llu, \"control_per_data_byte\": %.6f, \"load\": %s}\n",
+            (unsigned long long)joins, (unsigned long long)bulks, (unsigned long long)bulk_joins,
+            (unsigned long long)leaves, (unsigned long long)hellos, (unsigned long long)digests,
+            (unsigned long long)lists, (unsigned long long)listed, (unsigned long long)says,
+            (unsigned long long)dups, (unsigned long long)prunes, (unsigned long long)control,
+            (unsigned long long)data, ratio, load_json);
+        return;
+    }
+
+    printf("%s of %d servers (seed %llu, %d workers each), %d links:", topology, nservers,
+        seed, workers, nlinks);
+    for (int i = 0; i < nlinks; i++) {
+        printf(" %d-%d", links[i][0], links[i][1]);
+    }
+    printf("\n\n%-8s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "server", "S2S_JOIN", "JOIN_BULK", "bulk chans",
+        "S2S_LEAVE", "S2S_HELLO", "S2S_DIGEST", "SUBSCRIBED", "S2S_SAY", "dup SAY");
+    for (int i = 0; i < nservers; i++) {
+        struct metrics *b = &servers[i].before, *a = &servers[i].after;
+        printf("%-8d %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n", servers[i].port,
+            (unsigned long long)(a->received[S2S_JOIN] - b->received[S2S_JOIN]),
+            (unsigned long long)(a->received[S2S_JOIN_BULK] - b->received[S2S_JOIN_BULK]),
+            (unsigned long long)(a->bulk_joins - b->bulk_joins),
+            (unsigned long long)(a->received[S2S_LEAVE] - b->received[S2S_LEAVE]),
+            (unsigned long long)(a->received[S2S_HELLO] - b->received[S2S_HELLO]),
+            (unsigned long long)(a->received[S2S_DIGEST] - b->received[S2S_DIGEST]),
+            (unsigned long long)(a->received[S2S_SUBSCRIBED] - b->received[S2S_SUBSCRIBED]),
+            (unsigned long long)(a->received[S2S_SAY] - b->received[S2S_SAY]),
+            (unsigned long long)(a->dedup_hits - b->dedup_hits));
+    }
+    printf("%-8s %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n\n", "total", (unsigned long long)joins,
+        (unsigned long long)bulks, (unsigned long long)bulk_joins, (unsigned long long)leaves,
+        (unsigned long long)hellos, (unsigned long long)digests, (unsigned long long)lists,
+        (unsigned long long)says, (unsigned long long)dups);
+    printf("control bytes %llu, data bytes %llu, %.4f control bytes per data byte\n",
+        (unsigned long long)control, (unsigned long long)data, ratio);
+    printf("load: %s\n", load_json);
+}
+
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    int opt;
+    while ((opt = getopt(argc, argv, "+b:d:jn:s:t:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                base_port = atoi(optarg);
+                break;
+            case 'd':
+                mesh_degree = atoi(optarg);
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'n':
+                nservers = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 't':
+                topology = optarg;
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            default:
+                argc = 0; // print usage
+                break;
+        }
+    }
+    if (argc == 0 || nservers < 1 || nservers > MAX_SERVERS || mesh_degree < 1 || workers < 1 ||
+        base_port <= 0 || base_port + nservers > 65536 || build_topology() < 0) {
+        fprintf(stderr, "Usage: %s [-b <base port>] [-d <mesh degree>] [-j] [-n <servers>] [-s <seed>] [-t line|star|tree|ring|mesh] [-w <workers per server>] [-- <duckload options>]\n", prog);
+        fprintf(stderr, "  servers listen on consecutive ports from the base; -s picks the mesh, -d its average degree\n");
+        exit(1);
+    }
+
+    // server and duckload are expected next to us
+    const char *slash = strrchr(prog, '/');
+    int dir = slash ? (int)(slash - prog + 1) : 0;
+    snprintf(server_path, sizeof(server_path), "%.*sserver", dir, prog);
+    snprintf(load_path, sizeof(load_path), "%.*sduckload", dir, prog);
+    if (dir == 0) {
+        strcpy(server_path, "./server");
+        strcpy(load_path, "./duckload");
+    }
+
+    for (int i = 0; i < nservers; i++) {
+        servers[i].port = base_port + i;
+    }
+    for (int i = 0; i < nservers; i++) {
+        start_server(&servers[i], i);
+    }
+    for (int i = 0; i < nservers; i++) {
+        wait_for_page(&servers[i]);
+        metrics_sum(servers[i].page, &servers[i].before);
+    }
+
+    char load_json[4096];
+    int failed = run_load(argv + optind, argc - optind, load_json, sizeof(load_json));
+
+    usleep(SETTLE_MS * 1000);
+    for (int i = 0; i < nservers; i++) {
+        metrics_sum(servers[i].page, &servers[i].after);
+    }
+    stop_servers();
+    if (failed) {
+        fprintf(stderr, "duckload failed\n");
+        exit(1);
+    }
+    print_report(load_json);
+    return 0;
+}
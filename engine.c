@@ -0,0 +1,1684 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <arpa/inet.h>
+#include "engine.h"
+#include "dclog.h"
+/* See engine.h for usage information */
+
+#define DIGEST_INTERVAL 10       // seconds between S2S digests to a new neighbor
+#define DIGEST_MIN 2             // seconds between them while the link is unsettled, at the least
+#define DIGEST_MAX 60            // and once it has been quiet for a while, at the most
+#define NEIGHBOR_TIMEOUT 120     // seconds of silence before a neighbor is pruned from its channels
+#define HELLO_INTERVAL 1000      // ms between S2S hellos to every neighbor
+#define HELLO_TIMEOUT 3500       // ms without a hello before a neighbor drops out of the tree
+#define TREE_MAX_COST 5000000    // us to a root beyond which it counts as unreachable
+#define HOP_COST 100             // us a link costs on top of its latency, so fewer hops win a tie
+#define RTT_GUESS 1000           // us round trip for a link not measured yet
+#define TREE_HYSTERESIS 8        // a new parent has to be 1/8 (and a hop) cheaper than the current one
+#define JOIN_REPEATS 2           // hello rounds that repeat a channel's joins after a new one
+
+static void vengine_log(struct engine *e, int level, int category, const char *fmt, va_list args);
+static void engine_print(struct engine *e, const char *fmt, ...);
+static void log_message(struct engine *e, const struct sockaddr_in *remote_addr,
+                        const char *direction, const char *message_type, const char *channel,
+                        const char *username, const char *text);
+static void send_d(struct engine *e, void *txt, size_t txt_size, const struct sockaddr_in *addr);
+static void fan_out(struct engine *e, const void *buf, size_t len, const struct sockaddr_in *dests, uint32_t n);
+static struct sockaddr_in *reserve_dests(struct engine *e, uint32_t n);
+static void send_err(struct engine *e, char *err, const struct sockaddr_in *client_addr);
+static int validate_str(struct engine *e, const char *str, size_t max_len);
+static int validate_pac(struct engine *e, int rcv_len, int correct_len);
+static uint64_t generate_unique_id(struct engine *e);
+static int isdup(struct engine *e, uint64_t message_id);
+static void digest_expired(void *arg);
+static void send_digest(struct engine *e, struct neighbor *nbr);
+static uint32_t digest_bucket(uint32_t hash);
+static void toggle_digest_sum(struct neighbor *nbr, uint32_t *sums, const char *channel_name);
+static void reset_digest_sums(struct engine *e, struct neighbor *nbr, uint32_t shards);
+static uint64_t engine_random(struct engine *e);
+static uint64_t jittered(struct engine *e, uint64_t ms);
+static void handle_digest(struct engine *e, struct s2s_digest *digest, int len, const struct sockaddr_in *from);
+static void send_subscribed(struct engine *e, struct neighbor *nbr, const struct sockaddr_in *to, struct s2s_digest *digest, uint64_t buckets);
+static void handle_subscribed(struct engine *e, struct s2s_subscribed *subscribed, int len, const struct sockaddr_in *from);
+static void watch_neighbor(struct engine *e, struct neighbor *nbr);
+static void neighbor_expired(void *arg);
+static struct channel *route_channel(struct engine *e, struct route *r);
+static void add_neighbor_to_channel(struct engine *e, char *channel_name, const struct sockaddr_in *neighbor_addr);
+static void remove_neighbor_from_channel(struct engine *e, char *channel_name, const struct sockaddr_in *neighbor_addr);
+static uint64_t server_id(const struct sockaddr_in *addr);
+static void hello_expired(void *arg);
+static void repeat_joins(struct engine *e);
+static void send_hellos(struct engine *e, struct neighbor *only);
+static void handle_hello(struct engine *e, struct s2s_hello *hello, const struct sockaddr_in *from);
+static int hello_alive(struct engine *e, struct neighbor *nbr);
+static void measure_rtt(struct engine *e, struct neighbor *nbr, struct s2s_hello *hello);
+static uint32_t link_cost(struct neighbor *nbr);
+static int cost_moved(uint32_t cost, uint32_t from);
+static struct neighbor *choose_parent(struct engine *e, uint64_t *root, uint32_t *cost);
+static void update_tree(struct engine *e);
+static void update_interest(struct engine *e, struct channel *ch);
+static void send_join(struct engine *e, struct neighbor *nbr, const char *channel_name, const char *direction);
+static void send_leave(struct engine *e, const struct sockaddr_in *addr, const char *channel_name);
+static void send_one_join(struct engine *e, const struct sockaddr_in *addr, const char *channel_name);
+static void send_queued_joins(struct engine *e, struct neighbor *nbr);
+static void flush_joins(struct engine *e);
+static void handle_s2s_join(struct engine *e, char *channel_name, const struct sockaddr_in *from);
+static void handle_join_bulk(struct engine *e, struct s2s_join_bulk *bulk, int len, const struct sockaddr_in *from);
+static void s2s_say(struct engine *e, char *username, struct channel *ch, char *message, uint64_t unique_id);
+static void login(struct engine *e, char *username, const struct sockaddr_in *client_addr);
+static void logout(struct engine *e, const struct sockaddr_in *client_addr);
+static void join_channel(struct engine *e, char *channel_name, const struct sockaddr_in *client_addr);
+static void leave_channel(struct engine *e, char *channel_name, const struct sockaddr_in *client_addr);
+static void part_channel(struct engine *e, struct membership *m);
+static void say(struct engine *e, char *channel_name, char *message, const struct sockaddr_in *client_addr);
+static void list_channels(struct engine *e, const struct sockaddr_in *client_addr);
+static void send_list(struct engine *e, struct text_list *txt, const struct sockaddr_in *client_addr);
+static struct text_list *own_channels(struct engine *e, size_t *size);
+static void who(struct engine *e, char *channel_name, const struct sockaddr_in *client_addr);
+static void delete_channel(struct engine *e, struct channel *ch);
+static void delete_rt_entry(struct engine *e, struct channel *rt);
+static void broadcast(struct engine *e, struct text_say *txt_say, struct channel *ch);
+static void handle_s2s_say(struct engine *e, struct s2s_say *say_msg, const struct sockaddr_in *client_addr);
+
+int engine_init(struct engine *e, const struct engine_transport *t, const struct sockaddr_in *addr,
+                uint32_t origin, long dedup_window, long dedup_expiry, uint64_t now_us) {
+    memset(e, 0, sizeof(*e));
+    e->transport = t;
+    e->addr = *addr;
+    e->origin = origin;
+    e->id = server_id(addr);
+    e->root = e->id;
+    if (state_init(&e->state, dedup_window, dedup_expiry) < 0) {
+        return -1;
+    }
+    pvec_init(&e->join_queue);
+    pvec_init(&e->repeating);
+    engine_set_clock(e, now_us);
+    wheel_init(&e->timers, engine_tick(e->clock_ms));
+    e->nshards = 1;
+    e->random = (e->id ^ (uint64_t)origin << 48) * 0x9E3779B97F4A7C15ULL | 1;
+    wheel_timer_init(&e->hello_timer, hello_expired, e);
+    // servers started together would otherwise send their hellos in step
+    wheel_add(&e->timers, &e->hello_timer, e->timers.now + 1 + engine_random(e) % engine_tick(HELLO_INTERVAL));
+    return 0;
+}
+
+void engine_free(struct engine *e) {
+    pvec_free(&e->join_queue, &e->state.arena);
+    pvec_free(&e->repeating, &e->state.arena);
+    for (uint32_t i = 0; i < e->state.neighbors.count; i++) {
+        struct neighbor *nbr = pvec_at(&e->state.neighbors, i);
+        free(nbr->joins);
+        free(nbr->joined_sums);
+        free(nbr->subscribed_sums);
+        free(nbr);
+    }
+    state_free(&e->state);
+    free(e->dests);
+    e->dests = NULL;
+    e->dests_cap = 0;
+}
+
+/*
+    add a server to the neighbor table
+*/
+struct neighbor *engine_add_neighbor(struct engine *e, const struct sockaddr_in *addr) {
+    struct neighbor *nbr = (struct neighbor *)malloc(sizeof(struct neighbor));
+    if (nbr == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(nbr, 0, sizeof(*nbr));
+    nbr->addr = *addr;
+    nbr->active = 1;
+    nbr->last_active = e->clock_now;
+    nbr->owner = e;
+    nbr->id = server_id(addr);
+    for (uint32_t b = 0; b < S2S_DIGEST_BUCKETS; b++) {
+        pvec_init(&nbr->joined[b]);
+        pvec_init(&nbr->subscribed[b]);
+    }
+    wheel_timer_init(&nbr->expiry, neighbor_expired, nbr);
+    watch_neighbor(e, nbr);
+
+    // the first digest anywhere in an interval, so neighbors added together don't stay in step
+    nbr->digest_ms = DIGEST_INTERVAL * 1000;
+    wheel_timer_init(&nbr->digest_timer, digest_expired, nbr);
+    wheel_add(&e->timers, &nbr->digest_timer, engine_tick(e->clock_ms + engine_random(e) % nbr->digest_ms) + 1);
+
+    if (addrmap_put(&e->state.neighbor_index, addr, nbr) < 0) {
+        perror("addrmap_put");
+        wheel_del(&nbr->expiry);
+        wheel_del(&nbr->digest_timer);
+        free(nbr);
+        return NULL;
+    }
+    if (pvec_push(&e->state.neighbors, &e->state.arena, nbr) < 0) {
+        perror("pvec_push");
+        addrmap_del(&e->state.neighbor_index, addr);
+        wheel_del(&nbr->expiry);
+        wheel_del(&nbr->digest_timer);
+        free(nbr);
+        return NULL;
+    }
+    return nbr;
+}
+
+void engine_set_clock(struct engine *e, uint64_t us) {
+    if (us > e->clock_us) {
+        e->clock_us = us;
+        e->clock_ms = us / 1000;
+        e->clock_now = us / 1000000;
+    }
+}
+
+void engine_advance(struct engine *e) {
+    wheel_advance(&e->timers, engine_tick(e->clock_ms));
+    flush_joins(e);
+}
+
+void engine_tree_position(struct engine *e, uint64_t *root, uint32_t *cost, uint64_t *parent) {
+    *root = e->root;
+    *cost = e->cost;
+    *parent = e->parent != NULL ? e->parent->id : 0;
+}
+
+void engine_follow(struct engine *e, uint64_t root, uint32_t cost, uint64_t parent) {
+    e->follower = 1;
+    e->follow_root = root;
+    e->follow_cost = cost;
+    e->follow_parent = parent;
+    update_tree(e);
+    flush_joins(e);
+}
+
+void engine_shard(struct engine *e, uint32_t shard, uint32_t nshards) {
+    e->shard = shard;
+    e->nshards = nshards;
+}
+
+uint32_t engine_channel_hash(const char *channel) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < CHANNEL_MAX && channel[i] != '\0'; i++) {
+        h ^= (unsigned char)channel[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void engine_log(struct engine *e, int level, int category, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vengine_log(e, level, category, fmt, args);
+    va_end(args);
+}
+
+/*
+    queue a line for the log thread. the address prefix is added when it
+    is written out, and nothing is formatted at all if the line is filtered
+*/
+static void vengine_log(struct engine *e, int level, int category, const char *fmt, va_list args) {
+    struct dclog_record *r = dclog_begin(level, category);
+    if (r == NULL) {
+        return;
+    }
+    r->kind = DCLOG_TEXT;
+    r->u.text.addr = e->addr;
+    if (vsnprintf(r->u.text.text, DCLOG_TEXT_MAX, fmt, args) >= DCLOG_TEXT_MAX) {
+        r->u.text.text[DCLOG_TEXT_MAX - 2] = '\n'; // cut short, but still a whole line
+    }
+    dclog_commit(r);
+}
+
+static void engine_print(struct engine *e, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vengine_log(e, DCLOG_INFO, DCLOG_SERVER, fmt, args);
+    va_end(args);
+}
+
+/*
+    logging function for the s2s messages
+*/
+static void log_message(struct engine *e, const struct sockaddr_in *remote_addr,
+                        const char *direction, const char *message_type, const char *channel,
+                        const char *username, const char *text) {
+    // raw addresses and copies only, the log thread formats them
+    struct dclog_record *r = dclog_begin(DCLOG_DEBUG, DCLOG_S2S);
+    if (r == NULL) {
+        return;
+    }
+    struct dclog_packet *p = &r->u.packet;
+    r->kind = DCLOG_PACKET;
+    p->local = e->addr;
+    p->remote = *remote_addr;
+    p->direction = direction;
+    p->message_type = message_type;
+    p->has_channel = channel != NULL;
+    p->has_username = username != NULL;
+    p->has_text = text != NULL;
+    if (channel != NULL) {
+        strncpy(p->channel, channel, CHANNEL_MAX);
+    }
+    if (username != NULL) {
+        strncpy(p->username, username, USERNAME_MAX);
+    }
+    if (text != NULL) {
+        strncpy(p->text, text, SAY_MAX);
+    }
+    dclog_commit(r);
+}
+
+/*
+    send a message to a user or a neighbor
+*/
+static void send_d(struct engine *e, void *txt, size_t txt_size, const struct sockaddr_in *client_addr) {
+    e->transport->send(e->transport->ctx, txt, txt_size, client_addr);
+}
+/*
+    send one payload to many destinations and count the fan-out's size
+*/
+static void fan_out(struct engine *e, const void *buf, size_t len, const struct sockaddr_in *dests, uint32_t n) {
+    if (n > 0) {
+        e->transport->send_many(e->transport->ctx, buf, len, dests, n);
+    }
+    e->counters.fanouts++;
+    metrics_record(e->counters.fanout_hist, n);
+}
+/*
+    room for n destinations in the scratch list, NULL if it could not grow
+*/
+static struct sockaddr_in *reserve_dests(struct engine *e, uint32_t n) {
+    if (n > e->dests_cap) {
+        uint32_t cap = e->dests_cap ? e->dests_cap : 16;
+        while (cap < n) {
+            cap *= 2;
+        }
+        struct sockaddr_in *dests = realloc(e->dests, cap * sizeof(struct sockaddr_in));
+        if (dests == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        e->dests = dests;
+        e->dests_cap = cap;
+    }
+    return e->dests;
+}
+
+/*
+    send an error to the client
+*/
+static void send_err(struct engine *e, char *err, const struct sockaddr_in *client_addr) {
+    struct text_error txt_err;
+    memset(&txt_err, 0, sizeof(txt_err));
+    txt_err.txt_type = TXT_ERROR;
+    strncpy(txt_err.txt_error, err, SAY_MAX);
+
+    send_d(e, &txt_err, sizeof(struct text_error), client_addr);
+}
+
+/*
+    check input text for size restrictions or a lack of a null terminator
+*/
+static int validate_str(struct engine *e, const char *str, size_t max_len) {
+    if (strnlen(str, max_len) >= max_len) {
+        e->counters.bad_string++;
+        return 0; // too long or not null-terminated
+    }
+    return 1; // valid
+}
+/*
+    check size of incoming packet to make sure that it's not too short
+*/
+static int validate_pac(struct engine *e, int rcv_len, int correct_len) {
+    if (rcv_len < correct_len) {
+        e->counters.bad_length++;
+        engine_print(e, "malformed packet detected and dropped.\n");
+        return 0;
+    }
+    return 1; // valid
+}
+
+/*
+    create unique ID from our origin id and the next sequence number
+*/
+static uint64_t generate_unique_id(struct engine *e) {
+    return dedup_make_id(e->origin, ++e->say_seq);
+}
+/*
+    checks if a given message id is a duplicate or new, and adds it to recent_ids for loop detection
+*/
+static int isdup(struct engine *e, uint64_t message_id) {
+    if (dedup_check(&e->state.recent_ids, message_id, e->clock_now)) {
+        e->counters.dedup_hits++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    time for a neighbor's digest. the next one comes sooner if the link
+    lost something or its channels changed since the last one, and later
+    if it was quiet. either way at a jittered interval, so the digests of
+    servers started together drift apart
+*/
+static void digest_expired(void *arg) {
+    struct neighbor *nbr = (struct neighbor *)arg;
+    struct engine *e = nbr->owner;
+    send_digest(e, nbr);
+
+    if (nbr->unsettled) {
+        nbr->digest_ms = nbr->digest_ms / 2 > DIGEST_MIN * 1000 ? nbr->digest_ms / 2 : DIGEST_MIN * 1000;
+    } else {
+        nbr->digest_ms = nbr->digest_ms + nbr->digest_ms / 4 < DIGEST_MAX * 1000 ? nbr->digest_ms + nbr->digest_ms / 4 : DIGEST_MAX * 1000;
+    }
+    nbr->unsettled = 0;
+    wheel_add(&e->timers, &nbr->digest_timer, engine_tick(e->clock_ms + jittered(e, nbr->digest_ms)));
+}
+/*
+    tell a neighbor what we joined through it, a digest for each of its
+    shards. the sums are kept up to date as we join and leave, so this
+    doesn't look at the channels. only neighbors that send hellos take
+    digests, and they are the only ones we join through
+*/
+static void send_digest(struct engine *e, struct neighbor *nbr) {
+    if (!hello_alive(e, nbr) || nbr->joined_sums == NULL) {
+        return;
+    }
+    char buf[sizeof(struct s2s_digest) + S2S_DIGEST_BUCKETS * sizeof(uint32_t)];
+    struct s2s_digest *digest = (struct s2s_digest *)buf;
+    digest->req_type = S2S_DIGEST;
+    digest->shard = e->shard;
+    digest->nshards = e->nshards;
+    digest->nslots = nbr->shards;
+    digest->nsums = S2S_DIGEST_BUCKETS;
+    for (uint32_t slot = 0; slot < nbr->shards; slot++) {
+        digest->slot = slot;
+        memcpy(digest->sums, nbr->joined_sums + slot * S2S_DIGEST_BUCKETS, S2S_DIGEST_BUCKETS * sizeof(uint32_t));
+        send_d(e, digest, sizeof(buf), &nbr->addr);
+    }
+}
+/*
+    a channel's digest bucket, the top bits of its hash. shards go by the
+    low ones, so every shard's channels spread over all the buckets
+*/
+static uint32_t digest_bucket(uint32_t hash) {
+    return hash / (UINT32_MAX / S2S_DIGEST_BUCKETS + 1);
+}
+/*
+    add a channel to one of a neighbor's digest sums or take it out, the
+    same XOR either way. the sum is the neighbor's shard it falls in, then
+    its bucket. nothing to do before the neighbor's first hello
+*/
+static void toggle_digest_sum(struct neighbor *nbr, uint32_t *sums, const char *channel_name) {
+    if (sums == NULL) {
+        return;
+    }
+    uint32_t h = engine_channel_hash(channel_name);
+    sums[h % nbr->shards * S2S_DIGEST_BUCKETS + digest_bucket(h)] ^= h;
+}
+/*
+    a neighbor's hello says how many shards it has. the first time, and
+    whenever that changes, its sums are counted again from its channels
+*/
+static void reset_digest_sums(struct engine *e, struct neighbor *nbr, uint32_t shards) {
+    if (shards == nbr->shards && nbr->joined_sums != NULL) {
+        return;
+    }
+    free(nbr->joined_sums);
+    free(nbr->subscribed_sums);
+    nbr->joined_sums = NULL;
+    nbr->subscribed_sums = NULL;
+    nbr->shards = shards;
+    if (shards == 0 || shards > S2S_SHARDS_MAX) {
+        return;
+    }
+    nbr->joined_sums = calloc(shards * S2S_DIGEST_BUCKETS, sizeof(uint32_t));
+    nbr->subscribed_sums = calloc(shards * S2S_DIGEST_BUCKETS, sizeof(uint32_t));
+    if (nbr->joined_sums == NULL || nbr->subscribed_sums == NULL) {
+        perror("calloc");
+        free(nbr->joined_sums);
+        free(nbr->subscribed_sums);
+        nbr->joined_sums = NULL;
+        nbr->subscribed_sums = NULL;
+        return;
+    }
+    for (uint32_t b = 0; b < S2S_DIGEST_BUCKETS; b++) {
+        for (uint32_t i = 0; i < nbr->joined[b].count; i++) {
+            toggle_digest_sum(nbr, nbr->joined_sums, route_channel(e, pvec_at(&nbr->joined[b], i))->name);
+        }
+        for (uint32_t i = 0; i < nbr->subscribed[b].count; i++) {
+            toggle_digest_sum(nbr, nbr->subscribed_sums, route_channel(e, pvec_at(&nbr->subscribed[b], i))->name);
+        }
+    }
+}
+/*
+    xorshift64*, seeded per engine so a simulation runs the same every time
+*/
+static uint64_t engine_random(struct engine *e) {
+    e->random ^= e->random >> 12;
+    e->random ^= e->random << 25;
+    e->random ^= e->random >> 27;
+    return e->random * 0x2545F4914F6CDD1DULL;
+}
+/*
+    an interval in ms, give or take a quarter
+*/
+static uint64_t jittered(struct engine *e, uint64_t ms) {
+    return ms - ms / 4 + engine_random(e) % (ms / 2 + 1);
+}
+/*
+    a neighbor's digest to our shard. each sum has to match the channels
+    of its shard and that bucket it is subscribed to with us. list the
+    ones that don't for it. a neighbor we don't know has none
+*/
+static void handle_digest(struct engine *e, struct s2s_digest *digest, int len, const struct sockaddr_in *from) {
+    if (!validate_pac(e, len, sizeof(*digest))) {
+        return;
+    }
+    if (digest->nshards == 0 || digest->shard >= digest->nshards ||
+        digest->nslots == 0 || digest->slot >= digest->nslots || digest->nsums != S2S_DIGEST_BUCKETS) {
+        e->counters.bad_length++;
+        return;
+    }
+    if (!validate_pac(e, len, sizeof(*digest) + digest->nsums * sizeof(uint32_t))) {
+        return;
+    }
+    if (digest->slot != e->shard || digest->nslots != e->nshards) {
+        return; // another shard's, or it hasn't had a hello from us yet
+    }
+
+    struct neighbor *nbr = state_find_neighbor(&e->state, from);
+    uint32_t *sums = NULL;
+    if (nbr != NULL) {
+        if (nbr->subscribed_sums == NULL || nbr->shards != digest->nshards) {
+            return; // we haven't had a hello from it yet
+        }
+        sums = nbr->subscribed_sums + digest->shard * S2S_DIGEST_BUCKETS;
+    }
+    uint64_t buckets = 0;
+    for (uint32_t b = 0; b < S2S_DIGEST_BUCKETS; b++) {
+        if (digest->sums[b] != (sums != NULL ? sums[b] : 0)) {
+            buckets |= 1ULL << b;
+            e->counters.repairs++;
+        }
+    }
+    if (buckets == 0) {
+        return;
+    }
+    log_message(e, from, "recv", "S2S Digest", NULL, NULL, "Digest does not match our subscriptions");
+    send_subscribed(e, nbr, from, digest, buckets);
+}
+/*
+    list the channels in a digest's buckets that its sender is subscribed
+    to with us, S2S_BULK_MAX at a time. there is always a first part, even
+    an empty one
+*/
+static void send_subscribed(struct engine *e, struct neighbor *nbr, const struct sockaddr_in *to, struct s2s_digest *digest, uint64_t buckets) {
+    char buf[sizeof(struct s2s_subscribed) + S2S_BULK_MAX * sizeof(struct channel_info)];
+    struct s2s_subscribed *list = (struct s2s_subscribed *)buf;
+    list->req_type = S2S_SUBSCRIBED;
+    list->shard = digest->shard;
+    list->nshards = digest->nshards;
+    list->slot = e->shard;
+    list->nslots = e->nshards;
+    list->buckets = buckets;
+    list->part = 0;
+    list->nchannels = 0;
+
+    for (uint32_t b = 0; nbr != NULL && b < S2S_DIGEST_BUCKETS; b++) {
+        for (uint32_t i = 0; (buckets >> b & 1) && i < nbr->subscribed[b].count; i++) {
+            struct channel *rt = route_channel(e, pvec_at(&nbr->subscribed[b], i));
+            if (engine_channel_hash(rt->name) % digest->nshards != digest->shard) {
+                continue;
+            }
+            strncpy(list->channels[list->nchannels++].ch_channel, rt->name, CHANNEL_MAX);
+            if (list->nchannels == S2S_BULK_MAX) {
+                send_d(e, list, sizeof(buf), to);
+                list->part++;
+                list->nchannels = 0;
+            }
+        }
+    }
+    if (list->nchannels > 0 || list->part == 0) {
+        send_d(e, list, sizeof(*list) + list->nchannels * sizeof(struct channel_info), to);
+    }
+}
+/*
+    what a neighbor has us subscribed to, in our digest's buckets that
+    didn't match. join again every channel in them we want from it, in
+    case a join was lost, and leave the listed ones we don't, in case a
+    leave was lost or overtaken by an earlier join
+*/
+static void handle_subscribed(struct engine *e, struct s2s_subscribed *list, int len, const struct sockaddr_in *from) {
+    if (!validate_pac(e, len, sizeof(*list))) {
+        return;
+    }
+    if (list->nchannels > S2S_BULK_MAX || list->nslots == 0 || list->slot >= list->nslots) {
+        e->counters.bad_length++;
+        return;
+    }
+    if (!validate_pac(e, len, sizeof(*list) + list->nchannels * sizeof(struct channel_info))) {
+        return;
+    }
+    if (list->shard != e->shard || list->nshards != e->nshards) {
+        return; // another shard's digest
+    }
+    struct neighbor *nbr = state_find_neighbor(&e->state, from);
+    if (nbr == NULL) {
+        return;
+    }
+
+    if (list->part == 0) {
+        nbr->unsettled = 1;
+        for (uint32_t b = 0; b < S2S_DIGEST_BUCKETS; b++) {
+            for (uint32_t i = 0; (list->buckets >> b & 1) && i < nbr->joined[b].count; i++) {
+                struct channel *rt = route_channel(e, pvec_at(&nbr->joined[b], i));
+                if (engine_channel_hash(rt->name) % list->nslots != list->slot) {
+                    continue;
+                }
+                send_join(e, nbr, rt->name, "repair");
+                e->counters.renews++;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < list->nchannels; i++) {
+        char *name = list->channels[i].ch_channel;
+        if (!validate_str(e, name, CHANNEL_MAX)) {
+            continue;
+        }
+        e->counters.listed++;
+        struct channel *rt = state_find_rt_entry(&e->state, name);
+        if (rt == NULL || state_find_route(&rt->joined_neighbors, nbr) == NULL) {
+            send_leave(e, from, name);
+        }
+    }
+}
+
+/*
+    make sure a neighbor's timeout is scheduled. after it has been pruned
+    nothing is pending until we hear from it or subscribe it again
+*/
+static void watch_neighbor(struct engine *e, struct neighbor *nbr) {
+    if (!wheel_pending(&nbr->expiry)) {
+        wheel_add(&e->timers, &nbr->expiry, engine_tick((nbr->last_active + NEIGHBOR_TIMEOUT + 1) * 1000));
+    }
+}
+/*
+    a neighbor's timeout came up. it is only rescheduled lazily, so the
+    neighbor may have been heard from since; if so just wait for the new
+    deadline. otherwise drop it from every channel it subscribed to
+*/
+static void neighbor_expired(void *arg) {
+    struct neighbor *nbr = (struct neighbor *)arg;
+    struct engine *e = nbr->owner;
+
+    if (e->clock_now - nbr->last_active <= NEIGHBOR_TIMEOUT) {
+        wheel_add(&e->timers, &nbr->expiry, engine_tick((nbr->last_active + NEIGHBOR_TIMEOUT + 1) * 1000));
+        return;
+    }
+
+    for (uint32_t b = 0; b < S2S_DIGEST_BUCKETS; b++) {
+        while (nbr->subscribed[b].count > 0) {
+            struct channel *rt = route_channel(e, pvec_at(&nbr->subscribed[b], nbr->subscribed[b].count - 1));
+            log_message(e, &nbr->addr, "prune", "S2S Leave", NULL, NULL, "Neighbor inactivity exceeded 120 seconds");
+            remove_neighbor_from_channel(e, rt->name, &nbr->addr);
+            e->counters.prunes++;
+            update_interest(e, rt);
+        }
+    }
+}
+/*
+    the channel a route is on. routes go before their channel does, so
+    this is never NULL
+*/
+static struct channel *route_channel(struct engine *e, struct route *r) {
+    return slotmap_get(&e->state.channels, r->channel);
+}
+
+/*
+    add a neighbor to a channel (after S2S join request)
+*/
+static void add_neighbor_to_channel(struct engine *e, char *channel_name, const struct sockaddr_in *neighbor_addr) {
+    struct channel *rt = state_add_rt_entry(&e->state, channel_name);
+    if (rt == NULL) {
+        return;
+    }
+
+    // a neighbor already subscribed to the channel only counts as heard from
+    struct neighbor *nbr = state_find_neighbor(&e->state, neighbor_addr);
+
+    if (nbr != NULL && state_find_route(&rt->subscribed_neighbors, nbr) != NULL) {
+        nbr->last_active = e->clock_now;
+        nbr->active = 1;
+        return;
+    }
+
+    // a server we have not heard of becomes a neighbor
+    if (nbr == NULL) {
+        nbr = engine_add_neighbor(e, neighbor_addr);
+        if (nbr == NULL) {
+            return;
+        }
+    }
+
+    // add to rt, and to the neighbor's channels in the channel's digest bucket
+    uint32_t bucket = digest_bucket(engine_channel_hash(channel_name));
+    if (state_add_route(&e->state, rt, &rt->subscribed_neighbors, nbr, &nbr->subscribed[bucket]) < 0) {
+        return;
+    }
+    toggle_digest_sum(nbr, nbr->subscribed_sums, channel_name);
+    watch_neighbor(e, nbr);
+    nbr->unsettled = 1;
+    engine_print(e, "Added neighbor %s:%d to channel %s.\n",
+        inet_ntoa(neighbor_addr->sin_addr), ntohs(neighbor_addr->sin_port), channel_name);
+}
+
+/*
+    remove neighbor from a channel's routing table (after leave request)
+*/
+static void remove_neighbor_from_channel(struct engine *e, char *channel_name, const struct sockaddr_in *neighbor_addr) {
+    struct channel *rt = state_find_rt_entry(&e->state, channel_name);
+    if (rt == NULL) {
+        return;
+    }
+    struct neighbor *nbr = state_find_neighbor(&e->state, neighbor_addr);
+    struct route *route = nbr != NULL ? state_find_route(&rt->subscribed_neighbors, nbr) : NULL;
+    if (route != NULL) {
+        state_remove_route(&e->state, rt, &rt->subscribed_neighbors, route);
+        toggle_digest_sum(nbr, nbr->subscribed_sums, channel_name);
+        nbr->unsettled = 1;
+        engine_print(e, "removed neighbor %s:%d from channel %s\n", inet_ntoa(neighbor_addr->sin_addr), ntohs(neighbor_addr->sin_port), channel_name);
+    }
+}
+/*
+    a server's id in the spanning tree: its address as one number
+*/
+static uint64_t server_id(const struct sockaddr_in *addr) {
+    return (uint64_t)ntohl(addr->sin_addr.s_addr) << 16 | ntohs(addr->sin_port);
+}
+
+/*
+    tell every neighbor where we are in the tree, then again about
+    HELLO_INTERVAL later. this is also when neighbors that went quiet drop out of it
+*/
+static void hello_expired(void *arg) {
+    struct engine *e = (struct engine *)arg;
+    update_tree(e);
+    if (!e->follower) {
+        send_hellos(e, NULL);
+    }
+    repeat_joins(e);
+    wheel_add(&e->timers, &e->hello_timer, engine_tick(e->clock_ms + jittered(e, HELLO_INTERVAL)));
+}
+/*
+    send new joins again for a few rounds. a join only goes one way, so a
+    lost one would otherwise cut the channel off until the next digest.
+    a repeat that outlives the join is undone the way any stale one is,
+    by the leave its first say gets back
+*/
+static void repeat_joins(struct engine *e) {
+    for (uint32_t i = e->repeating.count; i-- > 0;) {
+        struct channel *rt = pvec_at(&e->repeating, i);
+        for (uint32_t j = 0; j < rt->joined_neighbors.count; j++) {
+            struct route *route = pvec_at(&rt->joined_neighbors, j);
+            send_join(e, route->nbr, rt->name, "repeat");
+        }
+        if (--rt->join_repeats == 0) {
+            pvec_del_at(&e->repeating, &e->state.arena, i);
+        }
+    }
+}
+/*
+    send our root, cost and parent to one neighbor, or to all of them. each
+    one echoes that neighbor's last stamp, so they go out one by one
+*/
+static void send_hellos(struct engine *e, struct neighbor *only) {
+    struct s2s_hello hello;
+    hello.req_type = S2S_HELLO;
+    hello.root = e->root;
+    hello.cost = e->cost;
+    hello.parent = e->parent != NULL ? e->parent->id : 0;
+    hello.stamp = (uint32_t)e->clock_us | 1;
+    hello.shards = e->nshards;
+
+    for (uint32_t i = 0; i < e->state.neighbors.count; i++) {
+        struct neighbor *nbr = pvec_at(&e->state.neighbors, i);
+        if (only != NULL && nbr != only) {
+            continue;
+        }
+        hello.echo = nbr->probe_stamp;
+        hello.held = nbr->probe_stamp ? (uint32_t)(e->clock_us - nbr->probe_us) : 0;
+        send_d(e, &hello, sizeof(hello), &nbr->addr);
+    }
+    if (only == NULL) {
+        e->sent_cost = e->cost;
+    }
+}
+/*
+    an S2S hello: remember where the neighbor is in the tree and see if that
+    changes our place in it. a server we have not heard of becomes a neighbor
+*/
+static void handle_hello(struct engine *e, struct s2s_hello *hello, const struct sockaddr_in *from) {
+    struct neighbor *nbr = state_find_neighbor(&e->state, from);
+    if (nbr == NULL) {
+        nbr = engine_add_neighbor(e, from);
+        if (nbr == NULL) {
+            return;
+        }
+        engine_print(e, "new neighbor %s:%d.\n", inet_ntoa(from->sin_addr), ntohs(from->sin_port));
+    }
+    int first = !nbr->heard;
+    if (!first && e->clock_ms - nbr->hello_ms > 2 * HELLO_INTERVAL) {
+        nbr->unsettled = 1; // one went missing
+    }
+    nbr->hello_root = hello->root;
+    nbr->hello_cost = hello->cost;
+    nbr->hello_parent = hello->parent;
+    nbr->hello_ms = e->clock_ms;
+    nbr->heard = 1;
+    nbr->probe_stamp = hello->stamp;
+    nbr->probe_us = e->clock_us;
+    reset_digest_sums(e, nbr, hello->shards);
+    measure_rtt(e, nbr, hello);
+
+    // answer a server that just came up rather than have it wait for our next round
+    if (first && !e->follower) {
+        send_hellos(e, nbr);
+    }
+    update_tree(e);
+}
+/*
+    whether a neighbor's last hello is recent enough to route by
+*/
+static int hello_alive(struct engine *e, struct neighbor *nbr) {
+    return nbr->heard && e->clock_ms - nbr->hello_ms <= HELLO_TIMEOUT;
+}
+/*
+    a round trip from a hello that echoes one of ours: the time since our
+    stamp less the time the neighbor held it. smoothed like TCP's srtt, so
+    one slow datagram doesn't move the tree
+*/
+static void measure_rtt(struct engine *e, struct neighbor *nbr, struct s2s_hello *hello) {
+    if (hello->echo == 0) {
+        return;
+    }
+    uint32_t rtt = (uint32_t)e->clock_us - hello->echo - hello->held;
+    if (rtt > TREE_MAX_COST) {
+        return; // a stamp from before we restarted, or the neighbor's clock jumped
+    }
+    nbr->srtt = nbr->srtt ? nbr->srtt - nbr->srtt / 8 + rtt / 8 : rtt;
+}
+/*
+    what a link adds to the path through it: one way latency and a hop
+*/
+static uint32_t link_cost(struct neighbor *nbr) {
+    return (nbr->srtt ? nbr->srtt : RTT_GUESS) / 2 + HOP_COST;
+}
+/*
+    whether a path cost has drifted far enough from another to act on
+*/
+static int cost_moved(uint32_t cost, uint32_t from) {
+    uint32_t slack = from / TREE_HYSTERESIS + HOP_COST;
+    return cost > from + slack || cost + slack < from;
+}
+/*
+    choose our parent towards the lowest server id we have heard of: the
+    neighbor with the lowest latency path to it, the lowest id on a tie. a
+    neighbor whose parent is us can't be ours, so two servers never point at
+    each other, and paths longer than TREE_MAX_COST don't count, which ends
+    the count to infinity when a root goes away.
+
+    round trips wander, so we keep our parent until another path is
+    clearly better
+*/
+static struct neighbor *choose_parent(struct engine *e, uint64_t *root_out, uint32_t *cost_out) {
+    uint64_t root = e->id;
+    uint32_t cost = 0;
+    struct neighbor *parent = NULL;
+    uint64_t current_root = 0;
+    uint32_t current_cost = 0;
+    int current_ok = 0;
+    for (uint32_t i = 0; i < e->state.neighbors.count; i++) {
+        struct neighbor *nbr = pvec_at(&e->state.neighbors, i);
+        if (!hello_alive(e, nbr) || nbr->hello_parent == e->id) {
+            continue;
+        }
+        uint64_t c = (uint64_t)nbr->hello_cost + link_cost(nbr);
+        if (c >= TREE_MAX_COST) {
+            continue;
+        }
+        if (nbr == e->parent) {
+            current_root = nbr->hello_root;
+            current_cost = (uint32_t)c;
+            current_ok = 1;
+        }
+        if (nbr->hello_root < root ||
+            (nbr->hello_root == root && parent != NULL && (c < cost || (c == cost && nbr->id < parent->id)))) {
+            root = nbr->hello_root;
+            cost = (uint32_t)c;
+            parent = nbr;
+        }
+    }
+    // stay put unless the best path is better by more than the slack
+    if (current_ok && current_root == root && parent != e->parent && !cost_moved(current_cost, cost)) {
+        cost = current_cost;
+        parent = e->parent;
+    }
+    *root_out = root;
+    *cost_out = cost;
+    return parent;
+}
+/*
+    move to the place in the tree choose_parent() picks, or a follower to
+    the one it was told. hellos go out early only when the root or the
+    parent change or our cost has moved by more than the slack; small
+    drifts go out with the next round.
+
+    the tree links are our parent and the neighbors whose parent we are.
+    channels only join over those, so when they change every channel's
+    joins are redone. the joins neighbors sent us are theirs to take back:
+    a link can leave the tree on our side a moment before it does on
+    theirs, and dropping them here would lose the ones that stay
+*/
+static void update_tree(struct engine *e) {
+    uint64_t root;
+    uint32_t cost;
+    struct neighbor *parent = NULL;
+    if (e->follower) {
+        root = e->follow_root;
+        cost = e->follow_cost;
+        for (uint32_t i = 0; i < e->state.neighbors.count && e->follow_parent != 0; i++) {
+            struct neighbor *nbr = pvec_at(&e->state.neighbors, i);
+            if (nbr->id == e->follow_parent) {
+                parent = nbr;
+            }
+        }
+    } else {
+        parent = choose_parent(e, &root, &cost);
+    }
+
+    int moved = root != e->root || parent != e->parent;
+    if (parent != e->parent) {
+        e->counters.tree_changes++;
+        if (parent != NULL) {
+            engine_print(e, "tree parent is now %s:%d, %.1fms from the root.\n",
+                inet_ntoa(parent->addr.sin_addr), ntohs(parent->addr.sin_port), cost / 1000.0);
+        } else {
+            engine_print(e, "we are the tree root.\n");
+        }
+    }
+    e->root = root;
+    e->cost = cost;
+    e->parent = parent;
+    if (!e->follower && (moved || cost_moved(cost, e->sent_cost))) {
+        send_hellos(e, NULL);
+    }
+
+    int changed = 0;
+    for (uint32_t i = 0; i < e->state.neighbors.count; i++) {
+        struct neighbor *nbr = pvec_at(&e->state.neighbors, i);
+        int tree = hello_alive(e, nbr) && (nbr == parent || nbr->hello_parent == e->id);
+        if (tree == nbr->tree) {
+            continue;
+        }
+        nbr->tree = tree;
+        changed = 1;
+    }
+    if (changed) {
+        for (uint32_t i = 0; i < e->state.channels.used; i++) {
+            struct channel *rt = slotmap_at(&e->state.channels, i);
+            if (rt != NULL && rt->routed) {
+                update_interest(e, rt);
+            }
+        }
+    }
+}
+
+/*
+    bring our joins for a channel in line with who wants it. we join through
+    a tree neighbor when we have users in the channel or another neighbor
+    has joined through us, and leave it when neither is true any more. so
+    a channel's joins form the part of the tree that reaches its users, and
+    says follow it. the routing entry goes once nothing is left in it
+*/
+static void update_interest(struct engine *e, struct channel *ch) {
+    if (!ch->routed) {
+        return;
+    }
+    for (uint32_t i = 0; i < e->state.neighbors.count; i++) {
+        struct neighbor *nbr = pvec_at(&e->state.neighbors, i);
+        int want = 0;
+        if (nbr->tree) {
+            uint32_t others = ch->subscribed_neighbors.count - (state_find_route(&ch->subscribed_neighbors, nbr) != NULL);
+            want = ch->users.count > 0 || others > 0;
+        }
+        struct route *joined = state_find_route(&ch->joined_neighbors, nbr);
+        if (want && joined == NULL) {
+            uint32_t bucket = digest_bucket(engine_channel_hash(ch->name));
+            if (state_add_route(&e->state, ch, &ch->joined_neighbors, nbr, &nbr->joined[bucket]) < 0) {
+                continue;
+            }
+            toggle_digest_sum(nbr, nbr->joined_sums, ch->name);
+            send_join(e, nbr, ch->name, "send");
+            if (ch->join_repeats == 0 && pvec_push(&e->repeating, &e->state.arena, ch) < 0) {
+                perror("pvec_push");
+            } else {
+                ch->join_repeats = JOIN_REPEATS;
+            }
+            nbr->unsettled = 1;
+        } else if (!want && joined != NULL) {
+            state_remove_route(&e->state, ch, &ch->joined_neighbors, joined);
+            toggle_digest_sum(nbr, nbr->joined_sums, ch->name);
+            send_leave(e, &nbr->addr, ch->name);
+        }
+    }
+
+    if (ch->users.count == 0 && ch->subscribed_neighbors.count == 0 && ch->joined_neighbors.count == 0) {
+        delete_rt_entry(e, ch);
+    }
+}
+/*
+    ask a neighbor to send us a channel's says. a neighbor that sends hellos
+    takes S2S_JOIN_BULK as well, so its joins wait for flush_joins() and go
+    out together with the rest of the event's
+*/
+static void send_join(struct engine *e, struct neighbor *nbr, const char *channel_name, const char *direction) {
+    log_message(e, &nbr->addr, direction, "S2S Join", channel_name, NULL, NULL);
+
+    if (!nbr->heard) {
+        send_one_join(e, &nbr->addr, channel_name);
+        return;
+    }
+    if (nbr->joins == NULL) {
+        nbr->joins = malloc(sizeof(struct s2s_join_bulk) + S2S_BULK_MAX * sizeof(struct channel_info));
+        if (nbr->joins == NULL) {
+            perror("malloc");
+            send_one_join(e, &nbr->addr, channel_name);
+            return;
+        }
+        nbr->joins->req_type = S2S_JOIN_BULK;
+        nbr->joins->nchannels = 0;
+    }
+    struct s2s_join_bulk *bulk = nbr->joins;
+    for (uint32_t i = 0; i < bulk->nchannels; i++) {
+        if (strncmp(bulk->channels[i].ch_channel, channel_name, CHANNEL_MAX) == 0) {
+            return; // already on its way
+        }
+    }
+    if (bulk->nchannels == 0 && pvec_find(&e->join_queue, nbr) < 0
+        && pvec_push(&e->join_queue, &e->state.arena, nbr) < 0) {
+        perror("pvec_push");
+        send_one_join(e, &nbr->addr, channel_name);
+        return;
+    }
+    strncpy(bulk->channels[bulk->nchannels].ch_channel, channel_name, CHANNEL_MAX);
+    if (++bulk->nchannels == S2S_BULK_MAX) {
+        send_queued_joins(e, nbr);
+    }
+}
+/*
+    a single S2S join, for neighbors that don't take bulk ones
+*/
+static void send_one_join(struct engine *e, const struct sockaddr_in *addr, const char *channel_name) {
+    struct s2s_join join_msg;
+    join_msg.req_type = S2S_JOIN;
+    strncpy(join_msg.req_channel, channel_name, CHANNEL_MAX);
+
+    send_d(e, &join_msg, sizeof(join_msg), addr);
+}
+/*
+    send the joins queued for a neighbor, in one datagram
+*/
+static void send_queued_joins(struct engine *e, struct neighbor *nbr) {
+    struct s2s_join_bulk *bulk = nbr->joins;
+    if (bulk->nchannels == 1) {
+        send_one_join(e, &nbr->addr, bulk->channels[0].ch_channel);
+    } else if (bulk->nchannels > 1) {
+        send_d(e, bulk, sizeof(*bulk) + bulk->nchannels * sizeof(struct channel_info), &nbr->addr);
+    }
+    bulk->nchannels = 0;
+}
+/*
+    send every queued join. runs at the end of each event
+*/
+static void flush_joins(struct engine *e) {
+    for (uint32_t i = 0; i < e->join_queue.count; i++) {
+        send_queued_joins(e, pvec_at(&e->join_queue, i));
+    }
+    while (e->join_queue.count > 0) {
+        pvec_del_at(&e->join_queue, &e->state.arena, e->join_queue.count - 1);
+    }
+}
+/*
+    ask a neighbor to stop sending us a channel's says
+*/
+static void send_leave(struct engine *e, const struct sockaddr_in *addr, const char *channel_name) {
+    // a join still queued would go out after the leave and subscribe us again
+    struct neighbor *nbr = state_find_neighbor(&e->state, addr);
+    if (nbr != NULL) {
+        nbr->unsettled = 1;
+    }
+    if (nbr != NULL && nbr->joins != NULL) {
+        struct s2s_join_bulk *bulk = nbr->joins;
+        for (uint32_t i = 0; i < bulk->nchannels; i++) {
+            if (strncmp(bulk->channels[i].ch_channel, channel_name, CHANNEL_MAX) == 0) {
+                bulk->channels[i] = bulk->channels[--bulk->nchannels];
+                break;
+            }
+        }
+    }
+
+    struct s2s_leave leave_msg;
+    leave_msg.req_type = S2S_LEAVE;
+    strncpy(leave_msg.req_channel, channel_name, CHANNEL_MAX);
+
+    send_d(e, &leave_msg, sizeof(leave_msg), addr);
+
+    log_message(e, addr, "send", "S2S Leave", channel_name, NULL, NULL);
+}
+
+/*
+    send S2S say message with unique message id to the neighbors that joined the channel through us
+*/
+static void s2s_say(struct engine *e, char *username, struct channel *ch, char *message, uint64_t unique_id) {
+    if (!ch->routed || state_refresh_plan(&e->state, ch) < 0) {
+        return;
+    }
+    struct s2s_say say_msg;
+    say_msg.req_type = S2S_SAY;
+    say_msg.unique_id = unique_id;
+    strncpy(say_msg.req_username, username, USERNAME_MAX);
+    strncpy(say_msg.req_channel, ch->name, CHANNEL_MAX);
+    strncpy(say_msg.req_text, message, SAY_MAX);
+
+    for (uint32_t i = ch->plan_users; i < ch->plan_count; i++) {
+        log_message(e, &ch->plan[i], "send", "S2S Say", ch->name, username, message);
+    }
+    fan_out(e, &say_msg, sizeof(say_msg), ch->plan + ch->plan_users, ch->plan_count - ch->plan_users);
+}
+
+/*
+    login a user and add to user list
+*/
+static void login(struct engine *e, char *username, const struct sockaddr_in *client_addr) {
+
+    // user must have a unique name, check if user already exists
+    struct user *existing_user = state_find_user(&e->state, client_addr);
+    if (existing_user != NULL) {
+        engine_print(e, "user %s already logged in.\n", existing_user->username);
+        return;
+    }
+
+    // create new user
+    if (state_new_user(&e->state, username, client_addr) == NULL) {
+        return;
+    }
+
+    engine_print(e, "user %s logged in.\n", username);
+}
+
+/*
+    logout user and remove from user list/channels
+*/
+static void logout(struct engine *e, const struct sockaddr_in *client_addr) {
+
+    // find user
+    struct user *u = state_find_user(&e->state, client_addr);
+
+    if (u == NULL) {
+        engine_print(e, "unknown user trying to logout.\n");
+        return;
+    }
+
+    char username[USERNAME_MAX];
+    strcpy(username, u->username);
+
+    // remove from all the channels the user is in
+    while (u->channels.count > 0) {
+        part_channel(e, pvec_at(&u->channels, u->channels.count - 1));
+    }
+
+    // remove from user list
+    state_drop_user(&e->state, u);
+
+    engine_print(e, "user %s logged out.\n", username);
+}
+
+/*
+    add user to channel/create channel
+*/
+static void join_channel(struct engine *e, char *channel_name, const struct sockaddr_in *client_addr) {
+
+    // find user
+    struct user *u = state_find_user(&e->state, client_addr);
+    if (u == NULL) {
+        engine_print(e, "user not found for join request.\n");
+        return;
+    }
+
+    struct channel *ch = state_find_channel(&e->state, channel_name);
+    if (ch == NULL) { // if channel doesn't exist, create it
+        ch = state_get_channel(&e->state, channel_name);
+        if (ch == NULL) {
+            send_err(e, "Could not create channel.", client_addr);
+            return;
+        }
+        ch->local = 1;
+        if (e->directory != NULL) {
+            e->directory->publish(e->directory->ctx, ch->name);
+        }
+
+        engine_print(e, "new channel %s created.\n", channel_name);
+    }
+    if (!state_user_present(&e->state, u, ch)) { // user cannot join channel that they already are subscribed to
+        if (state_add_user(&e->state, u, ch) < 0) {
+            return;
+        }
+        engine_print(e, "user %s joined channel %s.\n", u->username, ch->name);
+
+        // join through the tree if this is the channel's first user here
+        if (state_add_rt_entry(&e->state, ch->name) != NULL) {
+            update_interest(e, ch);
+        }
+    } else {
+        engine_print(e, "user %s already in channel %s.\n", u->username, ch->name);
+        send_err(e, "You have already joined this channel.", client_addr);
+    }
+}
+
+/*
+    remove user from channel
+*/
+static void leave_channel(struct engine *e, char *channel_name, const struct sockaddr_in *client_addr) {
+    struct user *u = state_find_user(&e->state, client_addr);
+    if (u == NULL) {
+        engine_print(e, "user not found for leave request.\n");
+        return;
+    }
+
+    struct channel *ch = state_find_channel(&e->state, channel_name);
+    if (ch == NULL) {
+        engine_print(e, "channel %s not found.\n", channel_name);
+        return;
+    }
+
+    struct membership *m = state_find_membership(&e->state, u, ch);
+    if (m != NULL) {
+        part_channel(e, m);
+    } else {
+        engine_print(e, "user %s not in channel %s.\n", u->username, ch->name);
+    }
+}
+
+/*
+    drop a membership, and the channel with it if that was the last user
+*/
+static void part_channel(struct engine *e, struct membership *m) {
+    struct user *u = m->user;
+    struct channel *ch = slotmap_get(&e->state.channels, m->channel);
+
+    state_remove_user(&e->state, m, ch);
+    engine_print(e, "user %s left channel %s.\n", u->username, ch->name);
+
+    // if channel is empty, leave it through the tree unless others still need it from us
+    if (ch->users.count == 0) {
+        update_interest(e, ch);
+
+        // delete channel (except Common)
+        if (strncmp(ch->name, "Common", CHANNEL_MAX) != 0) {
+            delete_channel(e, ch);
+        }
+    }
+}
+
+/*
+    server-side handling of say request
+*/
+static void say(struct engine *e, char *channel_name, char *message, const struct sockaddr_in *client_addr) {
+    struct user *u = state_find_user(&e->state, client_addr);
+    if (u == NULL) {
+        engine_print(e, "user not found for say request.\n");
+        return;
+    }
+
+    struct channel *ch = state_find_channel(&e->state, channel_name);
+    if (ch == NULL) {
+        engine_print(e, "channel %s not found.\n", channel_name);
+        return;
+    }
+
+    if (!state_user_present(&e->state, u, ch)) {
+        engine_print(e, "user %s is not in channel %s.\n", u->username, ch->name);
+        return;
+    }
+
+    // construct say struct and broadcast to all users in the channel
+    struct text_say txt_say;
+    txt_say.txt_type = TXT_SAY;
+    strncpy(txt_say.txt_channel, channel_name, CHANNEL_MAX);
+    strncpy(txt_say.txt_username, u->username, USERNAME_MAX);
+    strncpy(txt_say.txt_text, message, SAY_MAX);
+
+    engine_print(e, "%s sends say message in %s.\n", u->username, txt_say.txt_channel);
+    broadcast(e, &txt_say, ch);
+
+    // generate unique message ID and broadcast the S2S say to the neighbors.
+    // remember it ourselves too, so it is dropped if it loops back here
+    uint64_t u_id = generate_unique_id(e);
+    isdup(e, u_id);
+
+    s2s_say(e, u->username, ch, message, u_id);
+}
+
+/*
+    list all channels that exist
+*/
+static void list_channels(struct engine *e, const struct sockaddr_in *client_addr) {
+
+    struct user *u = state_find_user(&e->state, client_addr);
+    if (u == NULL) {
+        engine_print(e, "user not found for list request.\n");
+        return;
+    }
+
+    // a server made of several engines keeps the list where they can all see it
+    size_t size;
+    struct text_list *txt;
+    if (e->directory != NULL) {
+        txt = e->directory->list(e->directory->ctx, &size);
+    } else {
+        txt = own_channels(e, &size);
+    }
+    if (txt == NULL) {
+        return;
+    }
+
+    engine_print(e, "%s requests channel list.\n", u->username);
+    send_list(e, txt, client_addr);
+    free(txt);
+}
+/*
+    send a TXT_LIST in parts of up to TXT_LIST_MAX channels. there is
+    always one, even an empty one
+*/
+static void send_list(struct engine *e, struct text_list *txt, const struct sockaddr_in *client_addr) {
+    char buf[sizeof(struct text_list) + TXT_LIST_MAX * sizeof(struct channel_info)];
+    struct text_list *part = (struct text_list *)buf;
+    part->txt_type = TXT_LIST;
+    int i = 0;
+    do {
+        int n = txt->txt_nchannels - i < TXT_LIST_MAX ? txt->txt_nchannels - i : TXT_LIST_MAX;
+        part->txt_nchannels = n;
+        memcpy(part->txt_channels, txt->txt_channels + i, n * sizeof(struct channel_info));
+        send_d(e, part, sizeof(*part) + n * sizeof(struct channel_info), client_addr);
+        i += n;
+    } while (i < txt->txt_nchannels);
+}
+/*
+    a TXT_LIST of this engine's local channels
+*/
+static struct text_list *own_channels(struct engine *e, size_t *size) {
+    uint32_t local_count = 0;
+    for (uint32_t i = 0; i < e->state.channels.used; i++) {
+        struct channel *ch = slotmap_at(&e->state.channels, i);
+        local_count += ch != NULL && ch->local;
+    }
+    *size = sizeof(struct text_list) + local_count * sizeof(struct channel_info);
+    struct text_list *txt = (struct text_list *)malloc(*size);
+    if (txt == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    txt->txt_type = TXT_LIST;
+    txt->txt_nchannels = local_count;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < e->state.channels.used; i++) {
+        struct channel *ch = slotmap_at(&e->state.channels, i);
+        if (ch != NULL && ch->local) {
+            memcpy(txt->txt_channels[n++].ch_channel, ch->name, CHANNEL_MAX);
+        }
+    }
+    return txt;
+}
+
+/*
+    send list of users in specified channel back to user
+*/
+static void who(struct engine *e, char *channel_name, const struct sockaddr_in *client_addr) {
+    // check user validity
+    struct user *u = state_find_user(&e->state, client_addr);
+    if (u == NULL) {
+        engine_print(e, "user not found for who request.\n");
+        return;
+    }
+
+    struct channel *ch = state_find_channel(&e->state, channel_name);
+
+    // check if channel exists
+    if (ch == NULL) {
+        engine_print(e, "channel %s not found.\n", channel_name);
+        return;
+    }
+
+    // in parts of up to TXT_WHO_MAX users, always at least one
+    char buf[sizeof(struct text_who) + TXT_WHO_MAX * sizeof(struct user_info)];
+    struct text_who *txt = (struct text_who *)buf;
+    txt->txt_type = TXT_WHO;
+    txt->txt_nusernames = 0;
+    strncpy(txt->txt_channel, channel_name, CHANNEL_MAX);
+
+    engine_print(e, "Sending who response to %s.\n", u->username);
+    for (uint32_t i = 0; i < ch->users.count; i++) {
+        struct membership *m = pvec_at(&ch->users, i);
+        strncpy(txt->txt_users[txt->txt_nusernames++].us_username, m->user->username, USERNAME_MAX);
+        if (txt->txt_nusernames == TXT_WHO_MAX) {
+            send_d(e, txt, sizeof(buf), client_addr);
+            txt->txt_nusernames = 0;
+        }
+    }
+    if (txt->txt_nusernames > 0 || ch->users.count == 0) {
+        send_d(e, txt, sizeof(*txt) + txt->txt_nusernames * sizeof(struct user_info), client_addr);
+    }
+}
+
+/*
+    delete local channel. the record itself stays around while it is still routed
+*/
+static void delete_channel(struct engine *e, struct channel *ch) {
+    engine_print(e, "deleting channel %s\n", ch->name);
+    if (e->directory != NULL) {
+        e->directory->withdraw(e->directory->ctx, ch->name);
+    }
+    engine_print(e, "channel %s deleted.\n", ch->name);
+    state_delete_channel(&e->state, ch);
+}
+/*
+    used to delete internal records (as per the guide) of channel after sending a leave
+*/
+static void delete_rt_entry(struct engine *e, struct channel *rt) {
+    engine_print(e, "Deleted routing table entry for channel %s.\n", rt->name);
+    if (rt->join_repeats > 0) {
+        pvec_del(&e->repeating, &e->state.arena, rt);
+    }
+    state_delete_rt_entry(&e->state, rt);
+}
+
+/*
+    broadcast message to all users in channel
+*/
+static void broadcast(struct engine *e, struct text_say *txt_say, struct channel *ch) {
+    if (state_refresh_plan(&e->state, ch) < 0) {
+        return;
+    }
+    fan_out(e, txt_say, sizeof(struct text_say), ch->plan, ch->plan_users);
+}
+
+/*
+    an S2S say: deliver it here, pass it on, or tell the sender we don't need it
+*/
+static void handle_s2s_say(struct engine *e, struct s2s_say *say_msg, const struct sockaddr_in *client_addr) {
+    log_message(e, client_addr, "recv", "S2S Say", say_msg->req_channel, say_msg->req_username, say_msg->req_text);
+
+    // one record covers local users, forwarding and the leave decision
+    struct channel *ch = state_lookup_channel(&e->state, say_msg->req_channel);
+
+    // says only come from neighbors we joined the channel through. any other
+    // sender still has a join of ours whose leave it missed, so repeat it
+    struct neighbor *sender = state_find_neighbor(&e->state, client_addr);
+    if (ch == NULL || !ch->routed || sender == NULL || state_find_route(&ch->joined_neighbors, sender) == NULL) {
+        send_leave(e, client_addr, say_msg->req_channel);
+    }
+
+    // check for dups. the tree has no loops, so these only come while it is changing
+    if (isdup(e, say_msg->unique_id)) {
+        engine_print(e, "Duplicate message detected and dropped.\n");
+        return;
+    }
+
+    // broadcast message to local users if any
+    if (ch != NULL && ch->local) {
+        struct text_say txt_say;
+        txt_say.txt_type = TXT_SAY;
+        strncpy(txt_say.txt_channel, say_msg->req_channel, CHANNEL_MAX);
+        strncpy(txt_say.txt_username, say_msg->req_username, USERNAME_MAX);
+        strncpy(txt_say.txt_text, say_msg->req_text, SAY_MAX);
+        broadcast(e, &txt_say, ch);
+    }
+
+    // fwd message to the other neighbors that joined through us
+    if (ch != NULL && ch->routed && state_refresh_plan(&e->state, ch) < 0) {
+        return;
+    }
+    uint32_t forwarded = 0;
+    uint32_t nplan = ch != NULL && ch->routed ? ch->plan_count : 0;
+    struct sockaddr_in *dests = reserve_dests(e, nplan);
+    if (dests == NULL) {
+        return;
+    }
+    for (uint32_t i = ch != NULL ? ch->plan_users : 0; i < nplan; i++) {
+        struct sockaddr_in *addr = &ch->plan[i];
+
+        // skip sender
+        if (addr->sin_addr.s_addr == client_addr->sin_addr.s_addr &&
+            addr->sin_port == client_addr->sin_port) {
+            continue;
+        }
+
+        dests[forwarded++] = *addr;
+        log_message(e, addr, "send", "S2S Say", say_msg->req_channel, say_msg->req_username, say_msg->req_text);
+    }
+    if (forwarded > 0) {
+        fan_out(e, say_msg, sizeof(*say_msg), dests, forwarded);
+    }
+}
+
+/*
+    a neighbor joined a channel through us
+*/
+static void handle_s2s_join(struct engine *e, char *channel_name, const struct sockaddr_in *from) {
+    log_message(e, from, "recv", "S2S Join", channel_name, NULL, NULL);
+
+    // subscribe the sender, and join onwards if it is the first to want the channel from us
+    add_neighbor_to_channel(e, channel_name, from);
+    struct channel *rt = state_find_rt_entry(&e->state, channel_name);
+    if (rt != NULL) {
+        update_interest(e, rt);
+    }
+}
+/*
+    several joins in one datagram. when engines share a server each is
+    handed all of it and takes only its own shard's channels
+*/
+static void handle_join_bulk(struct engine *e, struct s2s_join_bulk *bulk, int len, const struct sockaddr_in *from) {
+    if (!validate_pac(e, len, sizeof(*bulk))) {
+        return;
+    }
+    if (bulk->nchannels == 0 || bulk->nchannels > S2S_BULK_MAX) {
+        e->counters.bad_length++;
+        return;
+    }
+    if (!validate_pac(e, len, sizeof(*bulk) + bulk->nchannels * sizeof(struct channel_info))) {
+        return;
+    }
+    for (uint32_t i = 0; i < bulk->nchannels; i++) {
+        char *name = bulk->channels[i].ch_channel;
+        if (!validate_str(e, name, CHANNEL_MAX)) {
+            continue;
+        }
+        if (engine_channel_hash(name) % e->nshards != e->shard) {
+            continue; // another shard's
+        }
+        e->counters.bulk_joins++;
+        handle_s2s_join(e, name, from);
+    }
+}
+
+void engine_handle(struct engine *e, char *buffer, int len, const struct sockaddr_in *client_addr) {
+    struct request *req = (struct request *)buffer;
+    uint32_t type = (uint32_t)req->req_type;
+    e->counters.received[type < METRICS_TYPES - 1 ? type : METRICS_TYPES - 1]++;
+
+    // update neighbor's last_active time
+    // its timeout is only moved once it comes up, so this is O(1)
+    struct neighbor *sender = state_find_neighbor(&e->state, client_addr);
+    if (sender != NULL) {
+        sender->last_active = e->clock_now;
+        watch_neighbor(e, sender);
+    }
+
+    switch (req->req_type) {
+        case REQ_LOGIN: {
+            if (!validate_pac(e, len, sizeof(struct request_login))) {
+                send_err(e, "LOGIN: packet length too long", client_addr);
+                break; // validate length of packet
+            }
+            struct request_login *req_login = (struct request_login *)buffer;
+            if (!validate_str(e, req_login->req_username, USERNAME_MAX)) {
+                send_err(e, "LOGIN: username length too long", client_addr);
+                break; // validate length of user
+            }
+            login(e, req_login->req_username, client_addr);
+            break;
+        }
+        case REQ_LOGOUT: {
+            if (!validate_pac(e, len, sizeof(struct request_logout))) {
+                send_err(e, "LOGOUT: packet length too long", client_addr);
+                break; // validate length of packet
+            }
+            logout(e, client_addr);
+            break;
+        }
+        case REQ_JOIN: {
+            if (!validate_pac(e, len, sizeof(struct request_join))) {
+                send_err(e, "JOIN: packet length too long", client_addr);
+                break; // validate length of packet
+            }
+            struct request_join *req_join = (struct request_join *)buffer;
+            if (!validate_str(e, req_join->req_channel, CHANNEL_MAX)) {
+                send_err(e, "JOIN: channel length too long", client_addr);
+                break; // validate length of channel
+            }
+            join_channel(e, req_join->req_channel, client_addr);
+            break;
+        }
+        case REQ_LEAVE: {
+            if (!validate_pac(e, len, sizeof(struct request_leave))) {
+                send_err(e, "LEAVE: packet length too long", client_addr);
+                break; // validate length of packet
+            }
+            struct request_leave *req_leave = (struct request_leave *)buffer;
+            if (!validate_str(e, req_leave->req_channel, USERNAME_MAX)) {
+                send_err(e, "JOIN: channel length too long", client_addr);
+                break; // validate length of channel
+            }
+            leave_channel(e, req_leave->req_channel, client_addr);
+            break;
+        }
+        case REQ_SAY: {
+            if (!validate_pac(e, len, sizeof(struct request_say))) {
+                send_err(e, "SAY: packet length too long", client_addr);
+                break; // validate length of packet
+            }
+            struct request_say *req_say = (struct request_say *)buffer;
+            if (!validate_str(e, req_say->req_text, SAY_MAX)) {
+                send_err(e, "SAY: message length too long", client_addr);
+                break; // validate length of message
+            }
+            say(e, req_say->req_channel, req_say->req_text, client_addr);
+            break;
+        }
+        case REQ_LIST: {
+            if (!validate_pac(e, len, sizeof(struct request_list))) {
+                send_err(e, "LIST: packet length too long\n", client_addr);
+                break; // validate length of packet
+            }
+            list_channels(e, client_addr);
+            break;
+        }
+        case REQ_WHO: {
+            if (!validate_pac(e, len, sizeof(struct request_who))) {
+                send_err(e, "WHO: packet length too long", client_addr);
+                break; // validate length of packet
+            }
+            struct request_who *req_who = (struct request_who *)buffer;
+            if (!validate_str(e, req_who->req_channel, CHANNEL_MAX)) {
+                send_err(e, "WHO: channel length too long", client_addr);
+                break; // validate length of message
+            }
+            who(e, req_who->req_channel, client_addr);
+            break;
+        }
+        case S2S_JOIN: {
+            if (!validate_pac(e, len, sizeof(struct s2s_join))) {
+                break; // validate length of packet
+            }
+            struct s2s_join *join_msg = (struct s2s_join *)buffer;
+            if (!validate_str(e, join_msg->req_channel, CHANNEL_MAX)) {
+                break; // validate length of channel
+            }
+            handle_s2s_join(e, join_msg->req_channel, client_addr);
+            break;
+        }
+        case S2S_LEAVE: {
+            if (!validate_pac(e, len, sizeof(struct s2s_leave))) {
+                break; // validate length of packet
+            }
+            struct s2s_leave *leave_msg = (struct s2s_leave *)buffer;
+            if (!validate_str(e, leave_msg->req_channel, CHANNEL_MAX)) {
+                break; // validate length of channel
+            }
+
+            log_message(e, client_addr, "recv", "S2S Leave", leave_msg->req_channel, NULL, NULL);
+
+            remove_neighbor_from_channel(e, leave_msg->req_channel, client_addr);
+
+            // leave onwards if that was the last reason to have the channel
+            struct channel *rt = state_find_rt_entry(&e->state, leave_msg->req_channel);
+            if (rt != NULL) {
+                update_interest(e, rt);
+            }
+            break;
+        }
+        case S2S_SAY: {
+            if (!validate_pac(e, len, sizeof(struct s2s_say))) {
+                break; // validate length of packet
+            }
+            struct s2s_say *say_msg = (struct s2s_say *)buffer;
+            if (!validate_str(e, say_msg->req_channel, CHANNEL_MAX) ||
+                !validate_str(e, say_msg->req_username, USERNAME_MAX) ||
+                !validate_str(e, say_msg->req_text, SAY_MAX)) {
+                break; // validate length of channel, username and message
+            }
+            handle_s2s_say(e, say_msg, client_addr);
+            break;
+        }
+        case S2S_HELLO: {
+            if (!validate_pac(e, len, sizeof(struct s2s_hello))) {
+                break; // validate length of packet
+            }
+            handle_hello(e, (struct s2s_hello *)buffer, client_addr);
+            break;
+        }
+        case S2S_JOIN_BULK: {
+            handle_join_bulk(e, (struct s2s_join_bulk *)buffer, len, client_addr);
+            break;
+        }
+        case S2S_DIGEST: {
+            handle_digest(e, (struct s2s_digest *)buffer, len, client_addr);
+            break;
+        }
+        case S2S_SUBSCRIBED: {
+            handle_subscribed(e, (struct s2s_subscribed *)buffer, len, client_addr);
+            break;
+        }
+
+        default: {
+            send_err(e, "request type unknown.", client_addr);
+            break;
+        }
+    }
+    flush_joins(e);
+}
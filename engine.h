@@ -0,0 +1,127 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+#include "state.h"
+#include "wheel.h"
+#include "metrics.h"
+/* The DuckChat protocol engine: one server's users, channels and
+* neighbors, and everything it does with a datagram.
+*
+* An engine has no socket, thread or clock of its own. Whoever hosts it
+* hands it datagrams with engine_handle(), sets its clock, runs its
+* timers with engine_advance(), and carries what it sends through a
+* struct engine_transport. The server hosts one per worker thread on real
+* sockets and the monotonic clock; ducksim hosts hundreds in one thread on
+* a simulated network and a virtual clock.
+*
+* Engines keep a spanning tree of the servers with S2S_HELLO and join
+* channels only over its links, so a say crosses each tree link at most
+* once and only towards servers with users in its channel. The hellos
+* measure each link's round trip, and the tree is the lowest latency one
+* to its root. Joins are not renewed one by one: every few seconds each
+* engine sends its neighbors a digest of what it joined through them, and
+* only channels in a sum that doesn't match are joined or left again. Each
+* neighbor's digests keep their own jittered schedule, more often while the
+* link loses datagrams or its channels change and less once it settles.
+*
+* Engines log through dclog, so the hosting thread must have called
+* dclog_thread(). An engine belongs to one thread. */
+#define ENGINE_TICK_MS 100 /* timing wheel resolution */
+
+/* How an engine's datagrams leave it. Sends can't fail as far as the
+* engine is concerned; a transport that loses datagrams just loses them. */
+struct engine_transport {
+    void *ctx;
+    void (*send)(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to);
+    /* The same datagram to n destinations */
+    void (*send_many)(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to, uint32_t n);
+};
+
+/* The channels LIST reports, when several engines make up one server.
+* Without one an engine lists its own local channels. */
+struct engine_directory {
+    void *ctx;
+    void (*publish)(void *ctx, const char *channel);
+    void (*withdraw)(void *ctx, const char *channel);
+    /* A malloc()ed TXT_LIST of every channel and its size, NULL on failure */
+    struct text_list *(*list)(void *ctx, size_t *size);
+};
+
+struct engine {
+    struct server_state state;
+    struct sockaddr_in addr;       /* our own address, for the logs */
+    const struct engine_transport *transport;
+    const struct engine_directory *directory; /* NULL: list our own channels */
+    uint32_t origin;               /* our id in the S2S say ids we originate */
+    uint32_t say_seq;              /* sequence number of the last one */
+    struct wheel timers;           /* every soft state timeout, in ENGINE_TICK_MS ticks */
+    uint32_t shard;                /* engine_channel_hash() % nshards of our channels, see engine_shard() */
+    uint32_t nshards;
+    uint64_t id;                   /* our address as one number, the lowest is the tree's root */
+    uint64_t root;                 /* the root we know of, our latency to it in us and next hop towards it */
+    uint32_t cost;
+    struct neighbor *parent;       /* NULL when we are the root */
+    uint32_t sent_cost;            /* the cost our last hellos carried */
+    int follower;                  /* another engine of our server picks the parent, see engine_follow() */
+    uint64_t follow_root;
+    uint32_t follow_cost;
+    uint64_t follow_parent;
+    struct wheel_timer hello_timer;
+    uint64_t random;               /* xorshift state for timer jitter, seeded from id and origin */
+    uint64_t clock_us;             /* set by the host, never read from the system */
+    uint64_t clock_ms;             /* the same in ms, for timers */
+    time_t clock_now;              /* and in seconds, for soft state timestamps */
+    struct metrics counters;
+    struct sockaddr_in *dests;     /* scratch for fan-outs that aren't a channel's plan */
+    uint32_t dests_cap;
+    struct pvec join_queue;        /* struct neighbor * with joins queued, sent once the event is handled */
+    struct pvec repeating;         /* struct channel * with join_repeats left, see repeat_joins() */
+};
+
+/* Sets up an empty engine at time now_us. origin must be unique among the
+* servers it will talk to, and not 0. Returns -1 if the dedup window could
+* not be allocated, 0 on success. */
+int engine_init(struct engine *e, const struct engine_transport *t, const struct sockaddr_in *addr,
+                uint32_t origin, long dedup_window, long dedup_expiry, uint64_t now_us);
+/* Frees everything, neighbors included */
+void engine_free(struct engine *e);
+/* Adds a neighboring server. Returns NULL if the indexes could not grow. */
+struct neighbor *engine_add_neighbor(struct engine *e, const struct sockaddr_in *addr);
+
+/* Moves the engine's clock, in us. Time never goes backwards. */
+void engine_set_clock(struct engine *e, uint64_t us);
+/* Fires every timer due by the engine's clock */
+void engine_advance(struct engine *e);
+/* The timing wheel tick a time in ms falls in, for hosts that put their
+* own timers on e->timers */
+static inline uint64_t engine_tick(uint64_t ms) {
+    return ms / ENGINE_TICK_MS;
+}
+
+/* Where the engine is in the spanning tree: the root's id, the latency to
+* it in us and the parent's id, 0 at the root */
+void engine_tree_position(struct engine *e, uint64_t *root, uint32_t *cost, uint64_t *parent);
+/* Engines that make up one server have to show their neighbors a single
+* parent. One of them leads: it sends the hellos and picks the parent from
+* them. The others are handed its engine_tree_position() here, and from
+* then on only work out their tree links from it. */
+void engine_follow(struct engine *e, uint64_t root, uint32_t cost, uint64_t parent);
+
+/* Several engines that make up one server split its channels between them
+* by engine_channel_hash() % nshards, and every one of them is handed the
+* S2S datagrams about more than one channel. This tells an engine its part.
+* An engine on its own is shard 0 of 1. */
+void engine_shard(struct engine *e, uint32_t shard, uint32_t nshards);
+/* FNV-1a over a channel name, the hash shards are picked by */
+uint32_t engine_channel_hash(const char *channel);
+
+/* Handles one datagram from a client or a neighboring server */
+void engine_handle(struct engine *e, char *buffer, int len, const struct sockaddr_in *from);
+
+/* A server_print() style line, prefixed with the engine's address */
+void engine_log(struct engine *e, int level, int category, const char *fmt, ...);
+#endif
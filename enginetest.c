@@ -0,0 +1,216 @@
+/*
+enginetest.c
+drives one engine with hand made datagrams and checks what it sends back.
+exits 1 at the first check that fails
+*/
+#include "duckchat.h"
+#include "engine.h"
+#include "dclog.h"
+#include "udpio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <arpa/inet.h>
+
+#define LOG_RING 4096
+#define CROWD 2500           // users or channels, well past what fits one datagram
+#define SENT_MAX 256         // datagrams one request may answer with
+
+struct sent {
+    size_t len;
+    char buf[UDP_MAX_DGRAM];
+};
+
+struct engine e;
+struct engine_transport transport;
+struct sent sent[SENT_MAX];
+int nsent;
+int oversized;
+
+void capture_send(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to);
+void capture_send_many(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to, uint32_t n);
+struct sockaddr_in user_addr(int i);
+void request(int user, void *req, size_t len);
+void check(int ok, const char *what);
+void test_big_who();
+void test_big_list();
+void test_bad_s2s();
+void test_prune();
+
+/*
+    keep what the engine sends for the checks to look at
+*/
+void capture_send(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to) {
+    (void)ctx;
+    (void)to;
+    if (len > UDP_MAX_DGRAM) {
+        oversized++;
+        return;
+    }
+    if (nsent < SENT_MAX) {
+        sent[nsent].len = len;
+        memcpy(sent[nsent].buf, buf, len);
+        nsent++;
+    }
+}
+void capture_send_many(void *ctx, const void *buf, size_t len, const struct sockaddr_in *to, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        capture_send(ctx, buf, len, &to[i]);
+    }
+}
+
+struct sockaddr_in user_addr(int i) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x7f000001 + i / 50000);
+    addr.sin_port = htons(10000 + i % 50000);
+    return addr;
+}
+
+/*
+    one datagram from a user, with whatever it sent back in sent[]
+*/
+void request(int user, void *req, size_t len) {
+    struct sockaddr_in addr = user_addr(user);
+    nsent = 0;
+    oversized = 0;
+    engine_handle(&e, req, len, &addr);
+}
+
+void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        exit(1);
+    }
+    printf("ok: %s\n", what);
+}
+
+/*
+    a WHO on a channel with more users than one datagram holds
+*/
+void test_big_who() {
+    struct request_login login = { REQ_LOGIN, "" };
+    struct request_join join = { REQ_JOIN, "crowd" };
+    for (int i = 0; i < CROWD; i++) {
+        snprintf(login.req_username, USERNAME_MAX, "user%d", i);
+        request(i, &login, sizeof(login));
+        request(i, &join, sizeof(join));
+    }
+    struct request_who who = { REQ_WHO, "crowd" };
+    request(0, &who, sizeof(who));
+
+    int users = 0, ok = 1;
+    for (int i = 0; i < nsent; i++) {
+        struct text_who *txt = (struct text_who *)sent[i].buf;
+        ok = ok && txt->txt_type == TXT_WHO && strcmp(txt->txt_channel, "crowd") == 0 &&
+            txt->txt_nusernames <= TXT_WHO_MAX &&
+            sent[i].len == sizeof(*txt) + txt->txt_nusernames * sizeof(struct user_info);
+        users += txt->txt_nusernames;
+    }
+    check(oversized == 0, "WHO replies fit a datagram");
+    check(ok, "WHO replies are well formed");
+    check(users == CROWD, "WHO replies name every user");
+}
+
+/*
+    a LIST with more channels than one datagram holds
+*/
+void test_big_list() {
+    struct request_join join = { REQ_JOIN, "" };
+    for (int i = 0; i < CROWD; i++) {
+        snprintf(join.req_channel, CHANNEL_MAX, "ch%d", i);
+        request(0, &join, sizeof(join));
+    }
+    struct request_list list = { REQ_LIST };
+    request(0, &list, sizeof(list));
+
+    int channels = 0, ok = 1;
+    for (int i = 0; i < nsent; i++) {
+        struct text_list *txt = (struct text_list *)sent[i].buf;
+        ok = ok && txt->txt_type == TXT_LIST && txt->txt_nchannels <= TXT_LIST_MAX &&
+            sent[i].len == sizeof(*txt) + txt->txt_nchannels * sizeof(struct channel_info);
+        channels += txt->txt_nchannels;
+    }
+    check(oversized == 0, "LIST replies fit a datagram");
+    check(ok, "LIST replies are well formed");
+    check(channels == CROWD + 1, "LIST replies name every channel");
+}
+
+/*
+    S2S datagrams cut short or with a channel name that fills its field
+    are dropped before they reach the channel index
+*/
+void test_bad_s2s() {
+    struct s2s_join join;
+    join.req_type = S2S_JOIN;
+    memset(join.req_channel, 'x', CHANNEL_MAX);
+    uint32_t channels = e.state.channels.count;
+    uint64_t bad_string = e.counters.bad_string, bad_length = e.counters.bad_length;
+    request(CROWD, &join, sizeof(join));
+    check(e.state.channels.count == channels && e.counters.bad_string == bad_string + 1,
+        "S2S_JOIN without a terminator is dropped");
+
+    struct s2s_leave leave;
+    leave.req_type = S2S_LEAVE;
+    memset(leave.req_channel, 'x', CHANNEL_MAX);
+    request(CROWD, &leave, sizeof(leave));
+    check(e.counters.bad_string == bad_string + 2, "S2S_LEAVE without a terminator is dropped");
+
+    struct s2s_say say;
+    memset(&say, 0, sizeof(say));
+    say.req_type = S2S_SAY;
+    strcpy(say.req_channel, "crowd");
+    request(CROWD, &say, offsetof(struct s2s_say, req_text));
+    check(nsent == 0 && e.counters.bad_length == bad_length + 1, "short S2S_SAY is dropped");
+}
+
+/*
+    a neighbor that goes quiet is dropped from the channels it joined,
+    and only from those
+*/
+void test_prune() {
+    struct s2s_join join = { S2S_JOIN, "crowd" };
+    request(CROWD + 1, &join, sizeof(join));
+    strcpy(join.req_channel, "ch7");
+    request(CROWD + 1, &join, sizeof(join));
+    struct channel *crowd = state_lookup_channel(&e.state, "crowd");
+    struct channel *ch7 = state_lookup_channel(&e.state, "ch7");
+    check(crowd->subscribed_neighbors.count == 1 && ch7->subscribed_neighbors.count == 1,
+        "S2S_JOIN subscribes the neighbor");
+
+    uint64_t prunes = e.counters.prunes;
+    engine_set_clock(&e, 200 * 1000000ULL);
+    engine_advance(&e);
+    check(e.counters.prunes == prunes + 2 && crowd->subscribed_neighbors.count == 0 &&
+        ch7->subscribed_neighbors.count == 0, "a quiet neighbor is pruned from its channels");
+    check(state_find_channel(&e.state, "crowd") != NULL && state_find_channel(&e.state, "ch8") != NULL,
+        "pruning leaves the local channels");
+}
+
+int main() {
+    if (dclog_init(1, LOG_RING, stdout) < 0 || dclog_start() < 0) {
+        perror("dclog_init");
+        exit(1);
+    }
+    dclog_set_level(DCLOG_ERROR);
+    dclog_thread(0);
+
+    struct sockaddr_in addr = user_addr(-1);
+    transport.send = capture_send;
+    transport.send_many = capture_send_many;
+    if (engine_init(&e, &transport, &addr, 1, 4096, 60, 0) < 0) {
+        perror("engine_init");
+        exit(1);
+    }
+
+    test_big_who();
+    test_big_list();
+    test_bad_s2s();
+    test_prune();
+
+    engine_free(&e);
+    dclog_flush();
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <string.h>
+#include "epoch.h"
+/* See epoch.h for usage information */
+
+void epoch_init(struct epoch_domain *d, int nthreads) {
+    memset(d, 0, sizeof(*d));
+    d->global = 1;
+    d->nthreads = nthreads;
+}
+
+void epoch_enter(struct epoch_domain *d, int tid) {
+    struct epoch_thread *t = &d->threads[tid];
+    uint64_t e = __atomic_load_n(&d->global, __ATOMIC_RELAXED);
+    // a full barrier: the announcement has to be visible before we read
+    // anything shared
+    __atomic_exchange_n(&t->local, e << 1 | 1, __ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(struct epoch_domain *d, int tid) {
+    __atomic_store_n(&d->threads[tid].local, 0, __ATOMIC_RELEASE);
+}
+
+static void free_list(struct epoch_thread *t, int i) {
+    struct epoch_node *n = t->limbo[i];
+    while (n != NULL) {
+        struct epoch_node *next = n->next;
+        n->free(n);
+        t->freed++;
+        n = next;
+    }
+    t->limbo[i] = NULL;
+}
+
+/* frees every list retired at least two epochs before global */
+static void reclaim(struct epoch_thread *t, uint64_t global) {
+    for (int i = 0; i < 3; i++) {
+        if (t->limbo[i] != NULL && t->limbo_epoch[i] + 2 <= global) {
+            free_list(t, i);
+        }
+    }
+}
+
+void epoch_retire(struct epoch_domain *d, int tid, struct epoch_node *n) {
+    struct epoch_thread *t = &d->threads[tid];
+    // whatever was unlinked before this load is covered by this epoch
+    uint64_t e = __atomic_load_n(&d->global, __ATOMIC_SEQ_CST);
+    int i = e % 3;
+    if (t->limbo[i] != NULL && t->limbo_epoch[i] != e) {
+        free_list(t, i); // from e - 3 or earlier
+    }
+    t->limbo_epoch[i] = e;
+    n->next = t->limbo[i];
+    t->limbo[i] = n;
+    t->retired++;
+    epoch_poll(d, tid);
+}
+
+void epoch_poll(struct epoch_domain *d, int tid) {
+    uint64_t e = __atomic_load_n(&d->global, __ATOMIC_SEQ_CST);
+    int behind = 0;
+    for (int i = 0; i < d->nthreads; i++) {
+        uint64_t local = __atomic_load_n(&d->threads[i].local, __ATOMIC_SEQ_CST);
+        if ((local & 1) && (local >> 1) != e) {
+            behind = 1; // still reading in an older epoch
+            break;
+        }
+    }
+    if (!behind) {
+        // someone else may have moved it on already, either way is fine
+        __atomic_compare_exchange_n(&d->global, &e, e + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        e = __atomic_load_n(&d->global, __ATOMIC_SEQ_CST);
+    }
+    reclaim(&d->threads[tid], e);
+}
@@ -0,0 +1,47 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+#include <stdint.h>
+/* Epoch-based reclamation for data that one thread replaces while others
+* may still be reading the old copy.
+*
+* Readers bracket every access with epoch_enter() and epoch_exit(), which
+* are a couple of atomic stores and never wait. A writer publishes the new
+* version, then hands the old one to epoch_retire() instead of freeing it.
+* It is freed once the global epoch has moved on twice, which can only
+* happen after every reader that might have seen it has left. The epoch
+* moves on (and retired memory is freed) in epoch_poll(), which each
+* thread should call now and then; a thread's retired memory is only ever
+* freed by that thread.
+*
+* Threads are numbered 0 to nthreads - 1 and each uses only its own slot. */
+#define EPOCH_MAX_THREADS 64
+
+/* embedded in anything that gets retired */
+struct epoch_node {
+    struct epoch_node *next;
+    void (*free)(struct epoch_node *n);
+};
+
+struct epoch_thread {
+    _Alignas(64) uint64_t local;   /* epoch seen on entry << 1 | 1 while reading, 0 when idle */
+    struct epoch_node *limbo[3];   /* retired in epoch e, on list e % 3 */
+    uint64_t limbo_epoch[3];
+    uint64_t retired;
+    uint64_t freed;
+};
+
+struct epoch_domain {
+    _Alignas(64) uint64_t global;
+    int nthreads;
+    struct epoch_thread threads[EPOCH_MAX_THREADS];
+};
+
+void epoch_init(struct epoch_domain *d, int nthreads);
+void epoch_enter(struct epoch_domain *d, int tid);
+void epoch_exit(struct epoch_domain *d, int tid);
+/* Frees n with n->free once no reader can still hold it */
+void epoch_retire(struct epoch_domain *d, int tid, struct epoch_node *n);
+/* Moves the global epoch on if every reader has caught up with it, and
+* frees whatever of this thread's retired memory that makes safe */
+void epoch_poll(struct epoch_domain *d, int tid);
+#endif
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+#include "handoff.h"
+/* See handoff.h for usage information */
+
+int handoff_init(struct handoff_ring *r, uint32_t size) {
+    uint32_t cap = 1;
+    while (cap < size) {
+        cap <<= 1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->slots = malloc((size_t)cap * sizeof(struct handoff_msg));
+    if (r->slots == NULL) {
+        return -1;
+    }
+    r->size = cap;
+    return 0;
+}
+
+void handoff_free(struct handoff_ring *r) {
+    free(r->slots);
+    memset(r, 0, sizeof(*r));
+}
+
+int handoff_push(struct handoff_ring *r, const struct sockaddr_in *addr, const char *buf, uint32_t len) {
+    uint32_t tail = r->tail; // only we write it
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (tail - head == r->size) {
+        r->dropped++;
+        return -1;
+    }
+    struct handoff_msg *m = &r->slots[tail & (r->size - 1)];
+    if (len > UDP_MAX_DGRAM) {
+        len = UDP_MAX_DGRAM;
+    }
+    m->addr = *addr;
+    m->len = len;
+    memcpy(m->buf, buf, len);
+    // the copy has to be visible before the consumer can see the slot
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    r->passed++;
+    return 0;
+}
+
+int handoff_room(struct handoff_ring *r) {
+    return r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->size;
+}
+
+struct handoff_msg *handoff_peek(struct handoff_ring *r) {
+    uint32_t head = r->head; // only we write it
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+    return &r->slots[head & (r->size - 1)];
+}
+
+void handoff_pop(struct handoff_ring *r) {
+    // hands the slot back to the producer once we are done reading it
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
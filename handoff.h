@@ -0,0 +1,45 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+#include <netinet/in.h>
+#include <stdint.h>
+#include "udpio.h"
+/* A single producer, single consumer ring of datagrams, used to pass a
+* datagram from the worker that received it to the worker that owns its
+* channel. Each slot holds a full copy of the datagram and its sender, so
+* the producer can reuse its receive buffers straight away.
+*
+* The producer only writes tail and the consumer only writes head, so the
+* two sides never lock; they publish their progress with release stores
+* and read the other side's with acquire loads. When the ring is full the
+* datagram is dropped and counted, as the network would, unless the
+* producer waits for handoff_room() first. */
+struct handoff_msg {
+    struct sockaddr_in addr;
+    uint32_t len;
+    char buf[UDP_MAX_DGRAM];
+};
+
+struct handoff_ring {
+    /* kept on separate cache lines so the two sides don't contend */
+    _Alignas(64) uint32_t head;  /* next slot to consume */
+    _Alignas(64) uint32_t tail;  /* next slot to fill */
+    _Alignas(64) uint32_t size;  /* always a power of 2 */
+    struct handoff_msg *slots;
+
+    /* counters for reporting, written by the producer */
+    uint64_t passed;
+    uint64_t dropped;
+};
+
+/* Returns -1 if the memory could not be allocated, 0 on success */
+int handoff_init(struct handoff_ring *r, uint32_t size);
+void handoff_free(struct handoff_ring *r);
+/* Producer side. Returns -1 (and counts a drop) if the ring is full. */
+int handoff_push(struct handoff_ring *r, const struct sockaddr_in *addr, const char *buf, uint32_t len);
+/* Producer side. Whether the next push will find a free slot. */
+int handoff_room(struct handoff_ring *r);
+/* Consumer side. Returns the oldest datagram, or NULL if the ring is
+* empty. It stays valid until handoff_pop(). */
+struct handoff_msg *handoff_peek(struct handoff_ring *r);
+void handoff_pop(struct handoff_ring *r);
+#endif
@@ -0,0 +1,58 @@
+#include <string.h>
+#include "lathist.h"
+/* See lathist.h for usage information */
+
+static int bucket_of(uint64_t v) {
+    if (v < LATHIST_SUB) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - LATHIST_SUB_BITS;
+    return (shift + 1) * LATHIST_SUB + (int)((v >> shift) & (LATHIST_SUB - 1));
+}
+
+/* the largest value that lands in a bucket */
+static uint64_t bucket_top(int bucket) {
+    if (bucket < LATHIST_SUB) {
+        return bucket;
+    }
+    int shift = bucket / LATHIST_SUB - 1;
+    uint64_t low = (uint64_t)(LATHIST_SUB + bucket % LATHIST_SUB) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+void lathist_record(struct lathist *h, uint64_t value) {
+    h->buckets[bucket_of(value)]++;
+    h->count++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void lathist_merge(struct lathist *into, const struct lathist *from) {
+    for (int i = 0; i < LATHIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+uint64_t lathist_percentile(const struct lathist *h, double p) {
+    if (h->count == 0) {
+        return 0;
+    }
+    uint64_t want = (uint64_t)(p * h->count);
+    if (want < p * h->count || want == 0) {
+        want++; // round up, and the 0th percentile is still a sample
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LATHIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,24 @@
+#ifndef LATHIST_H
+#define LATHIST_H
+#include <stdint.h>
+/* Latency histogram for the load tools. Values below LATHIST_SUB get a
+* bucket each; above that every power of two is split into LATHIST_SUB
+* linear buckets, so a bucket is never more than ~6% wide relative to
+* the values in it, from nanoseconds up to hours. Recording is a couple
+* of shifts. */
+#define LATHIST_SUB_BITS 4
+#define LATHIST_SUB (1 << LATHIST_SUB_BITS)
+#define LATHIST_BUCKETS ((64 - LATHIST_SUB_BITS + 1) * LATHIST_SUB)
+
+struct lathist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LATHIST_BUCKETS];
+};
+
+void lathist_record(struct lathist *h, uint64_t value);
+void lathist_merge(struct lathist *into, const struct lathist *from);
+/* The value at or below which a fraction p of the samples fall, to
+* within a bucket, and never more than the largest sample. 0 if empty. */
+uint64_t lathist_percentile(const struct lathist *h, double p);
+#endif
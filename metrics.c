@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+/* See metrics.h for usage information */
+
+static size_t page_size(uint32_t nworkers) {
+    return sizeof(struct metrics_page) + (size_t)nworkers * sizeof(struct metrics_block);
+}
+
+static void page_name(char *name, size_t len, int port) {
+    snprintf(name, len, "/duckchat.%d", port);
+}
+
+struct metrics_page *metrics_create(int port, int nworkers) {
+    char name[64];
+    page_name(name, sizeof(name), port);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    size_t size = page_size(nworkers);
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return NULL;
+    }
+    struct metrics_page *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    // fresh from ftruncate, so already zeroed
+    p->version = METRICS_VERSION;
+    p->nworkers = nworkers;
+    p->pid = getpid();
+    p->port = port;
+    __atomic_store_n(&p->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    return p;
+}
+
+struct metrics_page *metrics_attach(int port) {
+    char name[64];
+    page_name(name, sizeof(name), port);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    struct metrics_page *p = NULL;
+    if ((size_t)st.st_size >= sizeof(struct metrics_page)) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (p == NULL || p == MAP_FAILED) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+        p->version != METRICS_VERSION || (size_t)st.st_size < page_size(p->nworkers)) {
+        munmap(p, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return p;
+}
+
+void metrics_publish(struct metrics_block *b, const struct metrics *m) {
+    uint32_t seq = b->seq; // only we write it
+    __atomic_store_n(&b->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // odd count before any data
+    memcpy(&b->m, m, sizeof(*m));
+    __atomic_store_n(&b->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void metrics_read(const struct metrics_block *b, struct metrics *m) {
+    while (1) {
+        uint32_t before = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue; // being written
+        }
+        memcpy(m, &b->m, sizeof(*m));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // data before the second count
+        if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) == before) {
+            return;
+        }
+    }
+}
+
+void metrics_sum(const struct metrics_page *p, struct metrics *total) {
+    memset(total, 0, sizeof(*total));
+    for (uint32_t w = 0; w < p->nworkers; w++) {
+        struct metrics m;
+        metrics_read(&p->workers[w], &m);
+
+        // every field is a uint64_t counter, so they can be summed blindly
+        uint64_t *dst = (uint64_t *)total;
+        uint64_t *src = (uint64_t *)&m;
+        for (size_t i = 0; i < sizeof(m) / sizeof(uint64_t); i++) {
+            dst[i] += src[i];
+        }
+    }
+}
+
+int metrics_unlink(int port) {
+    char name[64];
+    page_name(name, sizeof(name), port);
+    return shm_unlink(name);
+}
@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+/* Server counters in a shared memory page that duckstat can read while
+* the server runs.
+*
+* Every worker counts into its own private struct metrics with plain
+* increments. Now and then (on each timer tick) it copies that struct
+* into its block of the page, bracketed by the block's sequence count: odd
+* while the copy is in progress, even once it is done. A reader copies the
+* block out and retries if the count was odd or changed underneath it, so
+* neither side ever waits on the other and the hot path never sees the
+* page at all.
+*
+* The page is the POSIX shared memory object "/duckchat.<port>". */
+#define METRICS_MAGIC 0x4d4b4344u /* "DCKM" */
+#define METRICS_VERSION 4
+#define METRICS_TYPES 16   /* REQ_* and S2S_* by value, the last one counts anything else */
+#define METRICS_BUCKETS 32 /* histogram bucket i counts values in [2^i, 2^(i+1)) */
+
+struct metrics {
+    uint64_t received[METRICS_TYPES]; /* datagrams handled, by request type */
+    uint64_t bad_length;   /* dropped by validate_pac() */
+    uint64_t bad_string;   /* dropped by validate_str() */
+    uint64_t dedup_hits;   /* S2S says isdup() caught */
+    uint64_t prunes;       /* neighbors pruned from a channel */
+    uint64_t renews;       /* S2S joins sent again after a digest didn't match */
+    uint64_t tree_changes; /* times the spanning tree parent changed */
+    uint64_t bulk_joins;   /* channels received in S2S_JOIN_BULKs */
+    uint64_t repairs;      /* digest sums that didn't match ours */
+    uint64_t listed;       /* channels received in S2S_SUBSCRIBEDs */
+    uint64_t fanouts;      /* say fan-outs, and their sizes in destinations: */
+    uint64_t fanout_hist[METRICS_BUCKETS];
+    uint64_t handled;      /* datagrams timed, and their handling time in ns: */
+    uint64_t handle_ns;
+    uint64_t handle_hist[METRICS_BUCKETS];
+};
+
+struct metrics_block {
+    _Alignas(64) uint32_t seq;
+    struct metrics m;
+};
+
+struct metrics_page {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nworkers;
+    int32_t pid;
+    int32_t port;
+    struct metrics_block workers[]; /* nworkers of them */
+};
+
+/* Server side: creates (or replaces) the page for port and maps it.
+* Returns NULL with errno set on failure. */
+struct metrics_page *metrics_create(int port, int nworkers);
+/* Reader side: maps an existing page read-only. Returns NULL with errno
+* set on failure. */
+struct metrics_page *metrics_attach(int port);
+/* Copies m into block b. Only the block's own worker may call this. */
+void metrics_publish(struct metrics_block *b, const struct metrics *m);
+/* Takes a consistent copy of block b */
+void metrics_read(const struct metrics_block *b, struct metrics *m);
+/* Adds up a consistent copy of every worker's block */
+void metrics_sum(const struct metrics_page *p, struct metrics *total);
+/* Removes the page for port, for tools that start and stop servers */
+int metrics_unlink(int port);
+
+/* Adds one to the histogram bucket for value */
+static inline void metrics_record(uint64_t *hist, uint64_t value) {
+    int bucket = value > 1 ? 63 - __builtin_clzll(value) : 0;
+    hist[bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1]++;
+}
+#endif
@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+#include "namemap.h"
+/* See namemap.h for usage information */
+
+#define NAMEMAP_MIN_CAP 64
+
+/* FNV-1a over the name, stopping at the terminator or maxlen */
+static uint32_t name_hash(const char *name, size_t maxlen) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < maxlen && name[i] != '\0'; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_slot(uint32_t hash, uint32_t cap) {
+    return (uint32_t)(((uint64_t)hash * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+void namemap_init(struct namemap *m, size_t maxlen) {
+    m->slots = NULL;
+    m->cap = 0;
+    m->count = 0;
+    m->maxlen = maxlen;
+}
+
+void namemap_free(struct namemap *m) {
+    free(m->slots);
+    namemap_init(m, m->maxlen);
+}
+
+static int grow(struct namemap *m) {
+    uint32_t new_cap = m->cap ? m->cap * 2 : NAMEMAP_MIN_CAP;
+    struct namemap_slot *slots = calloc(new_cap, sizeof(struct namemap_slot));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < m->cap; i++) {
+        if (m->slots[i].key != NULL) {
+            uint32_t j = hash_slot(m->slots[i].hash, new_cap);
+            while (slots[j].key != NULL) {
+                j = (j + 1) & (new_cap - 1);
+            }
+            slots[j] = m->slots[i];
+        }
+    }
+    free(m->slots);
+    m->slots = slots;
+    m->cap = new_cap;
+    return 0;
+}
+
+/* index of the slot holding name, or of the empty slot ending its run */
+static uint32_t probe(const struct namemap *m, const char *name, uint32_t hash) {
+    uint32_t i = hash_slot(hash, m->cap);
+    while (m->slots[i].key != NULL) {
+        if (m->slots[i].hash == hash && strncmp(m->slots[i].key, name, m->maxlen) == 0) {
+            break;
+        }
+        i = (i + 1) & (m->cap - 1);
+    }
+    return i;
+}
+
+void *namemap_get(const struct namemap *m, const char *name) {
+    if (m->count == 0) {
+        return NULL;
+    }
+    uint32_t i = probe(m, name, name_hash(name, m->maxlen));
+    return m->slots[i].value; // NULL for an empty slot
+}
+
+int namemap_put(struct namemap *m, const char *name, void *value) {
+    if ((m->count + 1) * 2 > m->cap && grow(m) < 0) {
+        return -1;
+    }
+    uint32_t hash = name_hash(name, m->maxlen);
+    uint32_t i = probe(m, name, hash);
+    if (m->slots[i].key == NULL) {
+        m->count++;
+    }
+    m->slots[i].key = name;
+    m->slots[i].hash = hash;
+    m->slots[i].value = value;
+    return 0;
+}
+
+void namemap_del(struct namemap *m, const char *name) {
+    if (m->count == 0) {
+        return;
+    }
+    uint32_t mask = m->cap - 1;
+    uint32_t hole = probe(m, name, name_hash(name, m->maxlen));
+    if (m->slots[hole].key == NULL) {
+        return; // not present
+    }
+
+    // backward shift, same as addrmap_del()
+    uint32_t j = hole;
+    while (1) {
+        j = (j + 1) & mask;
+        if (m->slots[j].key == NULL) {
+            break;
+        }
+        uint32_t home = hash_slot(m->slots[j].hash, m->cap);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            m->slots[hole] = m->slots[j];
+            hole = j;
+        }
+    }
+    m->slots[hole].key = NULL;
+    m->slots[hole].value = NULL;
+    m->count--;
+}
@@ -0,0 +1,35 @@
+#ifndef NAMEMAP_H
+#define NAMEMAP_H
+#include <stddef.h>
+#include <stdint.h>
+/* Hash index keyed on a fixed-width name such as a channel name. Names
+* are compared with strncmp() up to maxlen bytes, so keys coming straight
+* off the wire don't need to be null terminated.
+*
+* The index doesn't copy keys. The key pointer handed to namemap_put()
+* must stay valid (and unchanged) until the entry is deleted, which is
+* easiest to guarantee by pointing it at the name inside the value.
+*
+* Same layout as addrmap: linear probing, backward shift deletes,
+* doubling once half full. */
+struct namemap_slot {
+    const char *key; /* NULL = empty */
+    uint32_t hash;
+    void *value;
+};
+
+struct namemap {
+    struct namemap_slot *slots;
+    uint32_t cap; /* always a power of 2 */
+    uint32_t count;
+    size_t maxlen;
+};
+
+void namemap_init(struct namemap *m, size_t maxlen);
+void namemap_free(struct namemap *m);
+/* Returns the value stored for name, or NULL if there is none */
+void *namemap_get(const struct namemap *m, const char *name);
+/* Inserts or replaces. Returns -1 if the table could not grow, 0 on success */
+int namemap_put(struct namemap *m, const char *name, void *value);
+void namemap_del(struct namemap *m, const char *name);
+#endif
@@ -4,7 +4,16 @@ Nicholas Anthony
 11/30/2024
 */
 #include "duckchat.h"
+#include "engine.h"
+#include "udpio.h"
+#include "handoff.h"
+#include "wheel.h"
+#include "epoch.h"
+#include "dclog.h"
+#include "metrics.h"
+#include "capture.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,140 +26,194 @@ Nicholas Anthony
 #include <errno.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
-
-#define MAX_USERS 100
-#define MAX_CHANNELS 100
-#define MAX_MESSAGE_IDS 100
+#include <getopt.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define DEDUP_WINDOW 4096        // default reordering tolerated per origin, in messages
+#define DEDUP_EXPIRY 600         // default seconds before a silent origin is forgotten
+#define STATS_INTERVAL 60        // seconds between stats reports
+#define RX_BATCH 32              // default datagrams per receive syscall
+#define MAX_WORKERS 64           // most worker threads, one bit each in a wake mask
+#define HANDOFF_SLOTS 256        // datagrams queued between each pair of workers
+#define LOG_RING 4096            // log records buffered per worker
 
 // structs
-struct user {
-    char username[USERNAME_MAX];
-    struct sockaddr_in addr;
+/*
+    a worker thread. every worker has its own SO_REUSEPORT socket and its
+    own copy of the server state below, and owns the channels whose names
+    hash to its index. a datagram about a channel it doesn't own is passed
+    to the owner through the owner's inbox
+*/
+struct worker {
+    int index;
+    int fd;                     // this worker's socket
+    int wake_fd;                // eventfd, signalled after something is put in the inbox
+    int epoll_fd;               // the worker's reactor: socket, inbox and timer
+    int timer_fd;               // ticks the timing wheel every TICK_MS
+    pthread_t thread;
+    struct handoff_ring *inbox; // inbox[i] is filled by worker i
 };
 
-struct channel {
+/*
+    the channels that are local on some worker, for LIST. only touched when
+    a channel is created or deleted, never on the say path
+*/
+struct directory_entry {
     char name[CHANNEL_MAX];
-    int user_count;
-    struct user *users[MAX_USERS];
+    uint32_t pos; // index in directory
 };
 
-struct neighbor {
-    struct sockaddr_in addr;
-    int active;
-    time_t last_active; // timestamp last seen active
+/*
+    where worker 0 put the server in the spanning tree. the other workers'
+    engines follow it, so the neighbors see one parent. a seqlock, since
+    the three fields have to be read together
+*/
+struct tree_share {
+    uint64_t seq;               // odd while worker 0 is writing
+    uint64_t root, parent;
+    uint32_t cost;
 };
 
-
-struct routing_table {
-    char channel_name[CHANNEL_MAX];
-    struct neighbor *subscribed_neighbors[MAX_CHANNELS];
-    int neighbor_count;
+/*
+    an immutable copy of the directory. the first LIST after a change builds
+    a new one and swaps it in, so a burst of joins and leaves costs one copy
+    at most. readers copy out of whichever one they loaded without taking a
+    lock. replaced copies are freed through the epochs
+*/
+struct directory_snapshot {
+    struct epoch_node node; // first, so a retired node is the snapshot itself
+    uint64_t version;
+    uint32_t count;
+    char names[][CHANNEL_MAX];
 };
 
-struct message_id {
-    uint64_t id;
-    time_t timestamp;
-};
 
 // global struct vars
 struct sockaddr_in server_addr;
-struct channel channels[MAX_CHANNELS];
-struct user *users[MAX_USERS];
-struct neighbor neighbors[MAX_CHANNELS];
-struct routing_table routing_table[MAX_CHANNELS];
-struct message_id rcnt_message_ids[MAX_MESSAGE_IDS];
+struct worker *workers;
+int nworkers = 1;
+uint32_t origin_base;          // worker i originates S2S say ids as origin_base + i
+pthread_mutex_t directory_lock = PTHREAD_MUTEX_INITIALIZER; // serializes writers only
+struct namemap directory_index; // name -> struct directory_entry *, under directory_lock
+struct pvec directory;          // struct directory_entry *, under directory_lock
+struct arena directory_arena;   // backs directory, under directory_lock
+struct directory_snapshot *directory_snap; // current snapshot, swapped atomically
+int directory_stale;            // the directory changed since the snapshot, set under directory_lock
+struct tree_share tree_share;   // worker 0's place in the spanning tree
+struct epoch_domain epochs;     // when replaced snapshots can be freed
+struct metrics_page *metrics_page; // shared with duckstat, one block per worker
+int capture_fd = -1;            // -p capture file, appended to by every worker
+
+// per worker state
+__thread struct worker *self;
+__thread struct engine engine;          // users, channels, neighbors, timers and counters
+__thread struct engine_transport transport; // the engine's sends, through this worker's socket
+__thread struct udp_batch rx_batch;     // receive buffers, filled a batch at a time
+__thread struct udp_fanout fanout;      // sends one payload to many destinations per syscall
+__thread uint64_t wake_mask = 0;        // workers handed a datagram since they were last woken
+__thread struct wheel_timer stats_timer;
+__thread struct capture_writer capture; // this worker's share of the capture file, if there is one
+__thread uint64_t tree_seen;            // the tree_share seq this worker followed last
+__thread uint64_t clock_ns;             // the last monotonic clock reading, see handle_timed()
 
 // global int/count vars
-int sockfd;
-int channel_count = 0;
-int user_count = 0;
-int neighbor_count = 0;
-int routing_table_count = 0;
-int message_count = 0;
-time_t start_time = 0;
+__thread int sockfd;
+long dedup_window = DEDUP_WINDOW;
+long dedup_expiry = DEDUP_EXPIRY;
+long batch_size = RX_BATCH;
+int neighbor_argc;
+char **neighbor_argv;
+int log_level = DCLOG_DEBUG;
+char *capture_path = NULL;
+unsigned log_categories = DCLOG_ALL;
+
 
 
 // functions
-struct user* find_user(struct sockaddr_in *client_addr);
-struct channel* find_channel(char *channel_name);
-struct routing_table *find_rt_entry(char *channel_name);
-void send_d(void *txt, size_t txt_size, struct sockaddr_in *addr);
-void login(char *username, struct sockaddr_in *client_addr);
-void logout(struct sockaddr_in *client_addr);
-void join_channel(char *channel_name, struct sockaddr_in *client_addr);
-void leave_channel(char *channel_name, struct sockaddr_in *client_addr);
-void say(char *channel_name, char *message, struct sockaddr_in *client_addr);
-void delete_channel(struct channel *ch);
-void list_channels(struct sockaddr_in *client_addr);
-void who(char *channel_name, struct sockaddr_in *client_addr);
-int user_present(struct user *u, struct channel *ch);
-void remove_user(char *username, struct channel *ch);
-void broadcast(struct text_say *txt_say, struct channel *ch);
-int validate_str(const char *str, size_t max_len);
-int validate_pac(int rcv_len, int correct_len);
-void send_err(char *err, struct sockaddr_in *client_addr);
+void send_d(void *ctx, const void *txt, size_t txt_size, const struct sockaddr_in *addr);
+void send_many(void *ctx, const void *txt, size_t txt_size, const struct sockaddr_in *addrs, uint32_t n);
 void init_neighbors(int argc, char *argv[]);
-void s2s_join(char *channel_name);
-void s2s_leave(char *channel_name);
-void s2s_say(char *username, char *channel_name, char *message, uint64_t unique_id);
-void renew_join();
-void add_neighbor_to_channel(char *channel_name, struct sockaddr_in *neighbor_addr);
-void remove_neighbor_from_channel(char *channel_name, struct sockaddr_in *neighbor_addr);
-int isdup(uint64_t message_id);
-void prune();
-void log_message(const struct sockaddr_in *local_addr, const struct sockaddr_in *remote_addr,
-                 const char *direction, const char *message_type, const char *channel,
-                const char *username, const char *text);
-void fwd_s2s_join(char *channel_name, struct sockaddr_in *sender_addr);
-void *timer_thread(void *arg);
+void stats_expired(void *arg);
+void update_clock();
+void *worker_main(void *arg);
+void init_worker();
+int channel_owner(const char *channel_name);
+int packet_owner(char *buffer, int len);
+void dispatch_packet(char *buffer, int len, struct sockaddr_in *client_addr);
+void wait_for_room(int i);
+void wake_workers();
+void drain_inbox();
+void publish_channel(void *ctx, const char *channel_name);
+void withdraw_channel(void *ctx, const char *channel_name);
+struct text_list *list_directory(void *ctx, size_t *size);
+void publish_directory();
+void share_tree();
+void free_snapshot(struct epoch_node *n);
 void init_random();
 void server_print(const char *fmt, ...);
-uint64_t generate_unique_id();
-void delete_rt_entry(char *channel_name);
+void server_log(int level, int category, const char *fmt, ...);
+void vserver_log(int level, int category, const char *fmt, va_list args);
+void log_verbosity(int sig);
+void print_stats();
+void handle_timed(char *buffer, int len, struct sockaddr_in *client_addr);
+
+// every worker's engine lists the channels of all of them
+const struct engine_directory directory_ops = { NULL, publish_channel, withdraw_channel, list_directory };
 /*
  * BEGIN FUNCTION DEFINITIONS
  */
 /*
-    used to delete internal records (as per the guide) of channel after sending a leave
+ from https://medium.com/@turman1701/va-list-in-c-exploring-ft-printf-bb2a19fcd128
 */
-void delete_rt_entry(char *channel_name) {
-    for (int i = 0; i < routing_table_count; i++) {
-        if (strncmp(routing_table[i].channel_name, channel_name, CHANNEL_MAX) == 0) {
-            // shift up
-            for (int j = i; j < routing_table_count - 1; j++) {
-                routing_table[j] = routing_table[j + 1];
-            }
-            routing_table_count--;
-            server_print("Deleted routing table entry for channel %s.\n", channel_name);
-            break;
-        }
-    }
+void server_print(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vserver_log(DCLOG_INFO, DCLOG_SERVER, fmt, args);
+    va_end(args);
 }
 /*
- from https://medium.com/@turman1701/va-list-in-c-exploring-ft-printf-bb2a19fcd128
+    server_print() with an explicit level and category
 */
-void server_print(const char *fmt, ...) {
-    char ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &server_addr.sin_addr, ip_str, INET_ADDRSTRLEN);
-    int port = ntohs(server_addr.sin_port);
-
-    printf("%s:%d ", ip_str, port);
-
+void server_log(int level, int category, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    vprintf(fmt, args);
+    vserver_log(level, category, fmt, args);
     va_end(args);
 }
 /*
-    create unique ID from seed
+    queue a line for the log thread. the address prefix is added when it
+    is written out, and nothing is formatted at all if the line is filtered
+*/
+void vserver_log(int level, int category, const char *fmt, va_list args) {
+    struct dclog_record *r = dclog_begin(level, category);
+    if (r == NULL) {
+        return;
+    }
+    r->kind = DCLOG_TEXT;
+    r->u.text.addr = server_addr;
+    if (vsnprintf(r->u.text.text, DCLOG_TEXT_MAX, fmt, args) >= DCLOG_TEXT_MAX) {
+        r->u.text.text[DCLOG_TEXT_MAX - 2] = '\n'; // cut short, but still a whole line
+    }
+    dclog_commit(r);
+}
+/*
+    SIGUSR1 logs more, SIGUSR2 logs less
 */
-uint64_t generate_unique_id() {
-    uint64_t id = ((uint64_t)rand() << 32) | rand();
-    return id;
+void log_verbosity(int sig) {
+    int level = dclog_get_level();
+    if (sig == SIGUSR1 && level < DCLOG_DEBUG) {
+        dclog_set_level(level + 1);
+    } else if (sig == SIGUSR2 && level > DCLOG_ERROR) {
+        dclog_set_level(level - 1);
+    }
 }
 /*
-    create seed from urandom
+    create seed and origin ids from urandom. the origin ids are fresh every run, so
+    neighbors never mistake a restarted server's new sequence numbers for old ones
 */
 void init_random() {
     FILE *fp = fopen("/dev/urandom", "rb");
@@ -159,7 +222,8 @@ void init_random() {
         perror("Error opening /dev/urandom");
         exit(1);
     }
-    if (fread(&seed, sizeof(seed), 1, fp) != 1) {
+    if (fread(&seed, sizeof(seed), 1, fp) != 1 ||
+        fread(&origin_base, sizeof(origin_base), 1, fp) != 1) {
         perror("Error reading from /dev/urandom");
         fclose(fp);
         exit(1);
@@ -168,151 +232,107 @@ void init_random() {
     srand(seed);
 }
 
-void *timer_thread(void *arg) {
-    (void)arg;
-    while (1) {
-        sleep(1);
-
-        time_t now = time(NULL);
-
-        // check if its time to renew joins
-        static time_t last_renew = 0;
-        if (now - last_renew >= 60) {
-            renew_join();
-            last_renew = now;
-        }
-
-        // prune inactive neighbors
-        prune();
-    }
-    return NULL;
-}
 /*
-    logging function for the s2s messages
+    set the engine's clock from the monotonic one. everything handled in one
+    reactor wakeup shares the reading, so packets don't each cost a clock call
 */
-void log_message(const struct sockaddr_in *local_addr, const struct sockaddr_in *remote_addr,
-                 const char *direction, const char *message_type, const char *channel,
-                 const char *username, const char *text) {
-
-    char local_ip[INET_ADDRSTRLEN];
-    char remote_ip[INET_ADDRSTRLEN];
-
-    inet_ntop(AF_INET, &local_addr->sin_addr, local_ip, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &remote_addr->sin_addr, remote_ip, INET_ADDRSTRLEN);
-
-    printf("%s:%d %s:%d %s %s %s",
-           local_ip, ntohs(local_addr->sin_port),
-           remote_ip, ntohs(remote_addr->sin_port),
-           direction, message_type, channel);
-
-    if (username != NULL) {
-        printf(" %s", username);
-    }
-
-    if (text != NULL) {
-        printf(" \"%s\"", text);
-    }
-
-    printf("\n");
+void update_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    clock_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    engine_set_clock(&engine, clock_ns / 1000);
 }
-
 /*
-    finds a routing table entry based on a channel name
+    worker 0 publishes its place in the spanning tree when it moves, and
+    the others follow it. once a tick is quick enough: until they catch
+    up they only forward over the old links
 */
-struct routing_table *find_rt_entry(char *channel_name) {
-    for (int i = 0; i < routing_table_count; i++) {
-        if (strncmp(routing_table[i].channel_name, channel_name, CHANNEL_MAX) == 0) {
-            return &routing_table[i];
-        }
+void share_tree() {
+    if (nworkers == 1) {
+        return;
     }
-    return NULL;
-}
-/*
-    checks if a given message id is a duplicate or new, and adds it to rcnt_message_ids for loop detection
-*/
-int isdup(uint64_t message_id) {
-    time_t now = time(NULL);
-
-
-    for (int i = 0; i < message_count; i++) {
-        if (rcnt_message_ids[i].id == message_id) {
-            return 1; // dup found
+    uint64_t root, parent, seq;
+    uint32_t cost;
+    if (self->index == 0) {
+        engine_tree_position(&engine, &root, &cost, &parent);
+        if (root == tree_share.root && cost == tree_share.cost && parent == tree_share.parent) {
+            return;
         }
+        seq = tree_share.seq;
+        __atomic_store_n(&tree_share.seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&tree_share.root, root, __ATOMIC_RELAXED);
+        __atomic_store_n(&tree_share.cost, cost, __ATOMIC_RELAXED);
+        __atomic_store_n(&tree_share.parent, parent, __ATOMIC_RELAXED);
+        __atomic_store_n(&tree_share.seq, seq + 2, __ATOMIC_RELEASE);
+        return;
     }
-
-    // add new message ID if it exists
-    if (message_count < MAX_MESSAGE_IDS) {
-        rcnt_message_ids[message_count].id = message_id;
-        rcnt_message_ids[message_count].timestamp = now;
-        message_count++;
-    } else {
-        // overwrite oldest entry
-        int oldest_index = 0;
-        for (int i = 1; i < MAX_MESSAGE_IDS; i++) {
-            if (rcnt_message_ids[i].timestamp < rcnt_message_ids[oldest_index].timestamp) {
-                oldest_index = i;
-            }
-        }
-        rcnt_message_ids[oldest_index].id = message_id;
-        rcnt_message_ids[oldest_index].timestamp = now;
+    do {
+        seq = __atomic_load_n(&tree_share.seq, __ATOMIC_ACQUIRE);
+        root = __atomic_load_n(&tree_share.root, __ATOMIC_RELAXED);
+        cost = __atomic_load_n(&tree_share.cost, __ATOMIC_RELAXED);
+        parent = __atomic_load_n(&tree_share.parent, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&tree_share.seq, __ATOMIC_RELAXED));
+    if (seq != tree_seen) {
+        tree_seen = seq;
+        engine_follow(&engine, root, cost, parent);
     }
-    return 0; // nodup
 }
-
 /*
-    function used in conjunction with the timer to renew join messages to each channel
+    report, then again STATS_INTERVAL later
 */
-void renew_join() {
-    for (int i = 0; i < routing_table_count; i++) {
-        struct routing_table *rt = &routing_table[i];
-
-        // for each channel we are subscribed to, send join to neighbors
-        struct s2s_join join_msg;
-        join_msg.req_type = S2S_JOIN;
-        strncpy(join_msg.req_channel, rt->channel_name, CHANNEL_MAX);
-
-        for (int j = 0; j < neighbor_count; j++) {
-            struct neighbor *nbr = &neighbors[j];
-            send_d(&join_msg, sizeof(join_msg), &nbr->addr);
-
-            log_message(&server_addr, &nbr->addr, "renew", "S2S Join", rt->channel_name, NULL, NULL);
+void stats_expired(void *arg) {
+    (void)arg;
+    print_stats();
+    wheel_add(&engine.timers, &stats_timer, engine_tick(engine.clock_ms + STATS_INTERVAL * 1000));
+}
+/*
+    periodic one-line summary of the server's state
+*/
+void print_stats() {
+    struct server_state *st = &engine.state;
+    double hit_rate = st->recent_ids.lookups ? 100.0 * st->recent_ids.hits / st->recent_ids.lookups : 0.0;
+    server_log(DCLOG_INFO, DCLOG_STATS, "stats: worker %d, %u users, %u channels, %u neighbors, dedup %u origins, %llu lookups, %.1f%% hits, %llu stale, %llu expired\n",
+        self->index, st->users.count, st->channels.count, st->neighbors.count, st->recent_ids.count,
+        (unsigned long long)st->recent_ids.lookups, hit_rate,
+        (unsigned long long)st->recent_ids.stale,
+        (unsigned long long)st->recent_ids.expired);
+    double fill = rx_batch.calls ? (double)rx_batch.datagrams / rx_batch.calls : 0.0;
+    server_log(DCLOG_INFO, DCLOG_STATS, "stats: rx batch %u, %llu datagrams in %llu receives, %.2f per receive\n",
+        rx_batch.size, (unsigned long long)rx_batch.datagrams,
+        (unsigned long long)rx_batch.calls, fill);
+    double per_send = fanout.calls ? (double)fanout.datagrams / fanout.calls : 0.0;
+    server_log(DCLOG_INFO, DCLOG_STATS, "stats: fanout %llu datagrams in %llu sends, %.2f per send, %llu datagrams failed to send\n",
+        (unsigned long long)fanout.datagrams, (unsigned long long)fanout.calls,
+        per_send, (unsigned long long)fanout.errors);
+    server_log(DCLOG_INFO, DCLOG_STATS, "stats: %llu fan-out plans rebuilt, %llu timers fired, %llu cascaded\n",
+        (unsigned long long)st->plan_builds, (unsigned long long)engine.timers.fired,
+        (unsigned long long)engine.timers.cascaded);
+    struct epoch_thread *et = &epochs.threads[self->index];
+    server_log(DCLOG_INFO, DCLOG_STATS, "stats: directory version %llu, %llu snapshots retired, %llu freed\n",
+        (unsigned long long)__atomic_load_n(&directory_snap, __ATOMIC_ACQUIRE)->version,
+        (unsigned long long)et->retired, (unsigned long long)et->freed);
+    if (nworkers > 1) {
+        uint64_t passed = 0, dropped = 0;
+        for (int i = 0; i < nworkers; i++) {
+            if (i != self->index) {
+                passed += workers[i].inbox[self->index].passed;
+                dropped += workers[i].inbox[self->index].dropped;
+            }
         }
+        server_log(DCLOG_INFO, DCLOG_STATS, "stats: %llu datagrams handed to other workers, %llu dropped on a full inbox\n",
+            (unsigned long long)passed, (unsigned long long)dropped);
     }
-}
-
-void prune() {
-    time_t now = time(NULL);
-
-    // dont want to prune neighbors in first 2 minutes of runtime
-    if(start_time != 0 && now - start_time < 119) {
-        return;
+    if (capture_fd >= 0) {
+        server_log(DCLOG_INFO, DCLOG_STATS, "stats: %llu datagrams captured, %llu lost to failed writes\n",
+            (unsigned long long)capture.records, (unsigned long long)capture.errors);
     }
-    //printf("prune() called at %ld\n", now);
-    for (int i = 0; i < routing_table_count; i++) {
-        struct routing_table *rt = &routing_table[i];
-        int inactive_neighbors[MAX_CHANNELS];
-        int inactive_count = 0;
-
-        // mark neighbors for removal >:)
-        for (int j = 0; j < rt->neighbor_count; j++) {
-            struct neighbor *nbr = rt->subscribed_neighbors[j];
-
-            // check for inactivity
-            if (now - nbr->last_active > 120) {
-                inactive_neighbors[inactive_count++] = j;
-                log_message(&server_addr, &nbr->addr, "prune", "S2S Leave", NULL, NULL, "Neighbor inactivity exceeded 120 seconds");
-            }
-        }
-
-        // remove em
-        for (int k = 0; k < inactive_count; k++) {
-            struct neighbor *nbr = rt->subscribed_neighbors[inactive_neighbors[k]];
-            remove_neighbor_from_channel(rt->channel_name, &nbr->addr);
-        }
+    if (self->index == 0) {
+        server_log(DCLOG_INFO, DCLOG_STATS, "stats: %llu log records dropped on a full log ring\n",
+            (unsigned long long)dclog_dropped());
     }
 }
-
-
 /*
     add "neighboring" servers to current server
 */
@@ -322,607 +342,536 @@ void init_neighbors(int argc, char *argv[]) {
         exit(1);
     }
 
-    memset(neighbors, 0, sizeof(neighbors));
-
     // iterate over all args, each pair is a neighbor's IP and port (supposedly)
     for (int i = 3; i < argc; i += 2) {
         char *neighbor_ip = argv[i];
         int neighbor_port = atoi(argv[i + 1]);
 
-        struct neighbor new_neighbor;
-        memset(&new_neighbor, 0, sizeof(new_neighbor));
-        new_neighbor.addr.sin_family = AF_INET;
-        new_neighbor.addr.sin_port = htons(neighbor_port);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(neighbor_port);
 
-        if (inet_pton(AF_INET, neighbor_ip, &new_neighbor.addr.sin_addr) <= 0) {
+        if (inet_pton(AF_INET, neighbor_ip, &addr.sin_addr) <= 0) {
             if (strcmp(neighbor_ip, "localhost") == 0){
-                new_neighbor.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
             }else{
                 perror("Invalid IP address");
                 continue;
             }
         }
-        new_neighbor.active = 1; 
-        new_neighbor.last_active = time(NULL); 
 
-        neighbors[neighbor_count++] = new_neighbor;
-        server_print("added neighbor: %s:%d\n", neighbor_ip, neighbor_port);
+        if (engine_add_neighbor(&engine, &addr) == NULL) {
+            exit(1);
+        }
+        if (self->index == 0) {
+            server_print("added neighbor: %s:%d\n", neighbor_ip, neighbor_port);
+        }
     }
 }
 /*
-    add a neighbor to a channel (after S2S join request)
+    send a message to a user or a neighbor, the engine's transport. the
+    socket doesn't block, so a full buffer fails the send; like a fan-out
+    destination, that datagram is counted and dropped
 */
-void add_neighbor_to_channel(char *channel_name, struct sockaddr_in *neighbor_addr) {
-    struct routing_table *rt = find_rt_entry(channel_name);
-
-    if (rt == NULL) {
-        rt = &routing_table[routing_table_count++];
-        strncpy(rt->channel_name, channel_name, CHANNEL_MAX);
-        rt->neighbor_count = 0;
-    }
-
-    // check if neighbor already exists in channel's neighbor list
-    for (int i = 0; i < rt->neighbor_count; i++) {
-        if (rt->subscribed_neighbors[i]->addr.sin_addr.s_addr == neighbor_addr->sin_addr.s_addr &&
-            rt->subscribed_neighbors[i]->addr.sin_port == neighbor_addr->sin_port) {
-            rt->subscribed_neighbors[i]->last_active = time(NULL);
-            rt->subscribed_neighbors[i]->active = 1;
-            //printf("neighbor already exists in channel neighbor list\n");
+void send_d(void *ctx, const void *txt, size_t txt_size, const struct sockaddr_in *client_addr) {
+    (void)ctx;
+    while (sendto(sockfd, txt, txt_size, 0, (struct sockaddr *)client_addr, sizeof(struct sockaddr_in)) < 0) {
+        if (errno != EINTR) {
+            perror("send");
+            fanout.errors++;
             return;
         }
     }
-
-    // check if neighbor already exists in neighbors[]
-    struct neighbor *nbr = NULL;
-    for (int i = 0; i < neighbor_count; i++) {
-        if (neighbors[i].addr.sin_addr.s_addr == neighbor_addr->sin_addr.s_addr &&
-            neighbors[i].addr.sin_port == neighbor_addr->sin_port) {
-            nbr = &neighbors[i];
-            break;
-        }
-    }
-
-    // if neighbor not found in neighbors[], add it
-    if (nbr == NULL) {
-        nbr = &neighbors[neighbor_count++];
-        nbr->addr = *neighbor_addr;
-        nbr->active = 1;
-        nbr->last_active = time(NULL);
-    }
-
-    // add to rt
-    rt->subscribed_neighbors[rt->neighbor_count++] = nbr;
-    server_print("Added neighbor %s:%d to channel %s.\n",
-    inet_ntoa(neighbor_addr->sin_addr), ntohs(neighbor_addr->sin_port), channel_name);
 }
-
 /*
-    remove neighbor from a channel's routing table (after leave request)
+    send one payload to many destinations, as few syscalls as the fan-out allows
 */
-void remove_neighbor_from_channel(char *channel_name, struct sockaddr_in *neighbor_addr){
-    for (int i = 0; i < routing_table_count; i++) {
-        // need to check if channel exists, so loop through all channels and check
-        if (strncmp(routing_table[i].channel_name, channel_name, CHANNEL_MAX) == 0) {
-            struct routing_table *rt = &routing_table[i];
-            for (int j = 0; j < rt->neighbor_count; j++) {
-                if (memcmp(&rt->subscribed_neighbors[j]->addr, neighbor_addr, sizeof(struct sockaddr_in)) == 0) {
-                    // shift other neighbors down and remove neighbor from rt
-                    for (int k = j; k < rt->neighbor_count - 1; k++) {
-                        rt->subscribed_neighbors[k] = rt->subscribed_neighbors[k + 1];
-                    }
-                    rt->neighbor_count--;
-                    server_print("removed neighbor %s:%d from channel %s\n", inet_ntoa(neighbor_addr->sin_addr), ntohs(neighbor_addr->sin_port), channel_name);
-                    return;
-                }
-            }
-        }
-    }
+void send_many(void *ctx, const void *txt, size_t txt_size, const struct sockaddr_in *addrs, uint32_t n) {
+    (void)ctx;
+    udp_fanout_begin(&fanout, txt, txt_size);
+    udp_fanout_add_many(&fanout, addrs, n);
+    udp_fanout_flush(&fanout);
 }
+
 /*
-    S2S implementation of join, share all joins with neighbors
+    add a newly local channel to the directory LIST reads
 */
-void s2s_join(char *channel_name) {
-    struct routing_table *rt = find_rt_entry(channel_name);
-
-    // create new routing table entry (if it doesn't exist)
-    if (rt == NULL) {
-        rt = &routing_table[routing_table_count++];
-        strncpy(rt->channel_name, channel_name, CHANNEL_MAX);
-        rt->neighbor_count = 0;
-    }
-
-    struct s2s_join join_msg;
-    join_msg.req_type = S2S_JOIN;
-    strncpy(join_msg.req_channel, channel_name, CHANNEL_MAX);
-
-    for (int i = 0; i < neighbor_count; i++) {
-        struct neighbor *nbr = &neighbors[i];
-
-        int already_neighbor = 0;
-        for (int j = 0; j < rt->neighbor_count; j++) {
-            if (rt->subscribed_neighbors[j] == nbr) {
-                already_neighbor = 1;
-                break;
+void publish_channel(void *ctx, const char *channel_name) {
+    (void)ctx;
+    pthread_mutex_lock(&directory_lock);
+    if (namemap_get(&directory_index, channel_name) == NULL) {
+        struct directory_entry *e = arena_alloc(&directory_arena, sizeof(struct directory_entry));
+        if (e == NULL) {
+            perror("arena_alloc");
+        } else {
+            strncpy(e->name, channel_name, CHANNEL_MAX);
+            e->pos = directory.count;
+            if (namemap_put(&directory_index, e->name, e) < 0) {
+                perror("namemap_put");
+                arena_release(&directory_arena, e, sizeof(struct directory_entry));
+            } else if (pvec_push(&directory, &directory_arena, e) < 0) {
+                perror("pvec_push");
+                namemap_del(&directory_index, e->name);
+                arena_release(&directory_arena, e, sizeof(struct directory_entry));
+            } else {
+                __atomic_store_n(&directory_stale, 1, __ATOMIC_RELEASE);
             }
         }
-
-        if (!already_neighbor) {
-            rt->subscribed_neighbors[rt->neighbor_count++] = nbr;
-        }
-
-        send_d(&join_msg, sizeof(join_msg), &nbr->addr);
-
-        log_message(&server_addr, &nbr->addr, "send", "S2S Join", channel_name, NULL, NULL);
     }
+    pthread_mutex_unlock(&directory_lock);
 }
 /*
-    fairly similar to s2s join, however used to avoid redundant join messages
+    drop a channel that is no longer local from the directory
 */
-void fwd_s2s_join(char *channel_name, struct sockaddr_in *sender_addr) {
-    struct s2s_join join_msg;
-    join_msg.req_type = S2S_JOIN;
-    strncpy(join_msg.req_channel, channel_name, CHANNEL_MAX);
-
-    struct routing_table *rt = find_rt_entry(channel_name);
-    if (rt == NULL) {
-        rt = &routing_table[routing_table_count++];
-        strncpy(rt->channel_name, channel_name, CHANNEL_MAX);
-        rt->neighbor_count = 0;
-    }
-
-    // loop over neighbors and send joins
-    for (int i = 0; i < neighbor_count; i++) {
-        struct neighbor *nbr = &neighbors[i];
-
-        // skip sender
-        if (nbr->addr.sin_addr.s_addr == sender_addr->sin_addr.s_addr &&
-            nbr->addr.sin_port == sender_addr->sin_port) {
-            continue;
-        }
-
-        // add neighbor to rt if not present already
-        int already_neighbor = 0;
-        for (int j = 0; j < rt->neighbor_count; j++) {
-            if (rt->subscribed_neighbors[j] == nbr) {
-                already_neighbor = 1;
-                break;
-            }
-        }
-
-        if (!already_neighbor) {
-            rt->subscribed_neighbors[rt->neighbor_count++] = nbr;
-            server_print("Added neighbor %s:%d to channel %s.\n",
-                   inet_ntoa(nbr->addr.sin_addr), ntohs(nbr->addr.sin_port), channel_name);
+void withdraw_channel(void *ctx, const char *channel_name) {
+    (void)ctx;
+    pthread_mutex_lock(&directory_lock);
+    struct directory_entry *e = namemap_get(&directory_index, channel_name);
+    if (e != NULL) {
+        namemap_del(&directory_index, e->name);
+        pvec_del_at(&directory, &directory_arena, e->pos);
+        if (e->pos < directory.count) {
+            ((struct directory_entry *)pvec_at(&directory, e->pos))->pos = e->pos;
         }
-
-        send_d(&join_msg, sizeof(join_msg), &nbr->addr);
-
-        log_message(&server_addr, &nbr->addr, "send", "S2S Join", channel_name, NULL, NULL);
+        arena_release(&directory_arena, e, sizeof(struct directory_entry));
+        __atomic_store_n(&directory_stale, 1, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&directory_lock);
 }
-
-
 /*
-    S2S implementation of leave, share all leaves with neighbors
+    a TXT_LIST of every worker's channels, copied out of the current snapshot
 */
-void s2s_leave(char *channel_name) {
-    struct s2s_leave leave_msg;
-    leave_msg.req_type = S2S_LEAVE;
-    strncpy(leave_msg.req_channel, channel_name, CHANNEL_MAX);
-
-    struct routing_table *rt = find_rt_entry(channel_name);
-    if (rt) {
-        for (int i = 0; i < rt->neighbor_count; i++) {
-            struct neighbor *nbr = rt->subscribed_neighbors[i];
-            send_d(&leave_msg, sizeof(leave_msg), &nbr->addr);
-
-            log_message(&server_addr, &nbr->addr, "send", "S2S Leave", channel_name, NULL, NULL);
+struct text_list *list_directory(void *ctx, size_t *size) {
+    (void)ctx;
+    if (__atomic_load_n(&directory_stale, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&directory_lock);
+        if (directory_stale) {
+            publish_directory();
         }
+        pthread_mutex_unlock(&directory_lock);
+    }
+    epoch_enter(&epochs, self->index);
+    struct directory_snapshot *snap = __atomic_load_n(&directory_snap, __ATOMIC_ACQUIRE);
+    int local_count = snap->count;
+    *size = sizeof(struct text_list) + local_count * sizeof(struct channel_info);
+    struct text_list *txt = (struct text_list *)malloc(*size);
+    if (txt != NULL) {
+        txt->txt_type = TXT_LIST;
+        txt->txt_nchannels = local_count;
+        memcpy(txt->txt_channels, snap->names, (size_t)local_count * CHANNEL_MAX);
     } else {
-        server_print("no active neighbors for channel %s to send leave.\n", channel_name);
+        perror("malloc");
     }
+    epoch_exit(&epochs, self->index);
+    return txt;
 }
-
 /*
-    send S2S say message with unique message id
+    swap in a snapshot of the directory as it is now. called with
+    directory_lock held. if there is no memory for it, LIST answers from
+    the previous one and the next LIST tries again
 */
-void s2s_say(char *username, char *channel_name, char *message, uint64_t unique_id) {
-    struct s2s_say say_msg;
-    say_msg.req_type = S2S_SAY;
-    say_msg.unique_id = unique_id;
-    strncpy(say_msg.req_username, username, USERNAME_MAX);
-    strncpy(say_msg.req_channel, channel_name, CHANNEL_MAX);
-    strncpy(say_msg.req_text, message, SAY_MAX);
-
-    for (int i = 0; i < neighbor_count; i++) {
-        send_d(&say_msg, sizeof(say_msg), &neighbors[i].addr);
-
-        log_message(&server_addr, &neighbors[i].addr, "send", "S2S Say",channel_name, username, message);
+void publish_directory() {
+    struct directory_snapshot *old = directory_snap;
+    struct directory_snapshot *snap = malloc(sizeof(struct directory_snapshot) + (size_t)directory.count * CHANNEL_MAX);
+    if (snap == NULL) {
+        perror("malloc");
+        return;
     }
-}                     
-/*
-    send a message to a user
-*/
-void send_d(void *txt, size_t txt_size, struct sockaddr_in *client_addr) {
-    int err = sendto(sockfd, txt, txt_size, 0, (struct sockaddr *)client_addr, sizeof(struct sockaddr_in));
-    if (err < 0) {
-        perror("send");
-        exit(1);
+    snap->node.free = free_snapshot;
+    snap->version = old != NULL ? old->version + 1 : 1;
+    snap->count = directory.count;
+    for (uint32_t i = 0; i < directory.count; i++) {
+        struct directory_entry *e = pvec_at(&directory, i);
+        memcpy(snap->names[i], e->name, CHANNEL_MAX);
+    }
+    __atomic_store_n(&directory_snap, snap, __ATOMIC_RELEASE);
+    __atomic_store_n(&directory_stale, 0, __ATOMIC_RELEASE);
+    if (old != NULL) {
+        epoch_retire(&epochs, self->index, &old->node);
     }
 }
-
 /*
-    login a user and add to user list
+    the epochs decided nobody can still be reading this snapshot
 */
-void login(char *username, struct sockaddr_in *client_addr) {
-    
-    // user must have a unique name, check if user already exists
-    struct user *existing_user = find_user(client_addr);
-    if (existing_user != NULL) {
-        server_print("user %s already logged in.\n", existing_user->username);
-        return;
-    }
-
-    // create new user
-    struct user *new_user = (struct user *)malloc(sizeof(struct user));
-    if (new_user == NULL) {
-        perror("malloc");
-    return;
+void free_snapshot(struct epoch_node *n) {
+    free(n);
 }
-    //force null termination
-    strncpy(new_user->username, username, USERNAME_MAX - 1);
-    new_user->username[USERNAME_MAX - 1] = '\0';
-    new_user->addr = *client_addr;
-    users[user_count++] = new_user;
 
-    server_print("user %s logged in.\n", username);
+/*
+    the worker that owns a channel, the engine shard it is in
+*/
+int channel_owner(const char *channel_name) {
+    return engine_channel_hash(channel_name) % nworkers;
 }
-
 /*
-    logout user and remove from user list/channels
+    the worker that should handle a datagram, or -1 if every worker should.
+    anything malformed stays where it is, engine_handle() rejects it there
 */
-void logout(struct sockaddr_in *client_addr) {
-
-    // find user
-    struct user *u = find_user(client_addr);
-
-    if (u == NULL) {
-        server_print("unknown user trying to logout.\n");
-        return;
+int packet_owner(char *buffer, int len) {
+    if (nworkers == 1 || len < (int)sizeof(struct request)) {
+        return self->index;
     }
-
-    char username[USERNAME_MAX];
-    strcpy(username, u->username);
-    
-    // remove from all channels (we don't discriminate)
-    for (int i = 0; i < channel_count; i++) {
-        leave_channel(channels[i].name,client_addr);
-    }
-
-    // remove from user list
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i]->username, username) == 0) {
-            free(users[i]);
-            users[i] = users[--user_count]; 
-            users[user_count] = NULL; 
+    struct request *req = (struct request *)buffer;
+    struct s2s_digest *digest = (struct s2s_digest *)buffer;
+    struct s2s_subscribed *list = (struct s2s_subscribed *)buffer;
+    size_t offset;
+    switch (req->req_type) {
+        case REQ_LOGIN:
+            // every worker keeps the user list, so they all learn of logins
+            return len < (int)sizeof(struct request_login) ? self->index : -1;
+        case REQ_LOGOUT:
+        case S2S_HELLO:
+            // every worker keeps the spanning tree as well
+            return -1;
+        case S2S_JOIN_BULK:
+            // about channels spread over the workers, each takes its own
+            return -1;
+        case S2S_DIGEST:
+            // addressed to one of our shards, and a list to the shard its digest came from
+            if (len < (int)sizeof(*digest) || digest->nslots != nworkers || digest->slot >= nworkers) {
+                return self->index;
+            }
+            return digest->slot;
+        case S2S_SUBSCRIBED:
+            if (len < (int)sizeof(*list) || list->nshards != nworkers || list->shard >= nworkers) {
+                return self->index;
+            }
+            return list->shard;
+        case REQ_JOIN:
+        case REQ_LEAVE:
+        case REQ_SAY:
+        case REQ_WHO:
+        case S2S_JOIN:
+        case S2S_LEAVE:
+            offset = offsetof(struct request_join, req_channel); // same spot in all of these
             break;
-        }
+        case S2S_SAY:
+            offset = offsetof(struct s2s_say, req_channel);
+            break;
+        default:
+            return self->index;
     }
-
-    server_print("user %s logged out.\n", username);
+    if (len < (int)(offset + CHANNEL_MAX)) {
+        return self->index;
+    }
+    return channel_owner(buffer + offset);
 }
-
 /*
-    add user to channel/create channel
+    handle a datagram here or pass it to the worker(s) it belongs to. a
+    sender always lands on the same socket, and each pair of workers has its
+    own inbox, so a client's requests reach the owner in the order they were sent
 */
-void join_channel(char *channel_name, struct sockaddr_in *client_addr) {
-    
-    // find user
-    struct user *u = find_user(client_addr);
-    if (u == NULL) {
-        server_print("user not found for join request.\n");
+void dispatch_packet(char *buffer, int len, struct sockaddr_in *client_addr) {
+    int owner = packet_owner(buffer, len);
+    if (owner == self->index) {
+        handle_timed(buffer, len, client_addr);
         return;
     }
-
-    struct channel *ch = find_channel(channel_name);
-    if (ch == NULL) { // if channel doesn't exist, create it
-        struct channel new_channel;
-        strncpy(new_channel.name, channel_name, CHANNEL_MAX - 1); // safe copy with null termination
-        new_channel.name[CHANNEL_MAX - 1] = '\0';
-        new_channel.user_count = 0;
-        channels[channel_count++] = new_channel;
-        ch = &channels[channel_count - 1];
-
-        server_print("new channel %s created.\n", channel_name);
+    request_t type = ((struct request *)buffer)->req_type;
+    int lossless = owner < 0 && (type == REQ_LOGIN || type == REQ_LOGOUT);
+    for (int i = 0; i < nworkers; i++) {
+        if (i == self->index || (owner >= 0 && i != owner)) {
+            continue;
+        }
+        if (lossless) {
+            wait_for_room(i);
+        }
+        if (handoff_push(&workers[i].inbox[self->index], client_addr, buffer, len) == 0) {
+            wake_mask |= 1ULL << i;
+        }
     }
-    s2s_join(channel_name);
-    if (!user_present(u, ch)) { // user cannot join channel that they already are subscribed to
-        ch->users[ch->user_count++] = u;
-        server_print("user %s joined channel %s.\n", u->username, ch->name);
-    } else {
-        server_print("user %s already in channel %s.\n", u->username, ch->name);
-        send_err("You have already joined this channel.", client_addr);
+    if (owner < 0) {
+        handle_timed(buffer, len, client_addr);
     }
 }
-
 /*
-    remove user from channel
+    wait until worker i's inbox from us has a free slot. logins and logouts
+    change every worker's copy of the user list, and unlike S2S soft state
+    nothing would repair a copy that missed one. keep our own inbox moving
+    meanwhile, since worker i may be waiting on room in it
 */
-void leave_channel(char *channel_name, struct sockaddr_in *client_addr) {
-    struct user *u = find_user(client_addr);
-    if (u == NULL) {
-        server_print("user not found for leave request.\n");
-        return;
-    }
-
-    struct channel *ch = find_channel(channel_name);
-    if (ch == NULL) {
-        server_print("channel %s not found.\n", channel_name);
-        return;
-    }
-
-    if (user_present(u, ch)) {
-        remove_user(u->username, ch);
-        server_print("user %s left channel %s.\n", u->username, ch->name);
-
-        // if channel is empty, S2S leave
-        if (ch->user_count == 0) {
-            s2s_leave(channel_name);
+void wait_for_room(int i) {
+    struct handoff_ring *r = &workers[i].inbox[self->index];
+    while (!handoff_room(r)) {
+        uint64_t one = 1;
+        if (write(workers[i].wake_fd, &one, sizeof(one)) < 0) {
+            perror("write");
         }
-    } else {
-        server_print("user %s not in channel %s.\n", u->username, ch->name);
+        drain_inbox();
+        sched_yield();
     }
 }
-
 /*
-    server-side handling of say request
+    signal every worker that was handed something since the last call, once
+    per receive batch rather than once per datagram
 */
-void say(char *channel_name, char *message, struct sockaddr_in *client_addr) {
-    struct user *u = find_user(client_addr);
-    if (u == NULL) {
-        server_print("user not found for say request.\n");
-        return;
-    }
-
-    struct channel *ch = find_channel(channel_name);
-    if (ch == NULL) {
-        server_print("channel %s not found.\n", channel_name);
-        return;
-    }
-
-    if (!user_present(u, ch)) {
-        server_print("user %s is not in channel %s.\n", u->username, ch->name);
-        return;
+void wake_workers() {
+    while (wake_mask != 0) {
+        int i = __builtin_ctzll(wake_mask);
+        wake_mask &= wake_mask - 1;
+        uint64_t one = 1;
+        if (write(workers[i].wake_fd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
     }
-
-    // construct say struct and broadcast to all users in the channel
-    struct text_say txt_say;
-    txt_say.txt_type = TXT_SAY;
-    strncpy(txt_say.txt_channel, channel_name, CHANNEL_MAX);
-    strncpy(txt_say.txt_username, u->username, USERNAME_MAX);
-    strncpy(txt_say.txt_text, message, SAY_MAX);
-
-    server_print("%s sends say message in %s.\n", u->username, txt_say.txt_channel);
-    broadcast(&txt_say, ch);
-
-    // generate unique message ID and broadcast the S2S say to the neighbors
-    uint64_t u_id = generate_unique_id();
-
-    s2s_say(u->username, channel_name, message, u_id);
 }
-
 /*
-    list all channels that exist
+    handle everything other workers passed to us
 */
-void list_channels(struct sockaddr_in *client_addr) {
-
-    struct user *u = find_user(client_addr);
-    if (u == NULL) {
-        server_print("user not found for list request.\n");
-        return;
+void drain_inbox() {
+    uint64_t n;
+    // reset the eventfd first, so anything pushed after this wakes us again
+    if (read(self->wake_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("read");
     }
-
-    // prepare to send list of channels
-    int size = sizeof(struct text_list) + channel_count * sizeof(struct channel_info);
-    struct text_list *txt = (struct text_list *)malloc(size);
-    txt->txt_type = TXT_LIST;
-    txt->txt_nchannels = channel_count;
-
-    for (int i = 0; i < channel_count; i++) {
-        strncpy(txt->txt_channels[i].ch_channel, channels[i].name, CHANNEL_MAX);
+    for (int i = 0; i < nworkers; i++) {
+        if (i == self->index) {
+            continue;
+        }
+        struct handoff_msg *m;
+        while ((m = handoff_peek(&self->inbox[i])) != NULL) {
+            handle_timed(m->buf, m->len, &m->addr);
+            handoff_pop(&self->inbox[i]);
+        }
     }
-
-    server_print("%s requests channel list.\n", u->username);
-    send_d(txt, size, client_addr);
-    free(txt);
 }
 
 /*
-    send list of users in specified channel back to user
+    set up the calling thread's copy of the server state
 */
-void who(char *channel_name, struct sockaddr_in *client_addr) {
-    // check user validity
-    struct user *u = find_user(client_addr);
-    if (u == NULL) {
-        server_print("user not found for who request.\n");
-        return;
+void init_worker() {
+    dclog_thread(self->index);
+    sockfd = self->fd;
+    uint32_t origin = origin_base + self->index;
+    if (origin == 0) {
+        origin = nworkers; // 0 marks an empty dedup slot, and the others are taken
     }
-    
-    struct channel *ch = find_channel(channel_name);
-    
-    // check if channel exists
-    if (ch == NULL) {
-        server_print("channel %s not found.\n", channel_name);
-        return;
+    transport.ctx = NULL;
+    transport.send = send_d;
+    transport.send_many = send_many;
+    update_clock();
+    if (engine_init(&engine, &transport, &server_addr, origin, dedup_window, dedup_expiry, engine.clock_us) < 0) {
+        perror("engine_init");
+        exit(1);
+    }
+    if (nworkers > 1) {
+        engine.directory = &directory_ops; // alone, the engine lists its own channels
+    }
+    engine_shard(&engine, self->index, nworkers);
+    if (udp_batch_init(&rx_batch, batch_size) < 0) {
+        perror("udp_batch_init");
+        exit(1);
+    }
+    if (udp_fanout_init(&fanout, sockfd) < 0) {
+        perror("udp_fanout_init");
+        exit(1);
+    }
+    if (capture_fd >= 0 && capture_writer_init(&capture, capture_fd) < 0) {
+        perror("capture_writer_init");
+        exit(1);
     }
 
-    // create who struct
-    struct text_who txt_who;
-    txt_who.txt_type = TXT_WHO;
-    txt_who.txt_nusernames = ch->user_count;
-    strncpy(txt_who.txt_channel, channel_name, CHANNEL_MAX);
+    wheel_timer_init(&stats_timer, stats_expired, NULL);
+    wheel_add(&engine.timers, &stats_timer, engine_tick(engine.clock_ms + STATS_INTERVAL * 1000));
 
-    // determine size of list and fill in params
-    int size = sizeof(struct text_who) + ch->user_count * sizeof(struct user_info);
-    struct text_who *txt = (struct text_who *)malloc(size);
-    txt->txt_type = TXT_WHO;
-    txt->txt_nusernames = ch->user_count;
-    strncpy(txt->txt_channel, channel_name, CHANNEL_MAX);
+    // add neighbors to this worker's array
+    init_neighbors(neighbor_argc, neighbor_argv);
 
-    // iterate through struct array and add usernames
-    for (int i = 0; i < ch->user_count; i++) {
-        strncpy(txt->txt_users[i].us_username, ch->users[i]->username, USERNAME_MAX);
+    // worker 0 speaks for the server in the tree, from the start
+    if (self->index != 0) {
+        engine_follow(&engine, engine.id, 0, 0);
     }
 
-    server_print("Sending who response to %s.\n", u->username);
-    send_d(txt, size, client_addr);
-    free(txt);
-}
-
-/*
-    find user according to address & port
-*/
-struct user* find_user(struct sockaddr_in *client_addr) {
-    for (int i = 0; i < user_count; i++) {
-        // checking two params: IP address & port. since we need to differentiate between clients from the same IP
-        if (memcmp(&users[i]->addr.sin_addr, &client_addr->sin_addr, sizeof(struct in_addr)) == 0 &&
-            users[i]->addr.sin_port == client_addr->sin_port) {
-            return users[i];
-        }
+    // the reactor. the timerfd is periodic; the wheel catches up on however
+    // many ticks went by, so a late wakeup never loses a timeout
+    self->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (self->timer_fd < 0) {
+        perror("timerfd_create");
+        exit(1);
     }
-    return NULL;
-}
-/*
-    find specified channel in channel list
-*/
-struct channel* find_channel(char *channel_name) {
-    for (int i = 0; i < channel_count; i++) {
-        if (strcmp(channels[i].name, channel_name) == 0) {
-            return &channels[i]; // channel found and returning
+    struct itimerspec its;
+    its.it_interval.tv_sec = ENGINE_TICK_MS / 1000;
+    its.it_interval.tv_nsec = (ENGINE_TICK_MS % 1000) * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(self->timer_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+        exit(1);
+    }
+    self->epoll_fd = epoll_create1(0);
+    if (self->epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    int fds[3] = { self->fd, self->timer_fd, self->wake_fd };
+    for (int i = 0; i < (nworkers > 1 ? 3 : 2); i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fds[i];
+        if (epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
         }
     }
-    return NULL;
 }
-
 /*
-    check if user present in channel
+    a worker's reactor: its socket, its inbox and its timers, all on one epoll set
 */
-int user_present(struct user *u, struct channel *ch) {
-    for (int i = 0; i < ch->user_count; i++) {
-        if (strcmp(ch->users[i]->username, u->username) == 0) {
-            return 1; // user present
-        }
+void *worker_main(void *arg) {
+    self = (struct worker *)arg;
+    if (self->index != 0) {
+        init_worker(); // worker 0 is set up before the others start
     }
-    return 0;
-}
-
-/* 
-    remove user from channel/delete channel if user count is 0
-*/
-void remove_user(char *username, struct channel *ch) {
-    for (int i = 0; i < ch->user_count; i++) {
-        if (strcmp(ch->users[i]->username, username) == 0) {
-            // move last user to current position and decrement user count
-            ch->users[i] = ch->users[ch->user_count - 1];
-            ch->users[ch->user_count - 1] = NULL;
-            ch->user_count--;
 
-            // if no users, delete channel (except Common)
-            if (ch->user_count == 0 && strncmp(ch->name, "Common", CHANNEL_MAX) != 0) {
-                delete_channel(ch);
+    while (1) {
+        struct epoll_event events[3];
+        int n = epoll_wait(self->epoll_fd, events, 3, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
             }
-            return;
+            continue;
         }
-    }
-}
+        update_clock();
+
+        for (int e = 0; e < n; e++) {
+            int fd = events[e].data.fd;
+            if (fd == self->wake_fd) {
+                drain_inbox();
+            } else if (fd == self->timer_fd) {
+                uint64_t expirations;
+                if (read(self->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    perror("read");
+                }
+                engine_advance(&engine);
+                share_tree();
+                epoch_poll(&epochs, self->index); // frees snapshots we replaced
+                metrics_publish(&metrics_page->workers[self->index], &engine.counters);
+                if (capture_fd >= 0) {
+                    capture_flush(&capture);
+                }
+            } else if (fd == self->fd) {
+                int count = udp_recv_batch(sockfd, &rx_batch);
+                if (count < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        perror("recvmmsg");
+                    }
+                    count = 0;
+                }
 
-/*
-    delete channel and decrement chanel count
-*/
-void delete_channel(struct channel *ch){
-    server_print("deleting channel %s\n", ch->name);
-    for (int i = 0; i < channel_count; i++){
-        if (&channels[i] == ch){
-            for (int j = i; j < channel_count - 1; j++) {
-                channels[j] = channels[j + 1];
-            }
+                // record the batch as it arrived, before anything looks at it
+                if (capture_fd >= 0 && count > 0) {
+                    uint64_t now = capture_clock();
+                    for (int i = 0; i < count; i++) {
+                        capture_add(&capture, now, &rx_batch.addrs[i], udp_batch_buf(&rx_batch, i), udp_batch_len(&rx_batch, i));
+                    }
+                }
 
-            channel_count--;
-            server_print("channel %s deleted.\n", ch->name);
-            break;
+                // dispatch the whole batch before going back to the kernel
+                for (int i = 0; i < count; i++) {
+                    dispatch_packet(udp_batch_buf(&rx_batch, i), udp_batch_len(&rx_batch, i), &rx_batch.addrs[i]);
+                }
+                wake_workers();
+            }
         }
     }
-
+    return NULL;
 }
 
 /*
-    broadcast message to all users in channel
+    engine_handle(), timed into the handling time histogram. one clock read
+    per datagram: it starts from the wakeup's reading or the end of the one
+    before, so it also counts the dispatching since then
 */
-void broadcast(struct text_say *txt_say, struct channel *ch) {
-    for (int i = 0; i < ch->user_count; i++) {
-        send_d(txt_say, sizeof(struct text_say), &ch->users[i]->addr);
-    }
-}
+void handle_timed(char *buffer, int len, struct sockaddr_in *client_addr) {
+    uint64_t start = clock_ns;
+    engine_handle(&engine, buffer, len, client_addr);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    clock_ns = (uint64_t)end.tv_sec * 1000000000 + end.tv_nsec;
 
-/*
-    check input text for size restrictions or a lack of a null terminator
-*/
-int validate_str(const char *str, size_t max_len){
-    if (strnlen(str, max_len) >= max_len) {
-        return 0; // too long or not null-terminated
-    }
-    return 1; // valid
+    uint64_t ns = clock_ns - start;
+    engine.counters.handled++;
+    engine.counters.handle_ns += ns;
+    metrics_record(engine.counters.handle_hist, ns);
 }
-/*
-    check size of incoming packet to make sure that it's not too short
-*/
-int validate_pac(int rcv_len, int correct_len){
-    if (rcv_len < correct_len){
-        server_print("malformed packet detected and dropped.\n");
-        return 0;
+int main(int argc, char *argv[]) {
+    char *prog = argv[0];
+    int opt;
+    // '+' stops at the first positional argument, neighbor ports are not options
+    while ((opt = getopt(argc, argv, "+b:c:l:n:p:t:w:")) != -1) {
+        switch (opt) {
+            case 'b':
+                batch_size = atol(optarg);
+                break;
+            case 'c':
+                if (dclog_parse_categories(optarg, &log_categories) < 0) {
+                    argc = 0; // print usage
+                }
+                break;
+            case 'l':
+                log_level = atoi(optarg);
+                break;
+            case 'n':
+                dedup_window = atol(optarg);
+                break;
+            case 'p':
+                capture_path = optarg;
+                break;
+            case 't':
+                nworkers = atoi(optarg);
+                break;
+            case 'w':
+                dedup_expiry = atol(optarg);
+                break;
+            default:
+                argc = 0; // print usage
+                break;
+        }
     }
-    return 1; // valid
-}
-
-/*
-    send an error to the client
-*/
-void send_err(char *err, struct sockaddr_in *client_addr){
-    /* NOTE: don't think this is needed since there can be an error logging in and the user won't be created
-    struct user *u = find_user(client_addr);
-    if (u == NULL) {
-        printf("user not found for err request.\n");
-        return;
+    // drop the options so argv[1] is the server IP again
+    argc -= optind - 1;
+    argv += optind - 1;
+    if (argc < 3 || dedup_window <= 0 || dedup_window > (1L << 30) || dedup_expiry < 0 ||
+        batch_size <= 0 || batch_size > 1024 || nworkers <= 0 || nworkers > MAX_WORKERS ||
+        log_level < DCLOG_ERROR || log_level > DCLOG_DEBUG) {
+        printf("Usage: %s [-b <rx batch>] [-c <log categories>] [-l <log level>] [-n <dedup window>] [-p <capture file>] [-t <worker threads>] [-w <dedup expiry seconds>] <server IP> <port> [<neighbor IP> <neighbor port>]...\n", prog);
+        printf("  log categories: comma separated from server, s2s, stats, all (default all)\n");
+        printf("  log level: 0 errors, 1 info, 2 debug incl. every S2S message (default 2); SIGUSR1/SIGUSR2 raise/lower it\n");
+        printf("  capture file: every datagram received is recorded there for duckreplay\n");
+        exit(1);
     }
-    */
-    int size = sizeof(struct text_error) + strlen(err);
-    struct text_error *txt_err = (struct text_error *)malloc(size);
-    txt_err->txt_type = TXT_ERROR;
-    strncpy(txt_err->txt_error, err, SAY_MAX);
+    neighbor_argc = argc;
+    neighbor_argv = argv;
 
-    send_d(txt_err, sizeof(struct text_error), client_addr);
-    free(txt_err);
-}
+    init_random();
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        printf("Usage: %s <server IP> <port> [<neighbor IP> <neighbor port>]...\n", argv[0]);
+    // logging goes through one ring per worker and a thread that writes it out
+    if (dclog_init(nworkers, LOG_RING, stdout) < 0) {
+        perror("dclog_init");
         exit(1);
     }
+    dclog_set_level(log_level);
+    dclog_set_categories(log_categories);
+    if (dclog_start() < 0) {
+        perror("dclog_start");
+        exit(1);
+    }
+    signal(SIGUSR1, log_verbosity);
+    signal(SIGUSR2, log_verbosity);
 
-    init_random();
-    start_time = time(NULL);
+    namemap_init(&directory_index, CHANNEL_MAX);
+    arena_init(&directory_arena);
+    pvec_init(&directory);
+    epoch_init(&epochs, nworkers);
+    publish_directory(); // an empty one, so readers always find a snapshot
+    if (directory_snap == NULL) {
+        exit(1);
+    }
 
     char *server_ip = argv[1];
     int port = atoi(argv[2]);
 
-    // setup UDP sock
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("socket");
-        exit(1);
-    }
-
     // setup addr
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -940,240 +889,90 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // bind socket to addr
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
-        exit(1);
+    // counters for duckstat. without the shared page they still have
+    // somewhere to go, just nobody to read them
+    metrics_page = metrics_create(port, nworkers);
+    if (metrics_page == NULL) {
+        perror("metrics_create");
+        metrics_page = calloc(1, sizeof(struct metrics_page) + nworkers * sizeof(struct metrics_block));
+        if (metrics_page == NULL) {
+            perror("calloc");
+            exit(1);
+        }
     }
-    // add neighbors to global array
-    init_neighbors(argc, argv);
-
-    // setup our soft-state thread
-    pthread_t timer_thread_id;
-    pthread_create(&timer_thread_id, NULL, timer_thread, NULL);
 
-    printf("DuckChat is listening on ip:port: %s:%d...\n", server_ip, port);
+    if (capture_path != NULL) {
+        capture_fd = capture_open(capture_path);
+        if (capture_fd < 0) {
+            perror(capture_path);
+            exit(1);
+        }
+    }
 
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-        char buffer[1024];
-        int len = recvfrom(sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&client_addr, &addr_len);
-        if (len < 0) {
-            perror("recvfrom");
-            continue;
+    // one UDP socket per worker, all bound to the same port. the kernel
+    // spreads senders across them by address
+    workers = calloc(nworkers, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+        w->index = i;
+        w->fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (w->fd < 0) {
+            perror("socket");
+            exit(1);
         }
-        
-        struct request *req = (struct request *)buffer;
-    
-        // update neighbor's last_active time
-        for (int i = 0; i < neighbor_count; i++) {
-            if (memcmp(&neighbors[i].addr, &client_addr, sizeof(struct sockaddr_in)) == 0) {
-                neighbors[i].last_active = time(NULL);
-                break;
-            }
+        int on = 1;
+        if (nworkers > 1 && setsockopt(w->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            perror("setsockopt");
+            exit(1);
+        }
+        // epoll says when to read, a spurious wakeup must not block the worker
+        if (fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            exit(1);
         }
 
-        switch (req->req_type) {
-            case REQ_LOGIN: {
-                if (!validate_pac(len, sizeof(struct request_login))) {
-                    send_err("LOGIN: packet length too long", &client_addr);
-                    break; // validate length of packet
-                }
-                struct request_login *req_login = (struct request_login *)buffer;
-                if (!validate_str(req_login->req_username, USERNAME_MAX)){
-                    send_err("LOGIN: username length too long", &client_addr);
-                    break; // validate length of user
-                }
-                login(req_login->req_username, &client_addr);
-                break;
-            }
-            case REQ_LOGOUT: {
-                if (!validate_pac(len, sizeof(struct request_logout))) {
-                    send_err("LOGOUT: packet length too long", &client_addr);
-                    break; // validate length of packet
-                }
-                logout(&client_addr);
-                break;
-            }
-            case REQ_JOIN: {
-                if (!validate_pac(len, sizeof(struct request_join))) {
-                    send_err("JOIN: packet length too long", &client_addr);
-                    break; // validate length of packet
-                }
-                struct request_join *req_join = (struct request_join *)buffer;
-                if (!validate_str(req_join->req_channel, CHANNEL_MAX)){
-                    send_err("JOIN: channel length too long", &client_addr);
-                    break; // validate length of channel
-                }
-                join_channel(req_join->req_channel, &client_addr);
-                break;
-            }
-            case REQ_LEAVE: {
-                if (!validate_pac(len, sizeof(struct request_leave))) {
-                    send_err("LEAVE: packet length too long", &client_addr);
-                    break; // validate length of packet
-                }
-                struct request_leave *req_leave = (struct request_leave *)buffer;
-                if (!validate_str(req_leave->req_channel, USERNAME_MAX)){
-                    send_err("JOIN: channel length too long", &client_addr);
-                    break; // validate length of channel
-                }
-                leave_channel(req_leave->req_channel, &client_addr);
-                break;
-            }
-            case REQ_SAY: {
-                if (!validate_pac(len, sizeof(struct request_say))) {
-                    send_err("SAY: packet length too long", &client_addr);
-                    break; // validate length of packet
-                }
-                struct request_say *req_say = (struct request_say *)buffer;
-                if (!validate_str(req_say->req_text, SAY_MAX)){
-                    send_err("SAY: message length too long", &client_addr);
-                    break; // validate length of message
-                }
-                say(req_say->req_channel, req_say->req_text, &client_addr);
-                break;
-            }
-            case REQ_LIST: {
-                if (!validate_pac(len, sizeof(struct request_list))) {
-                    send_err("LIST: packet length too long\n", &client_addr);
-                    break; // validate length of packet
-                }
-                list_channels(&client_addr);
-                break;
-            }
-            case REQ_WHO: {
-                if (!validate_pac(len, sizeof(struct request_who))) {
-                    send_err("WHO: packet length too long", &client_addr);
-                    break; // validate length of packet
-                }
-                struct request_who *req_who = (struct request_who *)buffer;
-                if (!validate_str(req_who->req_channel, CHANNEL_MAX)){
-                    send_err("WHO: channel length too long", &client_addr);
-                    break; // validate length of message
-                }
-                who(req_who->req_channel, &client_addr);
-                break;
-            }
-            case S2S_JOIN: {
-                struct s2s_join *join_msg = (struct s2s_join *)buffer;
-                
-                log_message(&server_addr, &client_addr, "recv", "S2S Join", join_msg->req_channel, NULL, NULL);
-                
-                // check if already subscribed to channel
-                struct routing_table *rt = find_rt_entry(join_msg->req_channel);
-                int already_subscribed = (rt != NULL);
-
-                
-                add_neighbor_to_channel(join_msg->req_channel, &client_addr);
-
-                // fwd join to other neighbors if not already subscribed
-                if (!already_subscribed) {
-                    fwd_s2s_join(join_msg->req_channel, &client_addr);
-                }
-                break;
-            }
-            case S2S_LEAVE: {
-                struct s2s_leave *leave_msg = (struct s2s_leave *)buffer;
-                
-                log_message(&server_addr, &client_addr, "recv", "S2S Leave", leave_msg->req_channel, NULL, NULL);
-
-
-                remove_neighbor_from_channel(leave_msg->req_channel, &client_addr);
-
-                // IF routing table exists for said channel AND there is only one neighbor AND that neighbor is the sender THEN leave
-                struct routing_table *rt = find_rt_entry(leave_msg->req_channel);
-                if (rt && rt->neighbor_count == 1 &&
-                memcmp(&rt->subscribed_neighbors[0]->addr, &client_addr, sizeof(struct sockaddr_in)) == 0) {
-
-                    // before leaving, we need to check if there are any local users in the channel. if not, we can leave
-                    struct channel *ch = find_channel(leave_msg->req_channel);
-                    if (ch && ch->user_count == 0) {
-                        s2s_leave(leave_msg->req_channel);
-                    }
-                }
-                break;
-            }
-            case S2S_SAY: {
-                struct s2s_say *say_msg = (struct s2s_say *)buffer;
-
-                log_message(&server_addr, &client_addr, "recv", "S2S Say", say_msg->req_channel, say_msg->req_username, say_msg->req_text);
-
-                // check for dups
-                if (isdup(say_msg->unique_id)) {
-                    server_print("Duplicate message detected. Responding with S2S Leave.\n");
-                    struct s2s_leave leave_msg;
-                    leave_msg.req_type = S2S_LEAVE;
-                    strncpy(leave_msg.req_channel, say_msg->req_channel, CHANNEL_MAX);
-
-                    send_d(&leave_msg, sizeof(leave_msg), &client_addr);
-
-                    log_message(&server_addr, &client_addr, "send", "S2S Leave", say_msg->req_channel, NULL, NULL);
-                    break;
-                }
-
-                // broadcast message to local users if any
-                struct channel *ch = find_channel(say_msg->req_channel);
-                if (ch != NULL) {
-                    struct text_say txt_say;
-                    txt_say.txt_type = TXT_SAY;
-                    strncpy(txt_say.txt_channel, say_msg->req_channel, CHANNEL_MAX);
-                    strncpy(txt_say.txt_username, say_msg->req_username, USERNAME_MAX);
-                    strncpy(txt_say.txt_text, say_msg->req_text, SAY_MAX);
-                    broadcast(&txt_say, ch);
-                }
-
-                // fwd message to other neighbors except the sender
-                struct routing_table *rt = find_rt_entry(say_msg->req_channel);
-                if (rt != NULL) {
-                    int forwarded = 0;
-                    for (int i = 0; i < rt->neighbor_count; i++) {
-                        struct neighbor *nbr = rt->subscribed_neighbors[i];
-
-                        // skip sender
-                        if (nbr->addr.sin_addr.s_addr == client_addr.sin_addr.s_addr &&
-                            nbr->addr.sin_port == client_addr.sin_port) {
-                            continue;
-                        }
-
-                        send_d(say_msg, sizeof(*say_msg), &nbr->addr);
-                        log_message(&server_addr, &nbr->addr, "send", "S2S Say", say_msg->req_channel, say_msg->req_username, say_msg->req_text);
-                        forwarded = 1;
-                    }
-
-                    // If the message was not forwarded and there are no local users, send S2S Leave
-                    if (!forwarded && (ch == NULL || ch->user_count == 0)) {
-                        struct s2s_leave leave_msg;
-                        leave_msg.req_type = S2S_LEAVE;
-                        strncpy(leave_msg.req_channel, say_msg->req_channel, CHANNEL_MAX);
-
-                        send_d(&leave_msg, sizeof(leave_msg), &client_addr);
-
-                        log_message(&server_addr, &client_addr, "send", "S2S Leave", say_msg->req_channel, NULL, NULL);
-
-                        remove_neighbor_from_channel(say_msg->req_channel, &client_addr);
-
-                        struct routing_table *rt = find_rt_entry(say_msg->req_channel);
-                        if (rt != NULL && rt->neighbor_count == 0) {
-                            if (ch == NULL || ch->user_count == 0) {
-                                // remove routing table entry for the channel
-                                delete_rt_entry(say_msg->req_channel);
-                                server_print("Removed internal records of channel %s.\n", say_msg->req_channel);
-                            }
-                        }
+        // bind socket to addr
+        if (bind(w->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            perror("bind");
+            exit(1);
+        }
 
-                    }
-                }
-                break;
+        w->wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (w->wake_fd < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+        w->inbox = calloc(nworkers, sizeof(struct handoff_ring));
+        if (w->inbox == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (int j = 0; j < nworkers; j++) {
+            if (j != i && handoff_init(&w->inbox[j], HANDOFF_SLOTS) < 0) {
+                perror("handoff_init");
+                exit(1);
             }
+        }
+    }
 
-            default: {
-                send_err("request type unknown.",&client_addr);
-                break;
-            }
+    // this thread is worker 0. setting it up first means bad neighbor
+    // arguments are reported once, before any other worker starts
+    self = &workers[0];
+    init_worker();
+    for (int i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
     }
-    close(sockfd);
+
+    printf("DuckChat is listening on ip:port: %s:%d with %d worker%s...\n",
+        server_ip, port, nworkers, nworkers == 1 ? "" : "s");
+
+    worker_main(&workers[0]);
     return 0;
 }
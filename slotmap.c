@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <string.h>
+#include "slotmap.h"
+/* See slotmap.h for usage information */
+
+/* precedes every record. gen is odd while the slot is live. */
+struct slot_hdr {
+    uint32_t gen;
+    uint32_t index;
+    uint32_t next_free; /* index + 1, only meaningful while free */
+    uint32_t pad;
+};
+
+static struct slot_hdr *slot(const struct slotmap *sm, uint32_t i) {
+    return (struct slot_hdr *)(sm->chunks[i / SLOTMAP_CHUNK] + (size_t)(i % SLOTMAP_CHUNK) * sm->stride);
+}
+
+static slot_handle_t make_handle(const struct slot_hdr *hdr) {
+    return ((slot_handle_t)hdr->gen << 32) | hdr->index;
+}
+
+void slotmap_init(struct slotmap *sm, size_t elem_size) {
+    sm->stride = (sizeof(struct slot_hdr) + elem_size + 15) & ~(size_t)15;
+    sm->chunks = NULL;
+    sm->nchunks = 0;
+    sm->used = 0;
+    sm->count = 0;
+    sm->free_head = 0;
+}
+
+void slotmap_free_all(struct slotmap *sm) {
+    for (uint32_t i = 0; i < sm->nchunks; i++) {
+        free(sm->chunks[i]);
+    }
+    free(sm->chunks);
+    slotmap_init(sm, sm->stride - sizeof(struct slot_hdr));
+}
+
+void *slotmap_alloc(struct slotmap *sm, slot_handle_t *h) {
+    struct slot_hdr *hdr;
+    if (sm->free_head != 0) {
+        hdr = slot(sm, sm->free_head - 1);
+        sm->free_head = hdr->next_free;
+    } else {
+        if (sm->used == sm->nchunks * SLOTMAP_CHUNK) {
+            char **chunks = realloc(sm->chunks, (sm->nchunks + 1) * sizeof(char *));
+            if (chunks == NULL) {
+                return NULL;
+            }
+            sm->chunks = chunks;
+            // calloc so every generation starts out even (free)
+            chunks[sm->nchunks] = calloc(SLOTMAP_CHUNK, sm->stride);
+            if (chunks[sm->nchunks] == NULL) {
+                return NULL;
+            }
+            sm->nchunks++;
+        }
+        hdr = slot(sm, sm->used);
+        hdr->index = sm->used++;
+    }
+
+    hdr->gen++;
+    sm->count++;
+    memset(hdr + 1, 0, sm->stride - sizeof(struct slot_hdr));
+    if (h != NULL) {
+        *h = make_handle(hdr);
+    }
+    return hdr + 1;
+}
+
+void slotmap_free(struct slotmap *sm, void *elem) {
+    struct slot_hdr *hdr = (struct slot_hdr *)elem - 1;
+    hdr->gen++;
+    hdr->next_free = sm->free_head;
+    sm->free_head = hdr->index + 1;
+    sm->count--;
+}
+
+void *slotmap_get(const struct slotmap *sm, slot_handle_t h) {
+    uint32_t i = (uint32_t)h;
+    uint32_t gen = (uint32_t)(h >> 32);
+    if (i >= sm->used || (gen & 1) == 0) {
+        return NULL;
+    }
+    struct slot_hdr *hdr = slot(sm, i);
+    return hdr->gen == gen ? hdr + 1 : NULL;
+}
+
+slot_handle_t slotmap_handle(const struct slotmap *sm, const void *elem) {
+    (void)sm;
+    return make_handle((const struct slot_hdr *)elem - 1);
+}
+
+void *slotmap_at(const struct slotmap *sm, uint32_t i) {
+    struct slot_hdr *hdr = slot(sm, i);
+    return (hdr->gen & 1) ? hdr + 1 : NULL;
+}
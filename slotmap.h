@@ -0,0 +1,39 @@
+#ifndef SLOTMAP_H
+#define SLOTMAP_H
+#include <stddef.h>
+#include <stdint.h>
+/* Fixed-size records in stable slots. Records are allocated from chunks
+* that never move, so a pointer stays valid for as long as its record
+* lives, and freeing one is O(1): its slot just goes on a free list.
+*
+* Anything that keeps a reference across calls that may delete records
+* should hold a handle instead of a pointer. A handle carries the slot's
+* generation, which changes every time the slot is freed, so a handle to
+* a deleted record resolves to NULL rather than to whatever reused the
+* slot. Handle 0 never refers to anything. */
+typedef uint64_t slot_handle_t;
+
+#define SLOTMAP_CHUNK 256 /* slots per chunk */
+
+struct slotmap {
+    size_t stride;     /* header + record, rounded up */
+    char **chunks;
+    uint32_t nchunks;
+    uint32_t used;     /* slots ever handed out; iteration bound */
+    uint32_t count;    /* live records */
+    uint32_t free_head; /* index + 1 of the first free slot, 0 = none */
+};
+
+void slotmap_init(struct slotmap *sm, size_t elem_size);
+void slotmap_free_all(struct slotmap *sm);
+/* Returns a zeroed record, or NULL if memory is exhausted. *h (if not
+* NULL) receives its handle. */
+void *slotmap_alloc(struct slotmap *sm, slot_handle_t *h);
+void slotmap_free(struct slotmap *sm, void *elem);
+/* Returns the record for h, or NULL if it has been freed */
+void *slotmap_get(const struct slotmap *sm, slot_handle_t h);
+slot_handle_t slotmap_handle(const struct slotmap *sm, const void *elem);
+/* For iteration: the record in slot i (i < sm->used), or NULL if free.
+* Freeing records while iterating is fine; nothing moves. */
+void *slotmap_at(const struct slotmap *sm, uint32_t i);
+#endif
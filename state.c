@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "state.h"
+/* See state.h for usage information */
+
+int state_init(struct server_state *st, long dedup_window, long dedup_expiry) {
+    addrmap_init(&st->user_index);
+    addrmap_init(&st->neighbor_index);
+    namemap_init(&st->channel_index, CHANNEL_MAX);
+    arena_init(&st->arena);
+    slotmap_init(&st->channels, sizeof(struct channel));
+    pvec_init(&st->users);
+    pvec_init(&st->neighbors);
+    st->plan_builds = 0;
+    return dedup_init(&st->recent_ids, dedup_window, dedup_expiry);
+}
+
+void state_free(struct server_state *st) {
+    for (uint32_t i = 0; i < st->users.count; i++) {
+        free(pvec_at(&st->users, i));
+    }
+    // memberships, spilled lists and plans all live in the arena
+    arena_free(&st->arena);
+    slotmap_free_all(&st->channels);
+    addrmap_free(&st->user_index);
+    addrmap_free(&st->neighbor_index);
+    namemap_free(&st->channel_index);
+    dedup_free(&st->recent_ids);
+    pvec_init(&st->users);
+    pvec_init(&st->neighbors);
+}
+
+/*
+    keyed on both IP address & port, since we need to differentiate between clients from the same IP
+*/
+struct user *state_find_user(struct server_state *st, const struct sockaddr_in *addr) {
+    return addrmap_get(&st->user_index, addr);
+}
+
+struct user *state_new_user(struct server_state *st, const char *username, const struct sockaddr_in *addr) {
+    struct user *u = (struct user *)malloc(sizeof(struct user));
+    if (u == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    //force null termination
+    strncpy(u->username, username, USERNAME_MAX - 1);
+    u->username[USERNAME_MAX - 1] = '\0';
+    u->addr = *addr;
+    pvec_init(&u->channels);
+    if (addrmap_put(&st->user_index, addr, u) < 0) {
+        perror("addrmap_put");
+        free(u);
+        return NULL;
+    }
+    u->pos = st->users.count;
+    if (pvec_push(&st->users, &st->arena, u) < 0) {
+        perror("pvec_push");
+        addrmap_del(&st->user_index, addr);
+        free(u);
+        return NULL;
+    }
+    return u;
+}
+
+void state_drop_user(struct server_state *st, struct user *u) {
+    addrmap_del(&st->user_index, &u->addr);
+    // the last user moves into the hole, like a membership does
+    pvec_del_at(&st->users, &st->arena, u->pos);
+    if (u->pos < st->users.count) {
+        struct user *moved = pvec_at(&st->users, u->pos);
+        moved->pos = u->pos;
+    }
+    pvec_free(&u->channels, &st->arena);
+    free(u);
+}
+
+struct neighbor *state_find_neighbor(struct server_state *st, const struct sockaddr_in *addr) {
+    return addrmap_get(&st->neighbor_index, addr);
+}
+
+struct channel *state_lookup_channel(struct server_state *st, const char *name) {
+    return namemap_get(&st->channel_index, name);
+}
+
+struct channel *state_get_channel(struct server_state *st, const char *name) {
+    struct channel *ch = state_lookup_channel(st, name);
+    if (ch != NULL) {
+        return ch;
+    }
+    ch = (struct channel *)slotmap_alloc(&st->channels, NULL);
+    if (ch == NULL) {
+        perror("slotmap_alloc");
+        return NULL;
+    }
+    strncpy(ch->name, name, CHANNEL_MAX - 1); // safe copy with null termination
+    ch->name[CHANNEL_MAX - 1] = '\0';
+    ch->local = 0;
+    ch->routed = 0;
+    pvec_init(&ch->users);
+    pvec_init(&ch->subscribed_neighbors);
+    pvec_init(&ch->joined_neighbors);
+    ch->join_repeats = 0;
+    ch->plan = NULL;
+    ch->plan_users = 0;
+    ch->plan_count = 0;
+    ch->plan_cap = 0;
+    ch->plan_stale = 1;
+    if (namemap_put(&st->channel_index, ch->name, ch) < 0) {
+        perror("namemap_put");
+        slotmap_free(&st->channels, ch);
+        return NULL;
+    }
+    return ch;
+}
+
+void state_release_channel(struct server_state *st, struct channel *ch) {
+    if (ch->local || ch->routed) {
+        return;
+    }
+    namemap_del(&st->channel_index, ch->name);
+    pvec_free(&ch->users, &st->arena);
+    pvec_free(&ch->subscribed_neighbors, &st->arena);
+    pvec_free(&ch->joined_neighbors, &st->arena);
+    arena_release(&st->arena, ch->plan, ch->plan_cap * sizeof(struct sockaddr_in));
+    slotmap_free(&st->channels, ch);
+}
+
+struct channel *state_find_channel(struct server_state *st, const char *name) {
+    struct channel *ch = state_lookup_channel(st, name);
+    return (ch != NULL && ch->local) ? ch : NULL;
+}
+
+struct channel *state_find_rt_entry(struct server_state *st, const char *name) {
+    struct channel *ch = state_lookup_channel(st, name);
+    return (ch != NULL && ch->routed) ? ch : NULL;
+}
+
+struct channel *state_add_rt_entry(struct server_state *st, const char *name) {
+    struct channel *rt = state_get_channel(st, name);
+    if (rt != NULL && !rt->routed) {
+        rt->routed = 1;
+    }
+    return rt;
+}
+
+void state_delete_channel(struct server_state *st, struct channel *ch) {
+    ch->local = 0;
+    pvec_free(&ch->users, &st->arena);
+    state_invalidate_plan(ch);
+    state_release_channel(st, ch);
+}
+
+void state_delete_rt_entry(struct server_state *st, struct channel *rt) {
+    rt->routed = 0;
+    pvec_free(&rt->subscribed_neighbors, &st->arena);
+    pvec_free(&rt->joined_neighbors, &st->arena);
+    state_invalidate_plan(rt);
+    state_release_channel(st, rt);
+}
+
+/*
+    only looks at the user's own channels, which is a short list
+*/
+struct membership *state_find_membership(struct server_state *st, struct user *u, struct channel *ch) {
+    slot_handle_t h = slotmap_handle(&st->channels, ch);
+    for (uint32_t i = 0; i < u->channels.count; i++) {
+        struct membership *m = pvec_at(&u->channels, i);
+        if (m->channel == h) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+int state_user_present(struct server_state *st, struct user *u, struct channel *ch) {
+    return state_find_membership(st, u, ch) != NULL;
+}
+
+int state_add_user(struct server_state *st, struct user *u, struct channel *ch) {
+    struct membership *m = arena_alloc(&st->arena, sizeof(struct membership));
+    if (m == NULL) {
+        perror("arena_alloc");
+        return -1;
+    }
+    m->user = u;
+    m->channel = slotmap_handle(&st->channels, ch);
+    m->user_pos = u->channels.count;
+    m->channel_pos = ch->users.count;
+
+    if (pvec_push(&u->channels, &st->arena, m) < 0) {
+        perror("pvec_push");
+        arena_release(&st->arena, m, sizeof(struct membership));
+        return -1;
+    }
+    if (pvec_push(&ch->users, &st->arena, m) < 0) {
+        perror("pvec_push");
+        pvec_del_at(&u->channels, &st->arena, m->user_pos);
+        arena_release(&st->arena, m, sizeof(struct membership));
+        return -1;
+    }
+    state_invalidate_plan(ch);
+    return 0;
+}
+
+void state_remove_user(struct server_state *st, struct membership *m, struct channel *ch) {
+    struct user *u = m->user;
+
+    // both lists move their last entry into the hole, so fix up its index
+    pvec_del_at(&ch->users, &st->arena, m->channel_pos);
+    if (m->channel_pos < ch->users.count) {
+        struct membership *moved = pvec_at(&ch->users, m->channel_pos);
+        moved->channel_pos = m->channel_pos;
+    }
+    pvec_del_at(&u->channels, &st->arena, m->user_pos);
+    if (m->user_pos < u->channels.count) {
+        struct membership *moved = pvec_at(&u->channels, m->user_pos);
+        moved->user_pos = m->user_pos;
+    }
+    arena_release(&st->arena, m, sizeof(struct membership));
+    state_invalidate_plan(ch);
+}
+
+/*
+    only looks at the channel's own neighbors, which is a short list
+*/
+struct route *state_find_route(struct pvec *routes, struct neighbor *nbr) {
+    for (uint32_t i = 0; i < routes->count; i++) {
+        struct route *r = pvec_at(routes, i);
+        if (r->nbr == nbr) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+int state_add_route(struct server_state *st, struct channel *ch, struct pvec *routes, struct neighbor *nbr, struct pvec *list) {
+    struct route *r = arena_alloc(&st->arena, sizeof(struct route));
+    if (r == NULL) {
+        perror("arena_alloc");
+        return -1;
+    }
+    r->nbr = nbr;
+    r->channel = slotmap_handle(&st->channels, ch);
+    r->list = list;
+    r->neighbor_pos = list->count;
+    r->channel_pos = routes->count;
+
+    if (pvec_push(list, &st->arena, r) < 0) {
+        perror("pvec_push");
+        arena_release(&st->arena, r, sizeof(struct route));
+        return -1;
+    }
+    if (pvec_push(routes, &st->arena, r) < 0) {
+        perror("pvec_push");
+        pvec_del_at(list, &st->arena, r->neighbor_pos);
+        arena_release(&st->arena, r, sizeof(struct route));
+        return -1;
+    }
+    if (routes == &ch->subscribed_neighbors) {
+        state_invalidate_plan(ch); // the plan's neighbors
+    }
+    return 0;
+}
+
+void state_remove_route(struct server_state *st, struct channel *ch, struct pvec *routes, struct route *r) {
+    // both lists move their last entry into the hole, so fix up its index
+    pvec_del_at(routes, &st->arena, r->channel_pos);
+    if (r->channel_pos < routes->count) {
+        struct route *moved = pvec_at(routes, r->channel_pos);
+        moved->channel_pos = r->channel_pos;
+    }
+    pvec_del_at(r->list, &st->arena, r->neighbor_pos);
+    if (r->neighbor_pos < r->list->count) {
+        struct route *moved = pvec_at(r->list, r->neighbor_pos);
+        moved->neighbor_pos = r->neighbor_pos;
+    }
+    arena_release(&st->arena, r, sizeof(struct route));
+    if (routes == &ch->subscribed_neighbors) {
+        state_invalidate_plan(ch);
+    }
+}
+
+int state_refresh_plan(struct server_state *st, struct channel *ch) {
+    if (!ch->plan_stale) {
+        return 0;
+    }
+    uint32_t need = ch->users.count + ch->subscribed_neighbors.count;
+    if (need > ch->plan_cap || need * 4 < ch->plan_cap) {
+        // size it to the arena block so small changes don't reallocate
+        uint32_t cap = arena_block_size(need * sizeof(struct sockaddr_in)) / sizeof(struct sockaddr_in);
+        struct sockaddr_in *plan = NULL;
+        if (need > 0) {
+            plan = arena_alloc(&st->arena, cap * sizeof(struct sockaddr_in));
+            if (plan == NULL) {
+                perror("arena_alloc");
+                return -1;
+            }
+        } else {
+            cap = 0;
+        }
+        arena_release(&st->arena, ch->plan, ch->plan_cap * sizeof(struct sockaddr_in));
+        ch->plan = plan;
+        ch->plan_cap = cap;
+    }
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < ch->users.count; i++) {
+        struct membership *m = pvec_at(&ch->users, i);
+        ch->plan[n++] = m->user->addr;
+    }
+    ch->plan_users = n;
+    for (uint32_t i = 0; i < ch->subscribed_neighbors.count; i++) {
+        struct route *r = pvec_at(&ch->subscribed_neighbors, i);
+        ch->plan[n++] = r->nbr->addr;
+    }
+    ch->plan_count = n;
+    ch->plan_stale = 0;
+    st->plan_builds++;
+    return 0;
+}
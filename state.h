@@ -0,0 +1,176 @@
+#ifndef STATE_H
+#define STATE_H
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "duckchat.h"
+#include "addrmap.h"
+#include "namemap.h"
+#include "arena.h"
+#include "vec.h"
+#include "slotmap.h"
+#include "dedup.h"
+#include "wheel.h"
+/* The server's users, channels and neighbors, and the indexes over them.
+*
+* These are the lookups and list edits behind every request. They only
+* touch memory: nothing here sends, logs or reads the clock, so the same
+* code runs inside a server worker and inside duckbench. Allocation
+* failures are reported with perror() and returned to the caller.
+*
+* A struct server_state belongs to one thread. */
+
+struct user {
+    char username[USERNAME_MAX];
+    struct sockaddr_in addr;
+    struct pvec channels; // struct membership *, the channels this user is in
+    uint32_t pos;         // index in server_state.users
+};
+
+/*
+    one record per channel name. covers both the local members (the channel
+    as users see it) and the neighbors subscribed to it (the routing table
+    entry), so a single lookup answers both sides
+*/
+struct channel {
+    char name[CHANNEL_MAX];
+    int local;  // joined by local users, shows up in LIST
+    int routed; // has a routing table entry
+    struct pvec users;                // struct membership *
+    struct pvec subscribed_neighbors; // struct route *, sent us a join: says go to them
+    struct pvec joined_neighbors;     // struct route *, we sent a join: says come from them
+    int join_repeats;                 // hello rounds left that send its joins again
+
+    /*
+        fan-out plan: every destination address packed into one array, the
+        local members first and then the subscribed neighbors. rebuilt on the
+        next send after any membership change, so a busy channel pays for the
+        walk over its lists once rather than once per message
+    */
+    struct sockaddr_in *plan;
+    uint32_t plan_users;     // plan[0, plan_users) are local members
+    uint32_t plan_count;     // plan[plan_users, plan_count) are neighbors
+    uint32_t plan_cap;       // entries allocated
+    int plan_stale;          // membership changed since the last build
+};
+
+/*
+    a user's membership in a channel. the same record sits in the channel's
+    member list and in the user's channel list and remembers its index in
+    both, so either side can drop it without searching
+*/
+struct membership {
+    struct user *user;
+    slot_handle_t channel;
+    uint32_t user_pos;    // index in user->channels
+    uint32_t channel_pos; // index in channel->users
+};
+
+/*
+    a neighbor on a channel's routing entry, subscribed to it with us or
+    joined by us. like a membership, the same record sits in the channel's
+    list and in one of the neighbor's and remembers its index in both, so
+    a neighbor's channels can be walked without looking at any others
+*/
+struct route {
+    struct neighbor *nbr;
+    slot_handle_t channel;
+    struct pvec *list;     // the neighbor's list it is on
+    uint32_t neighbor_pos; // index in *list
+    uint32_t channel_pos;  // index in the channel's list
+};
+
+struct neighbor {
+    struct sockaddr_in addr;
+    int active;
+    time_t last_active; // timestamp last seen active
+    struct wheel_timer expiry; // fires NEIGHBOR_TIMEOUT after last_active
+    void *owner;               // the engine whose timers it is on
+
+    // its place in the spanning tree, from its last S2S_HELLO
+    uint64_t id;               // its address as one number
+    uint64_t hello_root;
+    uint32_t hello_cost;
+    uint64_t hello_parent;
+    uint64_t hello_ms;         // when that hello arrived
+    int heard;                 // there has been a hello at all
+    uint32_t probe_stamp;      // that hello's stamp, echoed in ours
+    uint64_t probe_us;         // when it arrived, for the time we held it
+    uint32_t srtt;             // smoothed round trip in us, 0 until measured
+    uint32_t shards;           // engines its channels are split between, the sums its digests take
+    struct wheel_timer digest_timer; // our next digest to it
+    uint32_t digest_ms;        // and the interval, shorter while the link is unsettled
+    int unsettled;             // a loss or a change of channels on the link since the last one
+    uint32_t *joined_sums;     // XOR of the hashes we joined through it, S2S_DIGEST_BUCKETS for each of its shards
+    uint32_t *subscribed_sums; // and of those it subscribed to with us, the same way. NULL until its first hello
+    struct pvec joined[S2S_DIGEST_BUCKETS];     // struct route *, the channels we joined through it, by digest bucket
+    struct pvec subscribed[S2S_DIGEST_BUCKETS]; // struct route *, the ones it subscribed to with us
+    struct s2s_join_bulk *joins; // joins queued for it, NULL until the first
+    int tree;                  // our parent or our child, the only links channels use
+};
+
+struct server_state {
+    struct slotmap channels;       // every channel record, local or routed
+    struct pvec users;             // struct user *
+    struct pvec neighbors;         // struct neighbor *
+    struct dedup recent_ids;       // S2S say ids seen recently, for loop detection
+    struct addrmap user_index;     // ip:port -> struct user *
+    struct addrmap neighbor_index; // ip:port -> struct neighbor *
+    struct namemap channel_index;  // name -> struct channel *
+    struct arena arena;            // backs the membership lists once they outgrow their inline room
+    uint64_t plan_builds;          // fan-out plans rebuilt after a membership change
+};
+
+/* Returns -1 if the dedup window could not be allocated, 0 on success */
+int state_init(struct server_state *st, long dedup_window, long dedup_expiry);
+/* Frees every user and channel record. Neighbors are only unlinked; their
+* memory (and any pending timers) belongs to whoever created them. */
+void state_free(struct server_state *st);
+
+/* Users, keyed on ip:port. state_new_user() returns NULL if the indexes
+* could not grow; state_drop_user() expects the user to have left every
+* channel already. */
+struct user *state_find_user(struct server_state *st, const struct sockaddr_in *addr);
+struct user *state_new_user(struct server_state *st, const char *username, const struct sockaddr_in *addr);
+void state_drop_user(struct server_state *st, struct user *u);
+struct neighbor *state_find_neighbor(struct server_state *st, const struct sockaddr_in *addr);
+
+/* The record for a name whether it is local, routed or both */
+struct channel *state_lookup_channel(struct server_state *st, const char *name);
+/* The same, creating an empty record if there is none. NULL on failure. */
+struct channel *state_get_channel(struct server_state *st, const char *name);
+/* Frees the record once it is neither local nor routed */
+void state_release_channel(struct server_state *st, struct channel *ch);
+/* Only channels with local members */
+struct channel *state_find_channel(struct server_state *st, const char *name);
+/* Only channels with a routing table entry */
+struct channel *state_find_rt_entry(struct server_state *st, const char *name);
+struct channel *state_add_rt_entry(struct server_state *st, const char *name);
+/* Drop the local side (members) or the routed side (both neighbor lists)
+* of a channel, freeing the record if nothing else holds it */
+void state_delete_channel(struct server_state *st, struct channel *ch);
+void state_delete_rt_entry(struct server_state *st, struct channel *rt);
+
+struct membership *state_find_membership(struct server_state *st, struct user *u, struct channel *ch);
+int state_user_present(struct server_state *st, struct user *u, struct channel *ch);
+/* Returns -1 if either list could not grow, 0 on success */
+int state_add_user(struct server_state *st, struct user *u, struct channel *ch);
+/* The caller decides whether an empty channel gets deleted */
+void state_remove_user(struct server_state *st, struct membership *m, struct channel *ch);
+
+/* Routes: a channel's subscribed_neighbors or joined_neighbors on one side,
+* and on the other the neighbor's list for it, which the caller picks.
+* state_add_route() returns -1 if either list could not grow, 0 on success.
+* The caller decides whether an empty routing entry gets deleted. */
+struct route *state_find_route(struct pvec *routes, struct neighbor *nbr);
+int state_add_route(struct server_state *st, struct channel *ch, struct pvec *routes, struct neighbor *nbr, struct pvec *list);
+void state_remove_route(struct server_state *st, struct channel *ch, struct pvec *routes, struct route *r);
+
+/* Marks a channel's fan-out plan out of date. Called on every change to
+* its member or neighbor lists. */
+static inline void state_invalidate_plan(struct channel *ch) {
+    ch->plan_stale = 1;
+}
+/* Rebuilds a stale plan. Returns -1 if it could not grow, leaving it stale */
+int state_refresh_plan(struct server_state *st, struct channel *ch);
+#endif
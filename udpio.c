@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include "udpio.h"
+/* See udpio.h for usage information */
+
+int udp_batch_init(struct udp_batch *b, unsigned size) {
+    memset(b, 0, sizeof(*b));
+    b->msgs = calloc(size, sizeof(struct mmsghdr));
+    b->iov = calloc(size, sizeof(struct iovec));
+    b->addrs = calloc(size, sizeof(struct sockaddr_in));
+    b->bufs = malloc((size_t)size * UDP_MAX_DGRAM);
+    if (b->msgs == NULL || b->iov == NULL || b->addrs == NULL || b->bufs == NULL) {
+        udp_batch_free(b);
+        return -1;
+    }
+    b->size = size;
+    for (unsigned i = 0; i < size; i++) {
+        b->iov[i].iov_base = udp_batch_buf(b, i);
+        b->iov[i].iov_len = UDP_MAX_DGRAM;
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+        b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+    }
+    return 0;
+}
+
+void udp_batch_free(struct udp_batch *b) {
+    free(b->msgs);
+    free(b->iov);
+    free(b->addrs);
+    free(b->bufs);
+    memset(b, 0, sizeof(*b));
+}
+
+int udp_recv_batch(int fd, struct udp_batch *b) {
+    // the kernel overwrites these on every receive
+    for (unsigned i = 0; i < b->size; i++) {
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    int n = recvmmsg(fd, b->msgs, b->size, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+        b->count = 0;
+        return -1;
+    }
+    b->count = n;
+    b->calls++;
+    b->datagrams += n;
+    return n;
+}
+
+int udp_fanout_init(struct udp_fanout *f, int fd) {
+    memset(f, 0, sizeof(*f));
+    f->fd = fd;
+    f->msgs = calloc(UDP_FANOUT_MAX, sizeof(struct mmsghdr));
+    if (f->msgs == NULL) {
+        return -1;
+    }
+    for (unsigned i = 0; i < UDP_FANOUT_MAX; i++) {
+        f->msgs[i].msg_hdr.msg_iov = &f->iov;
+        f->msgs[i].msg_hdr.msg_iovlen = 1;
+        f->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    return 0;
+}
+
+void udp_fanout_free(struct udp_fanout *f) {
+    free(f->msgs);
+    memset(f, 0, sizeof(*f));
+}
+
+void udp_fanout_begin(struct udp_fanout *f, const void *payload, size_t len) {
+    if (f->count > 0) {
+        udp_fanout_flush(f);
+    }
+    f->iov.iov_base = (void *)payload;
+    f->iov.iov_len = len;
+    f->total = 0;
+}
+
+void udp_fanout_add(struct udp_fanout *f, const struct sockaddr_in *addr) {
+    f->msgs[f->count++].msg_hdr.msg_name = (void *)addr;
+    f->total++;
+    if (f->count == UDP_FANOUT_MAX) {
+        udp_fanout_flush(f);
+    }
+}
+
+void udp_fanout_add_many(struct udp_fanout *f, const struct sockaddr_in *addrs, unsigned n) {
+    while (n > 0) {
+        unsigned room = UDP_FANOUT_MAX - f->count;
+        unsigned take = n < room ? n : room;
+        struct mmsghdr *m = f->msgs + f->count;
+        for (unsigned i = 0; i < take; i++) {
+            m[i].msg_hdr.msg_name = (void *)&addrs[i];
+        }
+        f->count += take;
+        f->total += take;
+        addrs += take;
+        n -= take;
+        if (f->count == UDP_FANOUT_MAX) {
+            udp_fanout_flush(f);
+        }
+    }
+}
+
+int udp_fanout_flush(struct udp_fanout *f) {
+    unsigned sent = 0;
+    int failed = 0;
+    while (sent < f->count) {
+        int n = sendmmsg(f->fd, f->msgs + sent, f->count - sent, 0);
+        f->calls++;
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // sendmmsg() only fails outright when the first message does,
+            // so that destination is the one to skip
+            perror("sendmmsg");
+            f->errors++;
+            failed++;
+            sent++;
+            continue;
+        }
+        f->datagrams += n;
+        sent += n;
+    }
+    f->count = 0;
+    return failed;
+}
@@ -0,0 +1,75 @@
+#ifndef UDPIO_H
+#define UDPIO_H
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+/* Batched datagram I/O on top of recvmmsg(2) and sendmmsg(2). Needs
+* _GNU_SOURCE, which the Makefile defines for everything.
+*
+* A batch owns a preallocated buffer, address and header for each of its
+* slots, set up once. udp_recv_batch() blocks until at least one datagram
+* is waiting and then fills as many slots as the kernel has ready in the
+* same syscall.
+*
+* A fanout sends one payload to many destinations. Every header points at
+* the same iovec, so the payload is never copied, and the destinations go
+* out UDP_FANOUT_MAX at a time. The payload and the addresses are not
+* copied either: they must stay valid until udp_fanout_flush() returns. */
+#define UDP_MAX_DGRAM 1024 /* anything longer is truncated */
+
+struct udp_batch {
+    unsigned size;            /* number of slots */
+    unsigned count;           /* slots filled by the last receive */
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    struct sockaddr_in *addrs;
+    char *bufs;               /* size * UDP_MAX_DGRAM bytes */
+
+    /* counters for reporting */
+    uint64_t calls;
+    uint64_t datagrams;
+};
+
+#define UDP_FANOUT_MAX 1024 /* UIO_MAXIOV, the most sendmmsg() takes */
+
+struct udp_fanout {
+    int fd;
+    unsigned count;           /* destinations queued */
+    unsigned total;           /* destinations added since udp_fanout_begin() */
+    struct mmsghdr *msgs;
+    struct iovec iov;         /* the shared payload */
+
+    /* counters for reporting */
+    uint64_t calls;
+    uint64_t datagrams;
+    uint64_t errors;          /* destinations that could not be sent to */
+};
+
+/* Returns -1 if the memory could not be allocated, 0 on success */
+int udp_batch_init(struct udp_batch *b, unsigned size);
+void udp_batch_free(struct udp_batch *b);
+/* Returns the number of datagrams received, or -1 with errno set */
+int udp_recv_batch(int fd, struct udp_batch *b);
+
+/* Returns -1 if the memory could not be allocated, 0 on success */
+int udp_fanout_init(struct udp_fanout *f, int fd);
+void udp_fanout_free(struct udp_fanout *f);
+/* Starts a new fanout of payload. Anything still queued is flushed first. */
+void udp_fanout_begin(struct udp_fanout *f, const void *payload, size_t len);
+/* Queues a destination, sending the queue once it is full */
+void udp_fanout_add(struct udp_fanout *f, const struct sockaddr_in *addr);
+/* Queues n destinations packed in one array */
+void udp_fanout_add_many(struct udp_fanout *f, const struct sockaddr_in *addrs, unsigned n);
+/* Sends whatever is queued. A destination that fails is reported with
+* perror() and skipped; the rest still go out. Returns the number of
+* destinations that failed. */
+int udp_fanout_flush(struct udp_fanout *f);
+
+static inline char *udp_batch_buf(struct udp_batch *b, unsigned i) {
+    return b->bufs + (size_t)i * UDP_MAX_DGRAM;
+}
+
+static inline int udp_batch_len(struct udp_batch *b, unsigned i) {
+    return b->msgs[i].msg_len;
+}
+#endif
@@ -0,0 +1,84 @@
+#include <string.h>
+#include "vec.h"
+/* See vec.h for usage information */
+
+void pvec_init(struct pvec *v) {
+    v->count = 0;
+    v->cap = PVEC_INLINE;
+}
+
+void pvec_free(struct pvec *v, struct arena *a) {
+    if (v->cap > PVEC_INLINE) {
+        arena_release(a, v->u.heap, v->cap * sizeof(void *));
+    }
+    pvec_init(v);
+}
+
+/* move the entries into storage for new_cap slots */
+static int resize(struct pvec *v, struct arena *a, uint32_t new_cap) {
+    void **old = pvec_items(v);
+    void **items;
+    if (new_cap <= PVEC_INLINE) {
+        new_cap = PVEC_INLINE;
+        items = v->u.inl;
+        if (old == items) {
+            return 0;
+        }
+        // copy out first, the inline slots overlap the heap pointer
+        void *tmp[PVEC_INLINE];
+        memcpy(tmp, old, v->count * sizeof(void *));
+        arena_release(a, old, v->cap * sizeof(void *));
+        memcpy(items, tmp, v->count * sizeof(void *));
+        v->cap = new_cap;
+        return 0;
+    }
+
+    items = arena_alloc(a, new_cap * sizeof(void *));
+    if (items == NULL) {
+        return -1;
+    }
+    memcpy(items, old, v->count * sizeof(void *));
+    if (v->cap > PVEC_INLINE) {
+        arena_release(a, old, v->cap * sizeof(void *));
+    }
+    v->u.heap = items;
+    v->cap = new_cap;
+    return 0;
+}
+
+int pvec_push(struct pvec *v, struct arena *a, void *item) {
+    if (v->count == v->cap && resize(v, a, v->cap * 2) < 0) {
+        return -1;
+    }
+    pvec_items(v)[v->count++] = item;
+    return 0;
+}
+
+void pvec_del_at(struct pvec *v, struct arena *a, uint32_t i) {
+    void **items = pvec_items(v);
+    items[i] = items[--v->count];
+
+    // give memory back once the list is down to a quarter of its room
+    if (v->cap > PVEC_INLINE && v->count <= v->cap / 4) {
+        resize(v, a, v->cap / 2);
+    }
+}
+
+int pvec_del(struct pvec *v, struct arena *a, void *item) {
+    int i = pvec_find(v, item);
+    if (i < 0) {
+        return 0;
+    }
+    pvec_del_at(v, a, i);
+    return 1;
+}
+
+int pvec_find(struct pvec *v, void *item) {
+    void **items = pvec_items(v);
+    for (uint32_t i = 0; i < v->count; i++) {
+        if (items[i] == item) {
+            return i;
+        }
+    }
+    return -1;
+}
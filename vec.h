@@ -0,0 +1,40 @@
+#ifndef VEC_H
+#define VEC_H
+#include <stdint.h>
+#include "arena.h"
+/* A growable list of pointers. The first PVEC_INLINE entries live inside
+* the struct itself, which covers most channel membership lists without
+* any allocation. Longer lists spill into a block from an arena and move
+* back inline once they shrink again, so memory follows the actual size.
+*
+* Entries are unordered: removal moves the last entry into the hole. */
+#define PVEC_INLINE 4
+
+struct pvec {
+    uint32_t count;
+    uint32_t cap; /* PVEC_INLINE while inline */
+    union {
+        void *inl[PVEC_INLINE];
+        void **heap;
+    } u;
+};
+
+static inline void **pvec_items(struct pvec *v) {
+    return v->cap > PVEC_INLINE ? v->u.heap : v->u.inl;
+}
+
+static inline void *pvec_at(struct pvec *v, uint32_t i) {
+    return pvec_items(v)[i];
+}
+
+void pvec_init(struct pvec *v);
+/* Releases the spilled block, if any. The list is left empty. */
+void pvec_free(struct pvec *v, struct arena *a);
+/* Returns -1 if the list could not grow, 0 on success */
+int pvec_push(struct pvec *v, struct arena *a, void *item);
+void pvec_del_at(struct pvec *v, struct arena *a, uint32_t i);
+/* Removes the first entry equal to item. Returns 1 if it was found. */
+int pvec_del(struct pvec *v, struct arena *a, void *item);
+/* Returns the index of item, or -1 */
+int pvec_find(struct pvec *v, void *item);
+#endif
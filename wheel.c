@@ -0,0 +1,118 @@
+#include <stddef.h>
+#include "wheel.h"
+/* See wheel.h for usage information */
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+static void list_init(struct wheel_timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(struct wheel_timer *head, struct wheel_timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void wheel_init(struct wheel *w, uint64_t now) {
+    w->now = now;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int s = 0; s < WHEEL_SLOTS; s++) {
+            list_init(&w->slots[l][s]);
+        }
+    }
+    w->fired = 0;
+    w->cascaded = 0;
+}
+
+void wheel_timer_init(struct wheel_timer *t, void (*fn)(void *arg), void *arg) {
+    t->next = NULL;
+    t->prev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/* files t under the level whose span covers how far off it is. earliest
+* is the first tick whose slot hasn't been processed yet */
+static void place(struct wheel *w, struct wheel_timer *t, uint64_t earliest) {
+    uint64_t at = t->expires;
+    if (at < earliest) {
+        at = earliest; // overdue
+    } else if (at - w->now >= WHEEL_SPAN) {
+        at = w->now + WHEEL_SPAN - 1; // too far out, parked in the top level until then
+    }
+    uint64_t delta = at - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    list_append(&w->slots[level][(at >> (WHEEL_BITS * level)) & WHEEL_MASK], t);
+}
+
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t expires) {
+    wheel_del(t);
+    t->expires = expires;
+    place(w, t, w->now + 1);
+}
+
+void wheel_del(struct wheel_timer *t) {
+    if (t->next == NULL) {
+        return;
+    }
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/* moves a slot's timers onto a private list, so callbacks can touch the slot */
+static void take_slot(struct wheel_timer *slot, struct wheel_timer *list) {
+    list_init(list);
+    if (slot->next == slot) {
+        return;
+    }
+    list->next = slot->next;
+    list->prev = slot->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    list_init(slot);
+}
+
+/* re-files the timers of the upper level slot that the current tick has reached */
+static void cascade(struct wheel *w, int level) {
+    struct wheel_timer list;
+    take_slot(&w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK], &list);
+    while (list.next != &list) {
+        struct wheel_timer *t = list.next;
+        wheel_del(t);
+        place(w, t, w->now); // this tick's level 0 slot is still to come
+        w->cascaded++;
+    }
+}
+
+void wheel_advance(struct wheel *w, uint64_t now) {
+    while (w->now < now) {
+        w->now++;
+
+        // each level wraps when every level below it has
+        for (int l = 1; l < WHEEL_LEVELS; l++) {
+            if ((w->now & ((1ULL << (WHEEL_BITS * l)) - 1)) != 0) {
+                break;
+            }
+            cascade(w, l);
+        }
+
+        struct wheel_timer list;
+        take_slot(&w->slots[0][w->now & WHEEL_MASK], &list);
+        while (list.next != &list) {
+            struct wheel_timer *t = list.next;
+            wheel_del(t);
+            w->fired++;
+            t->fn(t->arg);
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+#include <stdint.h>
+/* A hierarchical timing wheel. Time is counted in ticks, whatever length
+* the caller picks. Level 0 has one slot per tick for the next
+* WHEEL_SLOTS ticks, and every level above covers WHEEL_SLOTS times the
+* span of the one below with the same number of slots. Adding or removing
+* a timer is O(1). A timer in an upper level is moved down ("cascaded")
+* once, when the level below wraps around to its slot.
+*
+* Timers are embedded in the records they time, so the wheel never
+* allocates. A timer fires at most once per wheel_add(); its callback may
+* add it again, or add and delete any other timer. */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* spans WHEEL_SLOTS^4 ticks, longer timers are re-cascaded */
+
+struct wheel_timer {
+    struct wheel_timer *next; /* NULL when not pending */
+    struct wheel_timer *prev;
+    uint64_t expires;         /* tick it fires at */
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+struct wheel {
+    uint64_t now;             /* last tick processed */
+    struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; /* list heads */
+
+    /* counters for reporting */
+    uint64_t fired;
+    uint64_t cascaded;
+};
+
+void wheel_init(struct wheel *w, uint64_t now);
+void wheel_timer_init(struct wheel_timer *t, void (*fn)(void *arg), void *arg);
+/* (Re)schedules t for tick expires. A tick that has already passed fires
+* on the next wheel_advance(). */
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t expires);
+/* Cancels t if it is pending */
+void wheel_del(struct wheel_timer *t);
+/* Processes every tick up to and including now, firing what expires */
+void wheel_advance(struct wheel *w, uint64_t now);
+
+static inline int wheel_pending(const struct wheel_timer *t) {
+    return t->next != NULL;
+}
+#endif